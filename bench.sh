@@ -0,0 +1,100 @@
+#!/bin/sh
+# benchmark the raytracer on generated scenes.
+# each run prints one json line: the scene kind, size and thread count,
+# its speedup over the first thread count and that speedup per thread
+# added, then the --timings report from the raytracer (phases, rays/s,
+# ns/ray, peak rss, and each thread's busy and idle seconds).
+#
+# environment:
+#   BENCH_SIZES    object counts to generate         (default "100 1000 10000")
+#   BENCH_RES      image resolution as WxH           (default 640x480)
+#   BENCH_THREADS  thread counts, each passed to -j, 0 renders serially
+#                  (default 0), e.g. "1 2 4 8 16 32 64 128" for scaling
+#   BENCH_KINDS    spheres rects mixed shadow texture (default all)
+#   BENCH_FLAGS    extra raytracer flags, e.g. --linear or --pin
+#   RAYTRACER      binary to run                     (default ./raytracer)
+
+RAYTRACER=${RAYTRACER:-./raytracer}
+SIZES=${BENCH_SIZES:-"100 1000 10000"}
+RES=${BENCH_RES:-640x480}
+THREADS=${BENCH_THREADS:-0}
+KINDS=${BENCH_KINDS:-"spheres rects mixed shadow texture"}
+
+W=${RES%x*}
+H=${RES#*x}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# gen kind n: write a deterministic scene of n objects to stdout
+gen()
+{
+  awk -v kind="$1" -v n="$2" -v w="$W" -v h="$H" 'BEGIN {
+    srand(1);
+    printf "ENV -3.3 %d %d\n", w, h;
+    if (kind == "texture")
+      print "BGFN sunset";
+    else
+      print "BG 0.8 0.8 0.8";
+    print "AMB 0.2 0.2 0.2";
+    print "DL -1 1 -1 1 1 1";
+    # spread objects over a box that grows with n so density stays similar
+    s = 2 + sqrt(n) / 4;
+    for (i = 0; i < n; i++) {
+      x = (rand() * 2 - 1) * s;
+      y = (rand() * 2 - 1) * s * h / w;
+      z = 4 + rand() * s * 2;
+      r = 0.05 + rand() * 0.3;
+      rect = kind == "rects" || (kind == "mixed" && i % 2);
+      if (kind == "shadow" && i % 4 == 0) {
+        # large slabs near the light that shadow much of the scene
+        printf "RECTANGLE %f %f %f %f %f 0.5 0.5 0.5 0 0 0\n",
+               x, y, z - 2, r * 8, r * 8;
+      } else if (rect) {
+        printf "RECTANGLE %f %f %f %f %f %f %f %f 0.2 0.2 0.2\n",
+               x, y, z, r * 2, r * 2, rand(), rand(), rand();
+      } else if (kind == "texture") {
+        printf "SPHEREFN %f %f %f %f %s 0.8 0.8 0.8\n",
+               x, y, z, r, i % 2 ? "fn1" : "fn2";
+      } else {
+        printf "SPHERE %f %f %f %f %f %f %f 0.5 0.5 0.5\n",
+               x, y, z, r, rand(), rand(), rand();
+      }
+    }
+  }'
+}
+
+if [ ! -x "$RAYTRACER" ]; then
+  echo "bench: $RAYTRACER not found, run make first" >&2
+  exit 1
+fi
+
+for kind in $KINDS; do
+  for n in $SIZES; do
+    gen "$kind" "$n" > "$TMP/scene.txt"
+    base=
+    for t in $THREADS; do
+      JOBS=
+      if [ "$t" -gt 0 ]; then
+        JOBS="-j $t"
+      fi
+      line=$("$RAYTRACER" --timings $JOBS $BENCH_FLAGS < "$TMP/scene.txt" \
+               2>&1 > /dev/null | grep '^{')
+      if [ -z "$line" ]; then
+        echo "bench: $kind $n -j $t failed" >&2
+        exit 1
+      fi
+      render=$(printf '%s\n' "$line" | sed 's/.*"render_s":\([0-9.]*\).*/\1/')
+      if [ -z "$base" ]; then
+        base=$render
+        base_t=$t
+      fi
+      # scaling is 1 when k times the threads render in 1/k of the time
+      scaling=$(awk -v b="$base" -v r="$render" -v bt="$base_t" -v t="$t" \
+        'BEGIN { bt = bt > 0 ? bt : 1; t = t > 0 ? t : 1;
+                 s = r > 0 ? b / r : 0;
+                 printf "\"speedup\":%.3f,\"scaling\":%.3f", s, s * bt / t }')
+      printf '{"scene":"%s","n":%d,%s,%s\n' "$kind" "$n" "$scaling" \
+        "${line#\{}"
+    done
+  done
+done
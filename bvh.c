@@ -0,0 +1,502 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+#include "stats.h"
+
+/* bounding volume hierarchy over a compiled scene, built once with a
+ * binned surface-area heuristic and shared read-only by every worker */
+
+#define BVH_BINS      16
+#define BVH_MAX_LEAF  8   /* never split a node this small if SAH says no */
+#define BVH_MAX_DEPTH 48  /* past this depth nodes are split at the median */
+#define BVH_STACK     128
+
+typedef struct {
+  double lo[3];
+  double hi[3];
+} aabb;
+
+/* nodes are laid out depth-first: an interior node's left child follows it
+ * directly. bvh_build reorders the compiled scene so each leaf covers one
+ * contiguous run of spheres and one of rectangles */
+typedef struct {
+  aabb box;
+  uint right;      /* interior nodes: index of the right child */
+  uint sph_first;  /* leaves: spheres [sph_first, sph_first + nsph) */
+  uint rect_first; /* leaves: rectangles [rect_first, rect_first + nrect) */
+  unsigned short nsph;
+  unsigned short nrect;
+} bvh_node;
+
+#define IS_LEAF(n) ((n)->nsph + (n)->nrect > 0)
+
+struct bvh {
+  bvh_node *nodes;
+  uint      nnodes;
+  int       owned;  /* 0 when the nodes live in a scene cache mapping */
+};
+
+typedef struct {
+  aabb box;
+  double c[3]; /* centroid */
+  uint prim;
+} build_prim;
+
+static void aabb_empty(aabb *b)
+{
+  for (int a = 0; a < 3; a++) {
+    b->lo[a] = INFINITY;
+    b->hi[a] = -INFINITY;
+  }
+}
+
+static void aabb_grow(aabb *b, aabb *o)
+{
+  for (int a = 0; a < 3; a++) {
+    if (o->lo[a] < b->lo[a]) b->lo[a] = o->lo[a];
+    if (o->hi[a] > b->hi[a]) b->hi[a] = o->hi[a];
+  }
+}
+
+static double aabb_area(aabb *b)
+{
+  double dx = b->hi[0] - b->lo[0];
+  double dy = b->hi[1] - b->lo[1];
+  double dz = b->hi[2] - b->lo[2];
+  if (dx < 0 || dy < 0 || dz < 0)
+    return 0;
+  return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+/* bounds are padded slightly so the box test never rejects a ray that the
+ * exact primitive test would accept */
+static void prim_bounds(compiled_scene *cs, uint prim, aabb *b)
+{
+  if (prim < cs->nspheres) {
+    double c[3] = { cs->sph_cx[prim], cs->sph_cy[prim], cs->sph_cz[prim] };
+    for (int a = 0; a < 3; a++) {
+      b->lo[a] = c[a] - cs->sph_r[prim];
+      b->hi[a] = c[a] + cs->sph_r[prim];
+    }
+  } else {
+    uint i = prim - cs->nspheres;
+    b->lo[0] = cs->rect_x0[i];
+    b->hi[0] = cs->rect_x1[i];
+    b->lo[1] = cs->rect_y0[i];
+    b->hi[1] = cs->rect_y1[i];
+    b->lo[2] = b->hi[2] = cs->rect_z[i];
+  }
+  for (int a = 0; a < 3; a++) {
+    double pad = 1e-7 * (1 + fmax(fabs(b->lo[a]), fabs(b->hi[a])));
+    b->lo[a] -= pad;
+    b->hi[a] += pad;
+  }
+}
+
+typedef struct {
+  build_prim *prims;
+  bvh_node   *nodes;
+  uint        nnodes;
+} builder;
+
+/* pick a split for prims[begin,end) and partition them around it; returns
+ * the index of the first primitive on the right, or begin for a leaf */
+static uint sah_split(builder *b, uint begin, uint end, aabb *box, uint depth)
+{
+  uint n = end - begin;
+  aabb cb;
+  aabb_empty(&cb);
+  for (uint i = begin; i < end; i++) {
+    for (int a = 0; a < 3; a++) {
+      if (b->prims[i].c[a] < cb.lo[a]) cb.lo[a] = b->prims[i].c[a];
+      if (b->prims[i].c[a] > cb.hi[a]) cb.hi[a] = b->prims[i].c[a];
+    }
+  }
+  int axis = 0;
+  for (int a = 1; a < 3; a++) {
+    if (cb.hi[a] - cb.lo[a] > cb.hi[axis] - cb.lo[axis])
+      axis = a;
+  }
+  double extent = cb.hi[axis] - cb.lo[axis];
+  if (extent <= 0 || depth >= BVH_MAX_DEPTH) {
+    /* no usable centroid spread (or too deep): halve by position */
+    return n <= BVH_MAX_LEAF ? begin : begin + n / 2;
+  }
+
+  uint   count[BVH_BINS];
+  aabb   bounds[BVH_BINS];
+  for (int k = 0; k < BVH_BINS; k++) {
+    count[k] = 0;
+    aabb_empty(&bounds[k]);
+  }
+  double scale = BVH_BINS / extent;
+  for (uint i = begin; i < end; i++) {
+    int k = (int)((b->prims[i].c[axis] - cb.lo[axis]) * scale);
+    if (k >= BVH_BINS) k = BVH_BINS - 1;
+    count[k]++;
+    aabb_grow(&bounds[k], &b->prims[i].box);
+  }
+
+  /* sweep from the right to get suffix costs, then from the left */
+  double right_cost[BVH_BINS];
+  aabb acc;
+  uint acc_n = 0;
+  aabb_empty(&acc);
+  for (int k = BVH_BINS - 1; k > 0; k--) {
+    aabb_grow(&acc, &bounds[k]);
+    acc_n += count[k];
+    right_cost[k] = acc_n * aabb_area(&acc);
+  }
+  int best = -1;
+  double best_cost = INFINITY;
+  aabb_empty(&acc);
+  acc_n = 0;
+  for (int k = 0; k < BVH_BINS - 1; k++) {
+    aabb_grow(&acc, &bounds[k]);
+    acc_n += count[k];
+    if (acc_n == 0 || acc_n == n)
+      continue;
+    double cost = acc_n * aabb_area(&acc) + right_cost[k + 1];
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = k;
+    }
+  }
+  double area = aabb_area(box);
+  double leaf_cost = n;
+  double split_cost = area > 0 ? 1 + best_cost / area : leaf_cost;
+  if (best < 0 || (n <= BVH_MAX_LEAF && split_cost >= leaf_cost))
+    return n <= BVH_MAX_LEAF ? begin : begin + n / 2;
+
+  uint mid = begin;
+  for (uint i = begin; i < end; i++) {
+    int k = (int)((b->prims[i].c[axis] - cb.lo[axis]) * scale);
+    if (k >= BVH_BINS) k = BVH_BINS - 1;
+    if (k <= best) {
+      build_prim tmp = b->prims[i];
+      b->prims[i] = b->prims[mid];
+      b->prims[mid] = tmp;
+      mid++;
+    }
+  }
+  return mid;
+}
+
+static uint build_node(builder *b, uint begin, uint end, uint depth)
+{
+  uint idx = b->nnodes++;
+  bvh_node *node = &b->nodes[idx];
+  aabb_empty(&node->box);
+  for (uint i = begin; i < end; i++)
+    aabb_grow(&node->box, &b->prims[i].box);
+  uint mid = sah_split(b, begin, end, &node->box, depth);
+  if (mid == begin || mid == end) {
+    /* leaf: remember the prim range for now, see reorder_leaves */
+    node->sph_first = begin;
+    node->rect_first = end;
+    node->nsph = 1;
+    node->nrect = 0;
+    return idx;
+  }
+  node->nsph = node->nrect = 0;
+  build_node(b, begin, mid, depth + 1);
+  /* b->nodes is preallocated, so node is still valid here */
+  node->right = build_node(b, mid, end, depth + 1);
+  return idx;
+}
+
+static void permute_doubles(double *a, uint *from, uint n, double *tmp)
+{
+  for (uint i = 0; i < n; i++)
+    tmp[i] = a[from[i]];
+  memcpy(a, tmp, sizeof(double) * n);
+}
+
+static void permute_uints(uint *a, uint *from, uint n, uint *tmp)
+{
+  for (uint i = 0; i < n; i++)
+    tmp[i] = a[from[i]];
+  memcpy(a, tmp, sizeof(uint) * n);
+}
+
+/* leaves were built over ranges of b->prims; renumber the scene's spheres
+ * and rectangles in leaf order and point each leaf at its two runs */
+static void reorder_leaves(builder *b, compiled_scene *cs)
+{
+  uint ns = cs->nspheres, nr = cs->nrects;
+  uint *sph_from = (uint*)malloc(sizeof(uint) * (ns + 1));
+  check_malloc("bvh_build", sph_from);
+  uint *rect_from = (uint*)malloc(sizeof(uint) * (nr + 1));
+  check_malloc("bvh_build", rect_from);
+  uint si = 0, ri = 0;
+  for (uint k = 0; k < b->nnodes; k++) {
+    bvh_node *n = &b->nodes[k];
+    if (!IS_LEAF(n))
+      continue;
+    uint begin = n->sph_first, end = n->rect_first;
+    n->sph_first = si;
+    n->rect_first = ri;
+    n->nsph = n->nrect = 0;
+    for (uint i = begin; i < end; i++) {
+      uint p = b->prims[i].prim;
+      if (p < ns) {
+        sph_from[si++] = p;
+        n->nsph++;
+      } else {
+        rect_from[ri++] = p - ns;
+        n->nrect++;
+      }
+    }
+  }
+  uint m = ns > nr ? ns : nr;
+  double *dtmp = (double*)malloc(sizeof(double) * (m + 1));
+  check_malloc("bvh_build", dtmp);
+  uint *utmp = (uint*)malloc(sizeof(uint) * (m + 1));
+  check_malloc("bvh_build", utmp);
+  permute_doubles(cs->sph_cx, sph_from, ns, dtmp);
+  permute_doubles(cs->sph_cy, sph_from, ns, dtmp);
+  permute_doubles(cs->sph_cz, sph_from, ns, dtmp);
+  permute_doubles(cs->sph_r, sph_from, ns, dtmp);
+  permute_uints(cs->sph_mat, sph_from, ns, utmp);
+  permute_uints(cs->sph_id, sph_from, ns, utmp);
+  permute_doubles(cs->rect_x0, rect_from, nr, dtmp);
+  permute_doubles(cs->rect_x1, rect_from, nr, dtmp);
+  permute_doubles(cs->rect_y0, rect_from, nr, dtmp);
+  permute_doubles(cs->rect_y1, rect_from, nr, dtmp);
+  permute_doubles(cs->rect_z, rect_from, nr, dtmp);
+  permute_uints(cs->rect_mat, rect_from, nr, utmp);
+  permute_uints(cs->rect_id, rect_from, nr, utmp);
+  free(dtmp);
+  free(utmp);
+  free(sph_from);
+  free(rect_from);
+}
+
+bvh *bvh_build(compiled_scene *cs)
+{
+  uint n = cs->nspheres + cs->nrects;
+  builder b;
+  b.prims = (build_prim*)malloc(sizeof(build_prim) * (n + 1));
+  check_malloc("bvh_build", b.prims);
+  b.nodes = (bvh_node*)malloc(sizeof(bvh_node) * (2 * n + 1));
+  check_malloc("bvh_build", b.nodes);
+  b.nnodes = 0;
+  for (uint i = 0; i < n; i++) {
+    build_prim *p = &b.prims[i];
+    p->prim = i;
+    prim_bounds(cs, i, &p->box);
+    for (int a = 0; a < 3; a++)
+      p->c[a] = 0.5 * (p->box.lo[a] + p->box.hi[a]);
+  }
+  if (n > 0) {
+    build_node(&b, 0, n, 0);
+    reorder_leaves(&b, cs);
+  }
+  free(b.prims);
+
+  bvh *t = (bvh*)malloc(sizeof(bvh));
+  check_malloc("bvh_build", t);
+  t->nodes = b.nodes;
+  t->nnodes = b.nnodes;
+  t->owned = 1;
+  return t;
+}
+
+/* the nodes as they are laid out in memory, for the scene cache */
+size_t bvh_export(bvh *t, const void **nodes)
+{
+  *nodes = t->nodes;
+  return sizeof(bvh_node) * t->nnodes;
+}
+
+/* a bvh over nodes written by bvh_export, which stay owned by the caller.
+ * NULL unless the nodes form one tree laid out depth first, every leaf
+ * range is within the scene, and no node is so deep that a traversal would
+ * overflow its BVH_STACK */
+bvh *bvh_import(void *nodes, size_t bytes, compiled_scene *cs)
+{
+  if (bytes % sizeof(bvh_node) != 0)
+    return NULL;
+  bvh_node *n = (bvh_node*)nodes;
+  uint nnodes = bytes / sizeof(bvh_node);
+  /* walk it as a traversal would. laid out depth first, the nodes come off
+   * the stack in index order, each once, and a right child is the node
+   * just past its left subtree; shared or overlapping children break that
+   * order, so traversals cannot revisit a node */
+  uint stack[BVH_STACK], depth[BVH_STACK];
+  int top = 0, ok = 1;
+  uint next = 0;
+  stack[0] = 0;
+  depth[0] = 0;
+  while (ok && top >= 0) {
+    uint i = stack[top], d = depth[top--];
+    ok = i == next && next < nnodes;
+    next++;
+    if (!ok)
+      break;
+    if (IS_LEAF(&n[i])) {
+      ok = n[i].sph_first <= cs->nspheres &&
+        n[i].nsph <= cs->nspheres - n[i].sph_first &&
+        n[i].rect_first <= cs->nrects &&
+        n[i].nrect <= cs->nrects - n[i].rect_first;
+    } else {
+      /* visiting an interior node at depth d leaves at most d + 2 entries
+       * on the stack */
+      ok = d + 2 <= BVH_STACK && top + 2 < BVH_STACK;
+      if (ok) {
+        stack[++top] = n[i].right;
+        depth[top] = d + 1;
+        stack[++top] = i + 1;
+        depth[top] = d + 1;
+      }
+    }
+  }
+  ok = ok && next == nnodes;
+  if (!ok)
+    return NULL;
+  bvh *t = (bvh*)malloc(sizeof(bvh));
+  check_malloc("bvh_import", t);
+  t->nodes = n;
+  t->nnodes = nnodes;
+  t->owned = 0;
+  return t;
+}
+
+void bvh_free(bvh *t)
+{
+  if (t->owned)
+    free(t->nodes);
+  free(t);
+}
+
+uint bvh_node_count(bvh *t)
+{
+  return t->nnodes;
+}
+
+bvh *bvh_clone(bvh *t)
+{
+  bvh *c = (bvh*)malloc(sizeof(bvh));
+  check_malloc("bvh_clone", c);
+  c->nodes = (bvh_node*)malloc(sizeof(bvh_node) * (t->nnodes + 1));
+  check_malloc("bvh_clone", c->nodes);
+  memcpy(c->nodes, t->nodes, sizeof(bvh_node) * t->nnodes);
+  c->nnodes = t->nnodes;
+  c->owned = 1;
+  return c;
+}
+
+/* fit every box to where the objects of cs are now, keeping the tree's
+ * shape. children follow their parents, so one backward pass does it; the
+ * tree gets no better as objects wander from where it was built */
+void bvh_refit(bvh *t, compiled_scene *cs)
+{
+  aabb b;
+  for (uint k = t->nnodes; k-- > 0;) {
+    bvh_node *n = &t->nodes[k];
+    if (!IS_LEAF(n)) {
+      n->box = t->nodes[k + 1].box;
+      aabb_grow(&n->box, &t->nodes[n->right].box);
+      continue;
+    }
+    aabb_empty(&n->box);
+    for (uint i = 0; i < n->nsph; i++) {
+      prim_bounds(cs, n->sph_first + i, &b);
+      aabb_grow(&n->box, &b);
+    }
+    for (uint i = 0; i < n->nrect; i++) {
+      prim_bounds(cs, cs->nspheres + n->rect_first + i, &b);
+      aabb_grow(&n->box, &b);
+    }
+  }
+}
+
+/* slab test; NaNs from 0 * inf compare false and so never cull a box */
+static int ray_box(aabb *b, double o[3], double inv[3], double tmax)
+{
+  double tnear = 0, tfar = tmax;
+  for (int a = 0; a < 3; a++) {
+    double t0 = (b->lo[a] - o[a]) * inv[a];
+    double t1 = (b->hi[a] - o[a]) * inv[a];
+    if (inv[a] < 0) {
+      double tmp = t0;
+      t0 = t1;
+      t1 = tmp;
+    }
+    if (t0 > tnear) tnear = t0;
+    if (t1 < tfar) tfar = t1;
+  }
+  return tnear <= tfar;
+}
+
+/* closest hit along r; equal t is resolved in favour of the object that
+ * comes first in the list, exactly as the linear scan does */
+int bvh_closest(bvh *t, compiled_scene *cs, ray3v r, prim_hit *h)
+{
+  h->prim = NO_PRIM;
+  if (t->nnodes == 0)
+    return 0;
+  double o[3] = { r.origin.x, r.origin.y, r.origin.z };
+  double inv[3] = { 1.0 / r.direction.x, 1.0 / r.direction.y,
+                    1.0 / r.direction.z };
+  uint stack[BVH_STACK];
+  uint sp = 0;
+  unsigned long visited = 0, tested = 0; /* for --stats */
+  stack[sp++] = 0;
+  while (sp > 0) {
+    bvh_node *n = &t->nodes[stack[--sp]];
+    visited++;
+    if (!ray_box(&n->box, o, inv, h->prim != NO_PRIM ? h->t : INFINITY))
+      continue;
+    if (IS_LEAF(n)) {
+      tested += n->nsph + n->nrect;
+      cs_closest_run(cs, n->sph_first, n->nsph, n->rect_first, n->nrect,
+                     r, h);
+    } else {
+      stack[sp++] = n->right;
+      stack[sp++] = (n - t->nodes) + 1;
+    }
+  }
+  STAT_ADD(ST_CLOSEST_NODES, visited);
+  STAT_ADD(ST_CLOSEST_TESTS, tested);
+  return h->prim != NO_PRIM;
+}
+
+/* first primitive found along the ray from o in direction d closer than
+ * tmax, or NO_PRIM; for shadow rays, so traversal stops at the first
+ * occluder */
+uint bvh_occluder(bvh *t, compiled_scene *cs, vector3 o, vector3 d,
+                  double tmax, unsigned long *tests)
+{
+  if (t->nnodes == 0)
+    return NO_PRIM;
+  double org[3] = { o.x, o.y, o.z };
+  double inv[3] = { 1.0 / d.x, 1.0 / d.y, 1.0 / d.z };
+  uint stack[BVH_STACK];
+  uint sp = 0;
+  unsigned long visited = 0; /* for --stats */
+  stack[sp++] = 0;
+  while (sp > 0) {
+    bvh_node *n = &t->nodes[stack[--sp]];
+    visited++;
+    if (!ray_box(&n->box, org, inv, tmax))
+      continue;
+    if (IS_LEAF(n)) {
+      uint p = cs_occluder_run(cs, n->sph_first, n->nsph,
+                               n->rect_first, n->nrect, o, d, tmax, tests);
+      if (p != NO_PRIM) {
+        STAT_ADD(ST_SHADOW_NODES, visited);
+        return p;
+      }
+    } else {
+      stack[sp++] = n->right;
+      stack[sp++] = (n - t->nodes) + 1;
+    }
+  }
+  STAT_ADD(ST_SHADOW_NODES, visited);
+  return NO_PRIM;
+}
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* primary rays. the eye looks through a grid of pixel centres on an image
+ * plane 2 units across its longer side; where every column and row falls
+ * on it is worked out once per frame, so a ray costs three additions and a
+ * normalization. the default view, from (0,0,camera_z) through the plane
+ * z = 0, keeps logical_coord's axes, and its rays are bit for bit those of
+ * logical_coord; camera_self_check makes sure */
+
+struct camera {
+  uint     width;
+  uint     height;
+  vector3  eye;
+  vector3  right;  /* unit vectors across and up the image plane */
+  vector3  up;
+  vector3  ahead;  /* from the eye to the centre of the plane */
+  double   x_init; /* as in logical_coord_at */
+  double   y_init;
+  double   side;
+  double  *col_x;  /* each column's centre along right */
+  double  *col_y;
+  double  *col_z;
+  double  *row_x;  /* ahead plus each row's centre along up */
+  double  *row_y;
+  double  *row_z;
+  int      fast;
+};
+
+static double *table(uint n)
+{
+  double *t = (double*)malloc(sizeof(double) * (n + 1));
+  check_malloc("camera_new", t);
+  return t;
+}
+
+/* the camera of e, for its view and image size. with e->fast_rays, rays
+ * are normalized by an approximate reciprocal square root, refined in
+ * double; they differ from the exact ones in the last few bits */
+camera *camera_new(environment *e)
+{
+  camera *c = (camera*)malloc(sizeof(camera));
+  check_malloc("camera_new", c);
+  uint w = e->image_width, h = e->image_height;
+  c->width = w;
+  c->height = h;
+  c->fast = e->fast_rays;
+  if (e->view) {
+    c->eye = e->view->eye;
+    c->ahead = v3_sub(e->view->at, c->eye);
+    vector3 f = v3_normalize(c->ahead);
+    /* looking straight up or down, the plane's up is along z */
+    vector3 sky = fabs(f.y) < 1 - 1e-9 ? v3(0, 1, 0) : v3(0, 0, 1);
+    c->right = v3_normalize(v3_cross(sky, f));
+    c->up = v3_cross(f, c->right);
+  } else {
+    /* the image plane is z = 0 with x to the right, on whichever side of
+     * it the eye is, and the eye may even sit in it */
+    c->eye = v3(0, 0, e->camera_z);
+    c->ahead = v3_sub(v3(0, 0, 0), c->eye);
+    c->right = v3(1, 0, 0);
+    c->up = v3(0, 1, 0);
+  }
+
+  c->x_init = -1.0;
+  c->y_init = 1.0;
+  c->side = 2.0 / w;
+  if (w > h)
+    c->y_init *= ((double)h / (double)w);
+  else if (w < h) {
+    c->x_init *= ((double)w / (double)h);
+    c->side = 2.0 / h;
+  }
+  c->col_x = table(w);
+  c->col_y = table(w);
+  c->col_z = table(w);
+  c->row_x = table(h);
+  c->row_y = table(h);
+  c->row_z = table(h);
+  for (uint i = 0; i < w; i++) {
+    double x = c->x_init + 0.5 * c->side + i * c->side;
+    c->col_x[i] = x * c->right.x;
+    c->col_y[i] = x * c->right.y;
+    c->col_z[i] = x * c->right.z;
+  }
+  for (uint i = 0; i < h; i++) {
+    double y = c->y_init - 0.5 * c->side - i * c->side;
+    c->row_x[i] = c->ahead.x + y * c->up.x;
+    c->row_y[i] = c->ahead.y + y * c->up.y;
+    c->row_z[i] = c->ahead.z + y * c->up.z;
+  }
+  return c;
+}
+
+/* give e its camera, once, before rendering from any thread */
+void camera_prepare(environment *e)
+{
+  if (!e->camera)
+    e->camera = camera_new(e);
+}
+
+void camera_free(camera *c)
+{
+  if (c) {
+    free(c->col_x);
+    free(c->col_y);
+    free(c->col_z);
+    free(c->row_x);
+    free(c->row_y);
+    free(c->row_z);
+    free(c);
+  }
+}
+
+/* 1 / sqrt(n2) for fast rays: an rsqrtss estimate, good to 12 bits, and
+ * two newton steps in double, good to about 1e-14. fast_rays_sse2 does
+ * the same lane by lane, so a ray does not depend on its neighbours */
+static double rsqrt(double n2)
+{
+#ifdef HAVE_X86_SIMD
+  double r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss((float)n2)));
+  double hn = 0.5 * n2;
+  for (int i = 0; i < 2; i++)
+    r = r * (1.5 - hn * (r * r));
+  return r;
+#else
+  return 1 / sqrt(n2);
+#endif
+}
+
+static vector3 unit(camera *c, vector3 d)
+{
+  if (!c->fast)
+    return v3_normalize(d);
+  return v3_scale(rsqrt(v3_dot(d, d)), d);
+}
+
+/* the ray through pixel (x, y), 0-based, moved dx across and dy down it,
+ * each on [-0.5,0.5) */
+ray3v camera_ray_at(camera *c, uint x, uint y, double dx, double dy)
+{
+  double px = c->x_init + (0.5 + dx) * c->side + x * c->side;
+  double py = c->y_init - (0.5 + dy) * c->side - y * c->side;
+  vector3 d = v3_add(v3_add(c->ahead, v3_scale(py, c->up)),
+                     v3_scale(px, c->right));
+  return ray3v_make(c->eye, unit(c, d));
+}
+
+ray3v camera_ray(camera *c, uint x, uint y)
+{
+  vector3 d = v3(c->row_x[y] + c->col_x[x], c->row_y[y] + c->col_y[x],
+                 c->row_z[y] + c->col_z[x]);
+  return ray3v_make(c->eye, unit(c, d));
+}
+
+#ifdef HAVE_X86_SIMD
+/* two fast rays at a time */
+static uint fast_rays_sse2(camera *c, uint x, uint y, uint n, ray3v *out)
+{
+  __m128d rx = _mm_set1_pd(c->row_x[y]), ry = _mm_set1_pd(c->row_y[y]);
+  __m128d rz = _mm_set1_pd(c->row_z[y]);
+  __m128d half = _mm_set1_pd(0.5), three_halves = _mm_set1_pd(1.5);
+  uint k = 0;
+  for (; k + 2 <= n; k += 2) {
+    __m128d dx = _mm_add_pd(rx, _mm_loadu_pd(c->col_x + x + k));
+    __m128d dy = _mm_add_pd(ry, _mm_loadu_pd(c->col_y + x + k));
+    __m128d dz = _mm_add_pd(rz, _mm_loadu_pd(c->col_z + x + k));
+    __m128d n2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx),
+                                       _mm_mul_pd(dy, dy)),
+                            _mm_mul_pd(dz, dz));
+    __m128d r = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(n2)));
+    __m128d hn = _mm_mul_pd(half, n2);
+    for (int i = 0; i < 2; i++)
+      r = _mm_mul_pd(r, _mm_sub_pd(three_halves,
+                                   _mm_mul_pd(hn, _mm_mul_pd(r, r))));
+    double ux[2], uy[2], uz[2];
+    _mm_storeu_pd(ux, _mm_mul_pd(dx, r));
+    _mm_storeu_pd(uy, _mm_mul_pd(dy, r));
+    _mm_storeu_pd(uz, _mm_mul_pd(dz, r));
+    out[k] = ray3v_make(c->eye, v3(ux[0], uy[0], uz[0]));
+    out[k + 1] = ray3v_make(c->eye, v3(ux[1], uy[1], uz[1]));
+  }
+  return k;
+}
+#endif
+
+/* the rays through pixels x to x + n - 1 of row y, into out */
+void camera_rays(camera *c, uint x, uint y, uint n, ray3v *out)
+{
+  uint k = 0;
+#ifdef HAVE_X86_SIMD
+  if (c->fast)
+    k = fast_rays_sse2(c, x, y, n, out);
+#endif
+  for (; k < n; k++)
+    out[k] = camera_ray(c, x + k, y);
+}
+
+static int same_ray(ray3v r, vector3 o, vector3 d)
+{
+  return !memcmp(&r.origin, &o, sizeof(o)) &&
+    !memcmp(&r.direction, &d, sizeof(d));
+}
+
+/* compare the default view's rays, from every entry point, with those
+ * through logical_coord_at, for eyes on either side of the image plane
+ * and in it, on wide, tall and square images; returns the number of rays
+ * that differ in any bit */
+int camera_self_check(FILE *f)
+{
+  static const double zs[] = { -3.3, 0, 3.3 };
+  static const uint sizes[][2] = { { 37, 23 }, { 23, 37 }, { 16, 16 } };
+  static const double offsets[][2] = { { 0, 0 }, { -0.5, 0.25 },
+                                       { 0.375, -0.125 } };
+  int failures = 0;
+  ray3v row[37];
+  for (uint zi = 0; zi < sizeof(zs) / sizeof(zs[0]); zi++) {
+    int bad = 0;
+    for (uint si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++) {
+      environment e;
+      memset(&e, 0, sizeof(e));
+      e.camera_z = zs[zi];
+      e.image_width = sizes[si][0];
+      e.image_height = sizes[si][1];
+      camera *c = camera_new(&e);
+      vector3 eye = v3(0, 0, e.camera_z);
+      for (uint y = 0; y < e.image_height; y++) {
+        camera_rays(c, 0, y, e.image_width, row);
+        for (uint x = 0; x < e.image_width; x++) {
+          vector3 want = v3_normalize(v3_sub(
+            logical_coord_at(e.image_height, e.image_width, y + 1, x + 1, 0,
+                             0), eye));
+          bad += !same_ray(row[x], eye, want) ||
+            !same_ray(camera_ray(c, x, y), eye, want);
+          for (uint k = 0; k < sizeof(offsets) / sizeof(offsets[0]); k++) {
+            double dx = offsets[k][0], dy = offsets[k][1];
+            want = v3_normalize(v3_sub(
+              logical_coord_at(e.image_height, e.image_width, y + 1, x + 1,
+                               dx, dy), eye));
+            bad += !same_ray(camera_ray_at(c, x, y, dx, dy), eye, want);
+          }
+        }
+      }
+      camera_free(c);
+    }
+    fprintf(f, "camera check: eye at z = %g: %s (%d rays differ)\n", zs[zi],
+            bad ? "FAILED" : "ok", bad);
+    failures += bad;
+  }
+  return failures;
+}
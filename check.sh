@@ -0,0 +1,151 @@
+#!/bin/sh
+# check the raytracer: every set of intersection kernels against the
+# scalar ones, in double and in float, the default camera's rays against
+# those through logical_coord, --precision float renders against double
+# ones, serial renders against threaded ones in both precisions, and a
+# frame of a keyed sequence against a still scene with everything where
+# that frame puts it. prints one line per check and exits non-zero if any
+# fails.
+#
+# environment:
+#   RAYTRACER      binary to run                     (default ./raytracer)
+#   IMGDIFF        image comparison tool             (default ./imgdiff)
+
+RAYTRACER=${RAYTRACER:-./raytracer}
+IMGDIFF=${IMGDIFF:-./imgdiff}
+
+for tool in "$RAYTRACER" "$IMGDIFF"; do
+  if [ ! -x "$tool" ]; then
+    echo "check: $tool not found, run make first" >&2
+    exit 1
+  fi
+done
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+
+# run name command...: run a check, and count it if it fails
+run()
+{
+  name=$1
+  shift
+  if "$@"; then
+    echo "check: $name ok"
+  else
+    echo "check: $name FAILED"
+    failed=$((failed + 1))
+  fi
+}
+
+for simd in scalar sse2 avx2; do
+  for precision in double float; do
+    run "simd $simd $precision" "$RAYTRACER" --simd "$simd" \
+      --precision "$precision" --simd-check
+  done
+done
+
+run camera "$RAYTRACER" --camera-check
+
+# a scene of spheres and rectangles, some touching, in the light of a
+# directional and a point light, with rectangles casting shadows on both
+awk 'BEGIN {
+  srand(7);
+  print "ENV -3.3 320 240";
+  print "BG 0.3 0.4 0.6";
+  print "AMB 0.2 0.2 0.2";
+  print "DL -1 1 -1 0.8 0.8 0.8";
+  print "PL 2 3 1 4 4 3";
+  for (i = 0; i < 60; i++) {
+    x = rand() * 6 - 3; y = rand() * 4 - 2; z = 3 + rand() * 6;
+    if (i % 3 == 0)
+      printf "RECTANGLE %f %f %f %f %f %f %f %f 0.3 0.3 0.3\n",
+             x, y, z, 0.2 + rand(), 0.2 + rand(), rand(), rand(), rand();
+    else
+      printf "SPHERE %f %f %f %f %f %f %f 0.5 0.5 0.5\n",
+             x, y, z, 0.1 + rand() * 0.6, rand(), rand(), rand();
+  }
+}' > "$TMP/scene.txt"
+
+# float may pick another object where two meet or a shadow begins, so a
+# pixel or so in a thousand may differ; the rest must be within one step
+compare_precisions()
+{
+  "$RAYTRACER" "$@" > "$TMP/double.ppm" 2> /dev/null &&
+    "$RAYTRACER" --precision float "$@" > "$TMP/float.ppm" 2> /dev/null &&
+    "$IMGDIFF" -t 1 -p 0.1 "$TMP/double.ppm" "$TMP/float.ppm"
+}
+run "float vs double, demo" compare_precisions 1
+run "float vs double, scene" compare_precisions < "$TMP/scene.txt"
+
+# a crowd of 3000 objects under three lights, where many shadow rays
+# graze an occluder; the per-thread occluder caches then see different
+# rays at different thread counts, and the image must not change
+awk 'BEGIN {
+  srand(11);
+  print "ENV -3.3 400 300";
+  print "BG 0.8 0.8 0.8";
+  print "AMB 0.2 0.2 0.2";
+  print "DL -1 1 -1 0.7 0.7 0.7";
+  print "DL 1 0.5 -1 0.4 0.4 0.4";
+  print "PL 0 3 2 3 3 3";
+  s = 2 + sqrt(3000) / 4;
+  for (i = 0; i < 3000; i++) {
+    x = (rand() * 2 - 1) * s; y = (rand() * 2 - 1) * s * 0.75;
+    z = 4 + rand() * s * 2; r = 0.05 + rand() * 0.3;
+    if (i % 2)
+      printf "RECTANGLE %f %f %f %f %f %f %f %f 0.2 0.2 0.2\n",
+             x, y, z, r * 2, r * 2, rand(), rand(), rand();
+    else
+      printf "SPHERE %f %f %f %f %f %f %f 0.5 0.5 0.5\n",
+             x, y, z, r, rand(), rand(), rand();
+  }
+}' > "$TMP/crowd.txt"
+
+# render the crowd serially and with -j n, and compare the bytes
+compare_threads()
+{
+  n=$1
+  shift
+  "$RAYTRACER" "$@" < "$TMP/crowd.txt" > "$TMP/serial.ppm" 2> /dev/null &&
+    "$RAYTRACER" -j "$n" "$@" < "$TMP/crowd.txt" > "$TMP/threads.ppm" \
+      2> /dev/null &&
+    cmp -s "$TMP/serial.ppm" "$TMP/threads.ppm"
+}
+for precision in double float; do
+  for n in 2 5; do
+    run "serial vs -j $n, $precision" compare_threads "$n" \
+      --precision "$precision"
+  done
+done
+
+# frame 2 of 5 is halfway to the keys at frame 4, and every value halfway
+# is exact, so the frame must match the still scene byte for byte. the
+# directional light is not a unit vector at either end
+still()
+{
+  printf 'ENV -4 160 120\nBG 0.1 0.1 0.3\nAMB 0.2 0.2 0.2\n'
+  printf 'DL %s 0.6 0.6 0.6\n' "$1"
+  [ -n "$4" ] && printf 'KEY 4 3 1 -1\n'
+  printf 'PL %s 2 2 2\n' "$2"
+  [ -n "$4" ] && printf 'KEY 4 -2 2 -2\n'
+  printf 'SPHERE %s 1 0.8 0.3 0.3 0.5 0.5 0.5\n' "$3"
+  [ -n "$4" ] && printf 'KEY 4 1 0 5\n'
+  printf 'RECTANGLE -3 -1 7 6 2 0.4 0.6 0.4 0.2 0.2 0.2\n'
+}
+compare_frame()
+{
+  still "-1 1 -1" "2 2 -2" "0 0 5" keyed > "$TMP/keyed.txt" &&
+    still "1 1 -1" "0 2 -2" "0.5 0 5" > "$TMP/still.txt" &&
+    "$RAYTRACER" "$@" --sequence "$TMP/frame%d.ppm" < "$TMP/keyed.txt" \
+      2> /dev/null &&
+    "$RAYTRACER" < "$TMP/still.txt" > "$TMP/still.ppm" 2> /dev/null &&
+    cmp -s "$TMP/frame2.ppm" "$TMP/still.ppm"
+}
+run "sequence frame vs still scene" compare_frame
+run "sequence frame vs still scene, -j 3" compare_frame -j 3
+
+if [ "$failed" -gt 0 ]; then
+  echo "check: $failed failed" >&2
+  exit 1
+fi
@@ -3,6 +3,7 @@
 #include <string.h>
 #include "utils.h"
 #include "raytracer-project2.h"
+#include "vmath.h"
 
 color *color_new(double r, double g, double b)
 {
@@ -14,6 +15,12 @@ color *color_new(double r, double g, double b)
   return c;
 }
 
+/* heap copy of a by-value color */
+color *color_box(color c)
+{
+  return color_new(c.r, c.g, c.b);
+}
+
 char *color_format = "(r=%lf,g=%lf,b=%lf)";
 
 char *color_tos(color *c)
@@ -30,19 +37,13 @@ void color_show(FILE *f, color *c)
 
 color *color_add(color *c1, color *c2)
 {
-  double r0 = c1->r + c2->r;
-  double g0 = c1->g + c2->g;
-  double b0 = c1->b + c2->b;
-  return color_new(r0 > 1 ? 1 : r0, g0 > 1 ? 1 : g0, b0 > 1 ? 1 : b0);
+  return color_box(col_add(*c1, *c2));
 }
 color *color_modulate(color *c1, color *c2)
 {
-  return color_new(c1->r * c2->r, c1->g * c2->g, c1->b * c2->b);
+  return color_box(col_modulate(*c1, *c2));
 }
 color *color_scale(double scalar, color *c)
 {
-  double r0 = c->r * scalar;
-  double g0 = c->g * scalar;
-  double b0 = c->b * scalar;
-  return color_new(r0 > 1 ? 1 : r0, g0 > 1 ? 1 : g0, b0 > 1 ? 1 : b0);
+  return color_box(col_scale(scalar, *c));
 }
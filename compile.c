@@ -0,0 +1,600 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+#include "stats.h"
+
+/* the compiled scene flattens the object list into structure-of-arrays form:
+ * sphere and rectangle parameters live in contiguous arrays, and surfaces
+ * are indices into a deduplicated material table. the intersection code
+ * below touches nothing else until a closest hit has been found */
+
+static double *doubles(uint n)
+{
+  double *a = (double*)calloc(n + SIMD_PAD, sizeof(double));
+  check_malloc("compile_scene", a);
+  return a;
+}
+
+static uint *uints(uint n)
+{
+  uint *a = (uint*)calloc(n + SIMD_PAD, sizeof(uint));
+  check_malloc("compile_scene", a);
+  return a;
+}
+
+/* a float copy of the first n entries of a, zero padded like a */
+static float *floats(double *a, uint n)
+{
+  float *f = (float*)calloc(n + SIMD_PAD, sizeof(float));
+  check_malloc("cs_build_single", f);
+  for (uint i = 0; i < n; i++)
+    f[i] = a[i];
+  return f;
+}
+
+/* give cs the single-precision copies the float kernels read. it must be
+ * in its final order, so this comes after any bvh_build */
+void cs_build_single(compiled_scene *cs)
+{
+  if (cs->single)
+    return;
+  compiled_single *f = (compiled_single*)malloc(sizeof(compiled_single));
+  check_malloc("cs_build_single", f);
+  f->sph_cx = floats(cs->sph_cx, cs->nspheres);
+  f->sph_cy = floats(cs->sph_cy, cs->nspheres);
+  f->sph_cz = floats(cs->sph_cz, cs->nspheres);
+  f->sph_r = floats(cs->sph_r, cs->nspheres);
+  f->rect_x0 = floats(cs->rect_x0, cs->nrects);
+  f->rect_x1 = floats(cs->rect_x1, cs->nrects);
+  f->rect_y0 = floats(cs->rect_y0, cs->nrects);
+  f->rect_y1 = floats(cs->rect_y1, cs->nrects);
+  f->rect_z = floats(cs->rect_z, cs->nrects);
+  cs->single = f;
+}
+
+static void single_free(compiled_single *f)
+{
+  if (f) {
+    free(f->sph_cx);
+    free(f->sph_cy);
+    free(f->sph_cz);
+    free(f->sph_r);
+    free(f->rect_x0);
+    free(f->rect_x1);
+    free(f->rect_y0);
+    free(f->rect_y1);
+    free(f->rect_z);
+    free(f);
+  }
+}
+
+/* === material table === */
+
+typedef struct {
+  material *items;
+  uint      n;
+  uint     *slots; /* open-addressed hash of item index + 1, 0 when empty */
+  uint      nslots;
+} material_table;
+
+static unsigned long material_hash(material *m)
+{
+  /* fnv-1a over the fields that identify a material */
+  unsigned long h = 14695981039346656037UL;
+  unsigned char *p;
+  double v[6] = { m->k.r, m->k.g, m->k.b, m->shine.r, m->shine.g, m->shine.b };
+  p = (unsigned char*)v;
+  for (size_t i = 0; i < sizeof(v); i++)
+    h = (h ^ p[i]) * 1099511628211UL;
+  p = (unsigned char*)&m->f;
+  for (size_t i = 0; i < sizeof(m->f); i++)
+    h = (h ^ p[i]) * 1099511628211UL;
+  p = (unsigned char*)&m->t;
+  for (size_t i = 0; i < sizeof(m->t); i++)
+    h = (h ^ p[i]) * 1099511628211UL;
+  return h ^ m->tag;
+}
+
+static int material_eq(material *a, material *b)
+{
+  return a->tag == b->tag && a->f == b->f && a->t == b->t &&
+    a->k.r == b->k.r && a->k.g == b->k.g && a->k.b == b->k.b &&
+    a->shine.r == b->shine.r && a->shine.g == b->shine.g &&
+    a->shine.b == b->shine.b;
+}
+
+static uint material_intern(material_table *t, surface *surf, color *shine)
+{
+  material m;
+  memset(&m, 0, sizeof(material));
+  m.tag = surf->tag;
+  if (surf->tag == CONSTANT)
+    m.k = *surf->c.k;
+  else if (surf->tag == FUNCTION)
+    m.f = surf->c.f;
+  else
+    m.t = surf->c.t;
+  m.shine = *shine;
+  uint i = material_hash(&m) % t->nslots;
+  while (t->slots[i] != 0) {
+    if (material_eq(&t->items[t->slots[i] - 1], &m))
+      return t->slots[i] - 1;
+    i = (i + 1) % t->nslots;
+  }
+  t->items[t->n] = m;
+  t->slots[i] = ++t->n;
+  return t->n - 1;
+}
+
+/* === construction === */
+
+compiled_scene *compile_scene(object_list *objs)
+{
+  uint ns = 0, nr = 0;
+  for (object_list *ol = objs; ol != NULL; ol = ol->rest) {
+    if (ol->first.tag == SPHERE)
+      ns++;
+    else
+      nr++;
+  }
+  compiled_scene *cs = (compiled_scene*)malloc(sizeof(compiled_scene));
+  check_malloc("compile_scene", cs);
+  cs->nspheres = ns;
+  cs->sph_cx = doubles(ns);
+  cs->sph_cy = doubles(ns);
+  cs->sph_cz = doubles(ns);
+  cs->sph_r = doubles(ns);
+  cs->sph_mat = uints(ns);
+  cs->sph_id = uints(ns);
+  cs->nrects = nr;
+  cs->rect_x0 = doubles(nr);
+  cs->rect_x1 = doubles(nr);
+  cs->rect_y0 = doubles(nr);
+  cs->rect_y1 = doubles(nr);
+  cs->rect_z = doubles(nr);
+  cs->rect_mat = uints(nr);
+  cs->rect_id = uints(nr);
+  cs->accel = NULL;
+  cs->single = NULL;
+  cs->mapping = NULL;
+  cs->mapping_len = 0;
+
+  material_table mt;
+  mt.n = 0;
+  mt.items = (material*)malloc(sizeof(material) * (ns + nr + 1));
+  check_malloc("compile_scene", mt.items);
+  mt.nslots = 2 * (ns + nr) + 1;
+  mt.slots = uints(mt.nslots);
+  memset(mt.slots, 0, sizeof(uint) * mt.nslots);
+
+  uint id = 0, i = 0, j = 0;
+  for (object_list *ol = objs; ol != NULL; ol = ol->rest, id++) {
+    switch (ol->first.tag) {
+    case SPHERE:
+    {
+      sphere *s = ol->first.o.s;
+      cs->sph_cx[i] = s->center->x;
+      cs->sph_cy[i] = s->center->y;
+      cs->sph_cz[i] = s->center->z;
+      cs->sph_r[i] = s->radius;
+      cs->sph_mat[i] = material_intern(&mt, &s->surf, s->shine);
+      cs->sph_id[i] = id;
+      i++;
+      break;
+    }
+    case RECTANGLE:
+    {
+      rectangle *r = ol->first.o.r;
+      cs->rect_x0[j] = r->upper_left->x;
+      cs->rect_x1[j] = r->upper_left->x + r->w;
+      cs->rect_y0[j] = r->upper_left->y - r->h;
+      cs->rect_y1[j] = r->upper_left->y;
+      cs->rect_z[j] = r->upper_left->z;
+      cs->rect_mat[j] = material_intern(&mt, &r->surf, r->shine);
+      cs->rect_id[j] = id;
+      j++;
+      break;
+    }
+    default:
+      fprintf(stderr, "bad tag in obj\n");
+      exit(1);
+    }
+  }
+  free(mt.slots);
+  cs->nmaterials = mt.n;
+  cs->materials = mt.items;
+  return cs;
+}
+
+void compiled_scene_free(compiled_scene *cs)
+{
+  if (cs->accel)
+    bvh_free(cs->accel);
+  single_free(cs->single);
+  if (cs->mapping) {
+    /* every array is part of the cache file */
+    munmap(cs->mapping, cs->mapping_len);
+    free(cs);
+    shadow_cache_invalidate();
+    return;
+  }
+  free(cs->sph_cx);
+  free(cs->sph_cy);
+  free(cs->sph_cz);
+  free(cs->sph_r);
+  free(cs->sph_mat);
+  free(cs->sph_id);
+  free(cs->rect_x0);
+  free(cs->rect_x1);
+  free(cs->rect_y0);
+  free(cs->rect_y1);
+  free(cs->rect_z);
+  free(cs->rect_mat);
+  free(cs->rect_id);
+  free(cs->materials);
+  free(cs);
+  shadow_cache_invalidate();
+}
+
+static double *copy_doubles(double *a, uint n)
+{
+  double *c = doubles(n);
+  memcpy(c, a, sizeof(double) * n);
+  return c;
+}
+
+static uint *copy_uints(uint *a, uint n)
+{
+  uint *c = uints(n);
+  memcpy(c, a, sizeof(uint) * n);
+  return c;
+}
+
+/* a copy of cs, with its bvh and float copies, that owns all its arrays,
+ * for a frame of a sequence to move objects in */
+compiled_scene *cs_clone(compiled_scene *cs)
+{
+  uint ns = cs->nspheres, nr = cs->nrects;
+  compiled_scene *c = (compiled_scene*)malloc(sizeof(compiled_scene));
+  check_malloc("cs_clone", c);
+  c->nspheres = ns;
+  c->sph_cx = copy_doubles(cs->sph_cx, ns);
+  c->sph_cy = copy_doubles(cs->sph_cy, ns);
+  c->sph_cz = copy_doubles(cs->sph_cz, ns);
+  c->sph_r = copy_doubles(cs->sph_r, ns);
+  c->sph_mat = copy_uints(cs->sph_mat, ns);
+  c->sph_id = copy_uints(cs->sph_id, ns);
+  c->nrects = nr;
+  c->rect_x0 = copy_doubles(cs->rect_x0, nr);
+  c->rect_x1 = copy_doubles(cs->rect_x1, nr);
+  c->rect_y0 = copy_doubles(cs->rect_y0, nr);
+  c->rect_y1 = copy_doubles(cs->rect_y1, nr);
+  c->rect_z = copy_doubles(cs->rect_z, nr);
+  c->rect_mat = copy_uints(cs->rect_mat, nr);
+  c->rect_id = copy_uints(cs->rect_id, nr);
+  c->nmaterials = cs->nmaterials;
+  c->materials = (material*)malloc(sizeof(material) * (cs->nmaterials + 1));
+  check_malloc("cs_clone", c->materials);
+  memcpy(c->materials, cs->materials, sizeof(material) * cs->nmaterials);
+  c->accel = cs->accel ? bvh_clone(cs->accel) : NULL;
+  c->single = NULL;
+  c->mapping = NULL;
+  c->mapping_len = 0;
+  if (cs->single)
+    cs_build_single(c);
+  return c;
+}
+
+/* move sphere i to centre c, or rectangle i to upper-left corner ul, with
+ * the arithmetic of compile_scene; any bvh must be refit afterwards */
+void cs_place_sphere(compiled_scene *cs, uint i, vector3 c)
+{
+  cs->sph_cx[i] = c.x;
+  cs->sph_cy[i] = c.y;
+  cs->sph_cz[i] = c.z;
+  if (cs->single) {
+    cs->single->sph_cx[i] = c.x;
+    cs->single->sph_cy[i] = c.y;
+    cs->single->sph_cz[i] = c.z;
+  }
+}
+
+void cs_place_rect(compiled_scene *cs, uint i, vector3 ul, double w, double h)
+{
+  cs->rect_x0[i] = ul.x;
+  cs->rect_x1[i] = ul.x + w;
+  cs->rect_y0[i] = ul.y - h;
+  cs->rect_y1[i] = ul.y;
+  cs->rect_z[i] = ul.z;
+  if (cs->single) {
+    compiled_single *f = cs->single;
+    f->rect_x0[i] = cs->rect_x0[i];
+    f->rect_x1[i] = cs->rect_x1[i];
+    f->rect_y0[i] = cs->rect_y0[i];
+    f->rect_y1[i] = cs->rect_y1[i];
+    f->rect_z[i] = cs->rect_z[i];
+  }
+}
+
+static int same_vec(vector3 *a, vector3 *b)
+{
+  return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+static int same_color(color *a, color *b)
+{
+  return a->r == b->r && a->g == b->g && a->b == b->b;
+}
+
+static int same_surface(surface *a, surface *b)
+{
+  if (a->tag != b->tag)
+    return 0;
+  switch (a->tag) {
+  case CONSTANT:
+    return same_color(a->c.k, b->c.k);
+  case FUNCTION:
+    return a->c.f == b->c.f;
+  default:
+    return a->c.t == b->c.t; /* compiled textures are shared */
+  }
+}
+
+/* whether two object lists would compile to the same arrays */
+static int same_objects(object_list *a, object_list *b)
+{
+  for (; a && b; a = a->rest, b = b->rest) {
+    object *x = &a->first, *y = &b->first;
+    if (x->tag != y->tag)
+      return 0;
+    if (x->tag == SPHERE) {
+      sphere *p = x->o.s, *q = y->o.s;
+      if (!same_vec(p->center, q->center) || p->radius != q->radius ||
+          !same_surface(&p->surf, &q->surf) || !same_color(p->shine, q->shine))
+        return 0;
+    } else {
+      rectangle *p = x->o.r, *q = y->o.r;
+      if (!same_vec(p->upper_left, q->upper_left) || p->w != q->w ||
+          p->h != q->h || !same_surface(&p->surf, &q->surf) ||
+          !same_color(p->shine, q->shine))
+        return 0;
+    }
+  }
+  return a == NULL && b == NULL;
+}
+
+/* move prev's compiled form, with its bvh, to s if their objects are the
+ * same; the camera, image size, background and lights are free to differ.
+ * returns 1 if s was given prev's compiled scene */
+int scene_reuse_compiled(scene *s, scene *prev)
+{
+  if (!prev->compiled || s->compiled ||
+      !same_objects(s->objects, prev->objects))
+    return 0;
+  s->compiled = prev->compiled;
+  prev->compiled = NULL;
+  return 1;
+}
+
+void scene_compile(scene *s, int build_bvh)
+{
+  if (s->compiled)
+    compiled_scene_free(s->compiled);
+  s->compiled = compile_scene(s->objects);
+  fprintf(stderr, "scene: %u spheres, %u rectangles, %u materials\n",
+          s->compiled->nspheres, s->compiled->nrects,
+          s->compiled->nmaterials);
+  if (build_bvh) {
+    double t0 = wall_time();
+    s->compiled->accel = bvh_build(s->compiled);
+    fprintf(stderr, "bvh: %u nodes over %u objects, built in %.3f ms\n",
+            bvh_node_count(s->compiled->accel),
+            s->compiled->nspheres + s->compiled->nrects,
+            (wall_time() - t0) * 1e3);
+  }
+  if (simd_single())
+    cs_build_single(s->compiled);
+}
+
+/* === primitive tests === */
+
+/* same arithmetic, in the same order, as hit_sphere and intersect_sphere */
+int cs_sphere_hit(compiled_scene *cs, uint i, vector3 o, vector3 d, double *t)
+{
+  double ax = o.x - cs->sph_cx[i];
+  double ay = o.y - cs->sph_cy[i];
+  double az = o.z - cs->sph_cz[i];
+  double b = ax * d.x + ay * d.y + az * d.z;
+  double c = (ax * ax + ay * ay + az * az) - cs->sph_r[i] * cs->sph_r[i];
+  double disc = b * b - c;
+  *t = - b - sqrt(disc);
+  return disc > 0 && *t > 0;
+}
+
+/* same arithmetic as hit_rect: the plane z = rect_z with normal <0,0,-1> */
+int cs_rect_hit(compiled_scene *cs, uint i, vector3 o, vector3 d, double *t)
+{
+  *t = -(-o.z + cs->rect_z[i]) / -d.z;
+  double x = o.x + *t * d.x;
+  double y = o.y + *t * d.y;
+  return *t > 0 && x >= cs->rect_x0[i] && x <= cs->rect_x1[i] &&
+    y >= cs->rect_y0[i] && y <= cs->rect_y1[i];
+}
+
+int cs_prim_hit(compiled_scene *cs, uint prim, vector3 o, vector3 d,
+                double *t)
+{
+  if (prim < cs->nspheres)
+    return cs_sphere_hit(cs, prim, o, d, t);
+  return cs_rect_hit(cs, prim - cs->nspheres, o, d, t);
+}
+
+uint cs_prim_id(compiled_scene *cs, uint prim)
+{
+  return prim < cs->nspheres ? cs->sph_id[prim]
+    : cs->rect_id[prim - cs->nspheres];
+}
+
+/* keep the nearer hit; equal t goes to the object earlier in the list */
+void cs_consider(compiled_scene *cs, prim_hit *best, uint prim, double t)
+{
+  if (best->prim == NO_PRIM || t < best->t ||
+      (t == best->t && cs_prim_id(cs, prim) < cs_prim_id(cs, best->prim))) {
+    best->t = t;
+    best->prim = prim;
+  }
+}
+
+/* === queries === */
+
+/* closest hit among a run of spheres and a run of rectangles, via the simd
+ * kernels; hits are considered in index order so ties behave as in a scan */
+void cs_closest_run(compiled_scene *cs, uint sph_first, uint nsph,
+                    uint rect_first, uint nrect, ray3v r, prim_hit *h)
+{
+  double t[32];
+  while (nsph > 0) {
+    uint n = nsph < 32 ? nsph : 32;
+    uint mask = sphere_hits(cs, sph_first, n, r.origin, r.direction, t);
+    for (uint k = 0; mask != 0; k++, mask >>= 1) {
+      if (mask & 1)
+        cs_consider(cs, h, sph_first + k, t[k]);
+    }
+    sph_first += n;
+    nsph -= n;
+  }
+  while (nrect > 0) {
+    uint n = nrect < 32 ? nrect : 32;
+    uint mask = rect_hits(cs, rect_first, n, r.origin, r.direction, t);
+    for (uint k = 0; mask != 0; k++, mask >>= 1) {
+      if (mask & 1)
+        cs_consider(cs, h, cs->nspheres + rect_first + k, t[k]);
+    }
+    rect_first += n;
+    nrect -= n;
+  }
+}
+
+/* the hits of mask at or beyond tmax, for shadow rays toward a point */
+static uint drop_beyond(uint mask, double *t, double tmax)
+{
+  for (uint m = mask; m != 0; m &= m - 1) {
+    uint k = __builtin_ctz(m);
+    if (!(t[k] < tmax))
+      mask &= ~(1u << k);
+  }
+  return mask;
+}
+
+/* first occluder closer than tmax among a run of spheres and a run of
+ * rectangles, or NO_PRIM; tests counts every primitive handed to a kernel */
+uint cs_occluder_run(compiled_scene *cs, uint sph_first, uint nsph,
+                     uint rect_first, uint nrect, vector3 o, vector3 d,
+                     double tmax, unsigned long *tests)
+{
+  double t[32];
+  int bounded = tmax < INFINITY;
+  while (nsph > 0) {
+    uint n = nsph < 32 ? nsph : 32;
+    uint mask = sphere_hits(cs, sph_first, n, o, d, t);
+    *tests += n;
+    if (mask != 0 && bounded)
+      mask = drop_beyond(mask, t, tmax);
+    if (mask != 0)
+      return sph_first + __builtin_ctz(mask);
+    sph_first += n;
+    nsph -= n;
+  }
+  while (nrect > 0) {
+    uint n = nrect < 32 ? nrect : 32;
+    uint mask = rect_hits(cs, rect_first, n, o, d, t);
+    *tests += n;
+    if (mask != 0 && bounded)
+      mask = drop_beyond(mask, t, tmax);
+    if (mask != 0)
+      return cs->nspheres + rect_first + __builtin_ctz(mask);
+    rect_first += n;
+    nrect -= n;
+  }
+  return NO_PRIM;
+}
+
+static int closest_linear(compiled_scene *cs, ray3v r, prim_hit *h)
+{
+  h->prim = NO_PRIM;
+  STAT_ADD(ST_CLOSEST_TESTS, cs->nspheres + cs->nrects);
+  cs_closest_run(cs, 0, cs->nspheres, 0, cs->nrects, r, h);
+  return h->prim != NO_PRIM;
+}
+
+static uint occluder_linear(compiled_scene *cs, vector3 o, vector3 d,
+                            double tmax, unsigned long *tests)
+{
+  return cs_occluder_run(cs, 0, cs->nspheres, 0, cs->nrects, o, d, tmax,
+                         tests);
+}
+
+int cs_closest(compiled_scene *cs, ray3v r, prim_hit *h)
+{
+  int hit = cs->accel ? bvh_closest(cs->accel, cs, r, h)
+                      : closest_linear(cs, r, h);
+  /* the float kernels pick the object; its distance is worked out again
+   * in double so the hit point lies on the surface */
+  double t;
+  if (hit && cs->single &&
+      cs_prim_hit(cs, h->prim, r.origin, r.direction, &t))
+    h->t = t;
+  STAT_ADD(!hit ? ST_MISSES : h->prim < cs->nspheres ? ST_SPHERE_HITS
+                                                     : ST_RECT_HITS, 1);
+  return hit;
+}
+
+uint cs_occluder(compiled_scene *cs, vector3 o, vector3 d, double tmax,
+                 unsigned long *tests)
+{
+  if (cs->accel)
+    return bvh_occluder(cs->accel, cs, o, d, tmax, tests);
+  return occluder_linear(cs, o, d, tmax, tests);
+}
+
+/* fill in normal and shine for a hit found by cs_closest, and set anchor to
+ * the point its surface function is relative to; returns its material */
+material *cs_hit_geometry(compiled_scene *cs, ray3v r, prim_hit *ph, hitv *h,
+                          vector3 *anchor)
+{
+  vector3 hitpoint = ray3v_position(r, ph->t);
+  material *m;
+  h->t = ph->t;
+  if (ph->prim < cs->nspheres) {
+    uint i = ph->prim;
+    *anchor = v3(cs->sph_cx[i], cs->sph_cy[i], cs->sph_cz[i]);
+    h->surface_normal = v3_normalize(v3_sub(hitpoint, *anchor));
+    m = &cs->materials[cs->sph_mat[i]];
+  } else {
+    uint i = ph->prim - cs->nspheres;
+    *anchor = v3(cs->rect_x0[i], cs->rect_y1[i], cs->rect_z[i]);
+    h->surface_normal = v3(0, 0, -1);
+    m = &cs->materials[cs->rect_mat[i]];
+  }
+  h->shine = m->shine;
+  return m;
+}
+
+/* fill in normal, surface color and shine for a hit found by cs_closest */
+void cs_shade_hit(compiled_scene *cs, ray3v r, prim_hit *ph, hitv *h)
+{
+  vector3 anchor;
+  material *m = cs_hit_geometry(cs, r, ph, h, &anchor);
+  vector3 hitpoint = ray3v_position(r, ph->t);
+  if (m->tag == CONSTANT)
+    h->surface_color = m->k;
+  else if (m->tag == FUNCTION)
+    h->surface_color = fn_color(m->f, anchor, hitpoint);
+  else
+    h->surface_color = texture_eval1(m->t, anchor, hitpoint);
+}
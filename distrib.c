@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+
+/* distributed rendering. a coordinator compiles the scene once and sends
+ * it, as a scene cache, to worker processes: forked on this machine and
+ * reached over unix socket pairs, or started anywhere with --serve and
+ * reached over tcp. it then deals out blocks of the image, a couple at a
+ * time to each worker, as the blocks come back; the blocks of a worker
+ * that goes away are dealt to the others. every pixel comes out as it
+ * does in a local render.
+ *
+ * messages are structs in the machine's own layout, so the coordinator
+ * and its workers must be the same build on the same kind of machine; the
+ * hello checks as much */
+
+#define DIST_MAGIC   "RTDIST"
+#define DIST_VERSION 1
+#define DIST_ORDER   0x01020304u
+#define BLOCK_SIZE   64 /* side of the blocks dealt to workers */
+#define IN_FLIGHT    2  /* blocks a worker holds, so it never waits on us */
+#define MAX_SCENE    ((uint64_t)1 << 30) /* bytes of scene a worker takes */
+
+typedef struct {
+  char           magic[8];
+  uint32_t       version;
+  uint32_t       order;
+  uint32_t       size;      /* of this struct */
+  uint32_t       single;    /* --precision float */
+  uint32_t       linear;
+  uint32_t       fast_rays;
+  aa_settings    aa;
+  shade_settings shading;
+  uint64_t       scene_len; /* bytes of scene cache that follow */
+} dist_hello;
+
+/* a worker's answer once it has loaded the scene */
+typedef struct {
+  int32_t  pid;
+  uint32_t threads;
+} dist_ready;
+
+typedef struct {
+  uint32_t id;
+  uint32_t x, y, w, h; /* w == 0: there are no more */
+} dist_block;
+
+/* followed by the block's pixels, 3 bytes each */
+typedef struct {
+  uint32_t id;
+  uint32_t pad;
+  double   seconds; /* the worker spent rendering it */
+} dist_result;
+
+/* 1 once all n bytes have gone, 0 if the other end has */
+static int write_full(int fd, const void *p, size_t n)
+{
+  const char *c = (const char*)p;
+  while (n > 0) {
+    ssize_t k = write(fd, c, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return 0;
+    c += k;
+    n -= k;
+  }
+  return 1;
+}
+
+/* 1 once all n bytes have come, 0 on end of file or an error */
+static int read_full(int fd, void *p, size_t n)
+{
+  char *c = (char*)p;
+  while (n > 0) {
+    ssize_t k = read(fd, c, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return 0;
+    c += k;
+    n -= k;
+  }
+  return 1;
+}
+
+/* ====================================== */
+/* === worker                         === */
+/* ====================================== */
+
+/* copy n bytes of fd to the file f; 0 if they do not all come */
+static int receive_file(int fd, FILE *f, uint64_t n)
+{
+  char buf[65536];
+  while (n > 0) {
+    size_t k = n < sizeof(buf) ? n : sizeof(buf);
+    if (!read_full(fd, buf, k) || fwrite(buf, 1, k, f) != k)
+      return 0;
+    n -= k;
+  }
+  return fflush(f) == 0;
+}
+
+/* load the scene a coordinator sends on fd and render the blocks it asks
+ * for until it says there are no more or goes away */
+static void serve(int fd, uint nthreads, char *simd, const char *who)
+{
+  dist_hello h;
+  if (!read_full(fd, &h, sizeof(h)))
+    return;
+  if (memcmp(h.magic, DIST_MAGIC, sizeof(DIST_MAGIC)) ||
+      h.version != DIST_VERSION || h.order != DIST_ORDER ||
+      h.size != sizeof(dist_hello)) {
+    fprintf(stderr, "distrib: %s is not a coordinator of this build\n", who);
+    return;
+  }
+  /* the same limits main puts on the options; the scene itself is checked
+   * as any scene cache is, its bvh's depth included */
+  if (h.aa.min < 1 || h.aa.min > h.aa.max || h.aa.max > 1024 ||
+      !(h.shading.light_cutoff >= 0) ||
+      h.shading.reflect_depth > 64 || !(h.shading.reflect_cutoff >= 0) ||
+      h.single > 1 || h.linear > 1 || h.fast_rays > 1) {
+    fprintf(stderr, "distrib: %s sent settings out of range\n", who);
+    return;
+  }
+  if (h.scene_len > MAX_SCENE) {
+    fprintf(stderr, "distrib: %s sent a scene of more than %llu bytes\n",
+            who, (unsigned long long)MAX_SCENE);
+    return;
+  }
+  simd_select(simd, h.single);
+  FILE *f = tmpfile();
+  if (!f || !receive_file(fd, f, h.scene_len)) {
+    fprintf(stderr, "distrib: scene from %s did not arrive\n", who);
+    if (f)
+      fclose(f);
+    return;
+  }
+  environment *e = scene_cache_map(fileno(f), "the coordinator's scene", 0,
+                                   0, h.linear);
+  fclose(f);
+  if (!e)
+    return;
+  e->aa = h.aa;
+  e->scene->shading = h.shading;
+  e->fast_rays = h.fast_rays;
+  worker_pool *p = nthreads > 0 ? pool_new(nthreads) : NULL;
+  dist_ready r = { (int32_t)getpid(), nthreads > 0 ? nthreads : 1 };
+  int ok = write_full(fd, &r, sizeof(r));
+  dist_block b;
+  while (ok && read_full(fd, &b, sizeof(b)) && b.w > 0) {
+    if (b.h == 0 || b.x > e->image_width || b.w > e->image_width - b.x ||
+        b.y > e->image_height || b.h > e->image_height - b.y) {
+      fprintf(stderr, "distrib: %s asked for a block outside the image\n",
+              who);
+      break;
+    }
+    image_rect rect = { b.x, b.y, b.w, b.h };
+    framebuffer *fb = framebuffer_new(b.w, b.h);
+    double t0 = wall_time();
+    render_regions(&fb, &rect, 1, e, p);
+    dist_result res = { b.id, 0, wall_time() - t0 };
+    ok = write_full(fd, &res, sizeof(res)) &&
+      write_full(fd, fb->rgb, 3 * (size_t)b.w * b.h);
+    framebuffer_free(fb);
+  }
+  if (p)
+    pool_free(p);
+  env_free(e);
+  textures_free();
+}
+
+/* accept coordinators on a tcp port, one at a time, for good. addr is a
+ * port, listened on at 127.0.0.1 only, or host:port to listen on the
+ * address host names, 0.0.0.0 for every interface */
+void dist_serve(char *addr, uint nthreads, char *simd)
+{
+  /* a coordinator that goes away mid-block is not our end */
+  signal(SIGPIPE, SIG_IGN);
+  char *colon = strrchr(addr, ':');
+  if (colon && (colon == addr || !colon[1])) {
+    fprintf(stderr, "--serve: expected port or host:port, not %s\n", addr);
+    exit(1);
+  }
+  char *host = colon ? strndup(addr, colon - addr) : strdup("127.0.0.1");
+  char *port = colon ? colon + 1 : addr;
+  check_malloc("dist_serve", host);
+  struct addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    fprintf(stderr, "--serve: bad address %s\n", addr);
+    exit(1);
+  }
+  free(host);
+  int ls = -1;
+  for (struct addrinfo *a = ai; a && ls < 0; a = a->ai_next) {
+    ls = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (ls < 0)
+      continue;
+    int on = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(ls, a->ai_addr, a->ai_addrlen) != 0 || listen(ls, 4) != 0) {
+      close(ls);
+      ls = -1;
+    }
+  }
+  freeaddrinfo(ai);
+  if (ls < 0) {
+    fprintf(stderr, "--serve: cannot listen on %s\n", addr);
+    exit(1);
+  }
+  fprintf(stderr, "distrib: serving on %s%s\n", colon ? "" : "127.0.0.1:",
+          addr);
+  for (;;) {
+    struct sockaddr_storage from;
+    socklen_t flen = sizeof(from);
+    int fd = accept(ls, (struct sockaddr*)&from, &flen);
+    if (fd < 0)
+      continue;
+    char host[NI_MAXHOST];
+    if (getnameinfo((struct sockaddr*)&from, flen, host, sizeof(host), NULL,
+                    0, NI_NUMERICHOST) != 0)
+      strcpy(host, "?");
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fprintf(stderr, "distrib: coordinator at %s\n", host);
+    double t0 = wall_time();
+    serve(fd, nthreads, simd, host);
+    close(fd);
+    fprintf(stderr, "distrib: done with %s after %.3f s\n", host,
+            wall_time() - t0);
+  }
+}
+
+/* ====================================== */
+/* === coordinator                    === */
+/* ====================================== */
+
+typedef struct {
+  int      fd;      /* -1 once it has gone */
+  char    *name;    /* "local" or host:port */
+  pid_t    child;   /* forked here, or 0 */
+  int      pid;     /* as it reports */
+  uint     threads;
+  uint     held[IN_FLIGHT]; /* blocks sent and not back, oldest first */
+  double   sent[IN_FLIGHT];
+  uint     nheld;
+  double   ready;   /* when it had loaded the scene */
+  double   back;    /* when it last returned a block */
+  uint     blocks;  /* returned */
+  size_t   pixels;
+  double   busy;    /* seconds it reported rendering */
+  double   latency; /* summed over its blocks */
+} remote;
+
+typedef struct {
+  framebuffer *fb;
+  image_rect  *blocks;
+  uint         nblocks;
+  uint        *todo;    /* a stack; blocks dealt again go on top */
+  uint         ntodo;
+  double      *latency; /* of each block, once back */
+  uint         redealt;
+  uint         lost;    /* workers gone */
+  remote      *w;
+  uint         nw;
+} coordinator;
+
+static void lose(coordinator *c, remote *w, const char *why)
+{
+  close(w->fd);
+  w->fd = -1;
+  c->lost++;
+  for (uint i = w->nheld; i-- > 0;)
+    c->todo[c->ntodo++] = w->held[i];
+  c->redealt += w->nheld;
+  fprintf(stderr, "distrib: worker %ld (%s) %s, %u blocks dealt again\n",
+          (long)(w - c->w), w->name, why, w->nheld);
+  w->nheld = 0;
+}
+
+/* top up what w holds from the blocks still to do */
+static void deal(coordinator *c, remote *w)
+{
+  while (w->fd >= 0 && w->nheld < IN_FLIGHT && c->ntodo > 0) {
+    uint id = c->todo[--c->ntodo];
+    image_rect *r = &c->blocks[id];
+    dist_block b = { id, r->x, r->y, r->w, r->h };
+    w->held[w->nheld] = id;
+    w->sent[w->nheld++] = wall_time();
+    if (!write_full(w->fd, &b, sizeof(b)))
+      lose(c, w, "went away");
+  }
+}
+
+/* take the block w has finished, which is the oldest it holds */
+static void collect(coordinator *c, remote *w, unsigned char *buf)
+{
+  dist_result res;
+  image_rect *r = w->nheld > 0 ? &c->blocks[w->held[0]] : NULL;
+  if (!r || !read_full(w->fd, &res, sizeof(res)) ||
+      !read_full(w->fd, buf, 3 * (size_t)r->w * r->h)) {
+    lose(c, w, "went away");
+    return;
+  }
+  if (res.id != w->held[0]) {
+    lose(c, w, "answered out of turn");
+    return;
+  }
+  framebuffer *fb = c->fb;
+  for (uint y = 0; y < r->h; y++)
+    memcpy(fb->rgb + 3 * ((size_t)(r->y + y) * fb->width + r->x),
+           buf + 3 * (size_t)y * r->w, 3 * (size_t)r->w);
+  /* from when it could start on the block: the later of sending it and
+   * the block before it coming back */
+  double now = wall_time();
+  double start = w->sent[0] > w->back ? w->sent[0] : w->back;
+  c->latency[res.id] = now - start;
+  w->latency += now - start;
+  w->back = now;
+  w->blocks++;
+  w->pixels += (size_t)r->w * r->h;
+  w->busy += res.seconds;
+  w->nheld--;
+  memmove(w->held, w->held + 1, sizeof(uint) * w->nheld);
+  memmove(w->sent, w->sent + 1, sizeof(double) * w->nheld);
+}
+
+/* fork a worker on one end of a socket pair and keep the other */
+static void fork_worker(coordinator *c, remote *w, uint nthreads, char *simd)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    fprintf(stderr, "distrib: cannot make a socket pair\n");
+    exit(1);
+  }
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "distrib: cannot fork a worker\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(sv[0]);
+    for (remote *o = c->w; o < w; o++)
+      if (o->fd >= 0)
+        close(o->fd);
+    serve(sv[1], nthreads, simd, "the coordinator");
+    _exit(0);
+  }
+  close(sv[1]);
+  w->fd = sv[0];
+  w->child = pid;
+  w->name = "local";
+}
+
+/* connect to a worker started with --serve at host:port; -1 if there is
+ * none */
+static int connect_worker(char *addr)
+{
+  char *colon = strrchr(addr, ':');
+  if (!colon || colon == addr || !colon[1]) {
+    fprintf(stderr, "--connect: expected host:port, not %s\n", addr);
+    exit(1);
+  }
+  char *host = strndup(addr, colon - addr);
+  check_malloc("connect_worker", host);
+  struct addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int fd = -1;
+  if (getaddrinfo(host, colon + 1, &hints, &ai) == 0) {
+    for (struct addrinfo *a = ai; a && fd < 0; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(ai);
+  }
+  free(host);
+  if (fd >= 0) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  return fd;
+}
+
+/* the compiled scene of e as the bytes of a scene cache */
+static char *scene_bytes(environment *e, size_t *len)
+{
+  FILE *f = tmpfile();
+  if (!f || !scene_cache_put(f, e, 0, 0)) {
+    fprintf(stderr, "distrib: cannot send this scene to workers\n");
+    exit(1);
+  }
+  *len = ftello(f);
+  char *buf = (char*)malloc(*len + 1);
+  check_malloc("scene_bytes", buf);
+  rewind(f);
+  if (fread(buf, 1, *len, f) != *len) {
+    fprintf(stderr, "distrib: cannot send this scene to workers\n");
+    exit(1);
+  }
+  fclose(f);
+  return buf;
+}
+
+static int by_value(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void report(coordinator *c, double start, double end, size_t bytes,
+                   double sent)
+{
+  for (uint i = 0; i < c->nw; i++) {
+    remote *w = &c->w[i];
+    if (w->pid == 0)
+      continue; /* never loaded the scene */
+    double up = (w->fd >= 0 ? end : w->back) - w->ready;
+    fprintf(stderr, "distrib: worker %u (%s, pid %d, %u thread%s): "
+            "%u blocks, %.2f Mpixel/s busy, %.0f%% busy, mean latency "
+            "%.2f ms%s\n", i, w->name, w->pid, w->threads,
+            w->threads == 1 ? "" : "s", w->blocks,
+            w->busy > 0 ? w->pixels / w->busy * 1e-6 : 0,
+            up > 0 ? 100 * w->busy / up : 0,
+            w->blocks > 0 ? w->latency / w->blocks * 1e3 : 0,
+            w->fd < 0 ? ", went away" : "");
+  }
+  qsort(c->latency, c->nblocks, sizeof(double), by_value);
+  double sum = 0;
+  for (uint i = 0; i < c->nblocks; i++)
+    sum += c->latency[i];
+  double *l = c->latency;
+  uint n = c->nblocks;
+  fprintf(stderr, "distrib: %u blocks of %dx%d in %.3f s, %.2f Mpixel/s, "
+          "%u dealt again after losing %u of %u workers; scene of %zu bytes "
+          "sent in %.3f ms; block latency mean %.2f ms, median %.2f, p95 "
+          "%.2f, max %.2f\n", n, BLOCK_SIZE, BLOCK_SIZE, end - start,
+          (double)c->fb->width * c->fb->height / (end - start) * 1e-6,
+          c->redealt, c->lost, c->nw, bytes, sent * 1e3, sum / n * 1e3,
+          l[n / 2] * 1e3, l[(n - 1) * 95 / 100] * 1e3, l[n - 1] * 1e3);
+}
+
+/* render e into fb on workers: nlocal forked here, each rendering with
+ * nthreads threads and the kernels simd names, and one at each of
+ * hosts[0..nhosts). exits if they all go away */
+void dist_render(framebuffer *fb, environment *e, uint nlocal, char **hosts,
+                 uint nhosts, uint nthreads, char *simd, int linear)
+{
+  signal(SIGPIPE, SIG_IGN);
+  coordinator c;
+  c.fb = fb;
+  c.nw = nlocal + nhosts;
+  c.w = (remote*)calloc(c.nw + 1, sizeof(remote));
+  check_malloc("dist_render", c.w);
+  c.lost = c.redealt = 0;
+
+  size_t len;
+  char *bytes = scene_bytes(e, &len);
+  for (uint i = 0; i < nlocal; i++)
+    fork_worker(&c, &c.w[i], nthreads, simd);
+  for (uint i = 0; i < nhosts; i++) {
+    remote *w = &c.w[nlocal + i];
+    w->name = hosts[i];
+    w->fd = connect_worker(hosts[i]);
+    if (w->fd < 0)
+      fprintf(stderr, "distrib: cannot reach %s\n", hosts[i]);
+  }
+
+  /* everyone gets the scene before anyone is waited on, so they load it
+   * side by side */
+  double t0 = wall_time();
+  dist_hello h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, DIST_MAGIC, sizeof(DIST_MAGIC));
+  h.version = DIST_VERSION;
+  h.order = DIST_ORDER;
+  h.size = sizeof(dist_hello);
+  h.single = simd_single();
+  h.linear = linear;
+  h.fast_rays = e->fast_rays;
+  h.aa = e->aa;
+  h.shading = e->scene->shading;
+  h.scene_len = len;
+  for (uint i = 0; i < c.nw; i++) {
+    remote *w = &c.w[i];
+    if (w->fd >= 0 && !(write_full(w->fd, &h, sizeof(h)) &&
+                        write_full(w->fd, bytes, len)))
+      lose(&c, w, "went away");
+  }
+  double sent = wall_time() - t0;
+  free(bytes);
+  for (uint i = 0; i < c.nw; i++) {
+    remote *w = &c.w[i];
+    dist_ready r;
+    if (w->fd < 0)
+      continue;
+    if (!read_full(w->fd, &r, sizeof(r))) {
+      lose(&c, w, "could not load the scene");
+      continue;
+    }
+    w->pid = r.pid;
+    w->threads = r.threads;
+    w->ready = w->back = wall_time();
+  }
+
+  uint bw = (fb->width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint bh = (fb->height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  c.nblocks = bw * bh;
+  c.blocks = (image_rect*)malloc(sizeof(image_rect) * (c.nblocks + 1));
+  c.todo = (uint*)malloc(sizeof(uint) * (c.nblocks + 1));
+  c.latency = (double*)calloc(c.nblocks + 1, sizeof(double));
+  check_malloc("dist_render", c.blocks);
+  check_malloc("dist_render", c.todo);
+  check_malloc("dist_render", c.latency);
+  for (uint i = 0; i < c.nblocks; i++) {
+    image_rect *r = &c.blocks[i];
+    r->x = i % bw * BLOCK_SIZE;
+    r->y = i / bw * BLOCK_SIZE;
+    r->w = r->x + BLOCK_SIZE < fb->width ? BLOCK_SIZE : fb->width - r->x;
+    r->h = r->y + BLOCK_SIZE < fb->height ? BLOCK_SIZE : fb->height - r->y;
+    c.todo[c.nblocks - 1 - i] = i; /* the top of the frame first */
+  }
+  c.ntodo = c.nblocks;
+
+  unsigned char *buf = (unsigned char*)malloc(3 * BLOCK_SIZE * BLOCK_SIZE);
+  struct pollfd *pfd = (struct pollfd*)malloc(sizeof(struct pollfd) *
+                                              (c.nw + 1));
+  uint *who = (uint*)malloc(sizeof(uint) * (c.nw + 1));
+  check_malloc("dist_render", buf);
+  check_malloc("dist_render", pfd);
+  check_malloc("dist_render", who);
+  double start = wall_time();
+  uint done = 0;
+  while (done < c.nblocks) {
+    uint n = 0;
+    for (uint i = 0; i < c.nw; i++) {
+      deal(&c, &c.w[i]);
+      if (c.w[i].fd >= 0 && c.w[i].nheld > 0) {
+        pfd[n].fd = c.w[i].fd;
+        pfd[n].events = POLLIN;
+        who[n++] = i;
+      }
+    }
+    if (n == 0) {
+      fprintf(stderr, "distrib: no workers left, %u of %u blocks not "
+              "rendered\n", c.nblocks - done, c.nblocks);
+      exit(1);
+    }
+    if (poll(pfd, n, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "distrib: poll failed\n");
+      exit(1);
+    }
+    for (uint k = 0; k < n; k++) {
+      if (!pfd[k].revents)
+        continue;
+      remote *w = &c.w[who[k]];
+      uint before = w->blocks;
+      collect(&c, w, buf);
+      done += w->blocks - before;
+    }
+  }
+  double end = wall_time();
+
+  for (uint i = 0; i < c.nw; i++) {
+    remote *w = &c.w[i];
+    if (w->fd >= 0) {
+      dist_block stop = { 0, 0, 0, 0, 0 };
+      write_full(w->fd, &stop, sizeof(stop));
+      close(w->fd);
+    }
+    if (w->child > 0)
+      waitpid(w->child, NULL, 0);
+  }
+  report(&c, start, end, len, sent);
+  free(buf);
+  free(pfd);
+  free(who);
+  free(c.blocks);
+  free(c.todo);
+  free(c.latency);
+  free(c.w);
+}
@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+
+/* g-buffers for --gbuffer. with a frame's pixels the file keeps what each
+ * primary ray hit, and a snapshot of the objects, lights and background it
+ * was rendered with. the next run compares the scene it is given against
+ * the snapshot: pixels whose rays cannot see any change are copied, those
+ * whose object or lighting changed are shaded again from the stored hit,
+ * and only those near moved geometry are traced again. every pixel comes
+ * out exactly as a full render would make it */
+
+#define GB_MAGIC   "RTGBUF"
+#define GB_VERSION 3
+#define GB_ORDER   0x01020304u
+#define NO_TEXTURE ((uint32_t)-1)
+
+/* an object as the snapshot keeps it, under its key */
+typedef struct {
+  uint32_t kind;   /* SPHERE or RECTANGLE */
+  uint32_t tag;    /* its material's color_tag */
+  uint32_t tex;    /* TEXTURE: index into the texture sources */
+  uint32_t pad;
+  double   g[5];   /* SPHERE: cx cy cz r; RECTANGLE: x0 x1 y0 y1 z */
+  color    k;
+  color    shine;
+} gb_object;
+
+typedef struct {
+  uint32_t tag;    /* DIRECTIONAL or POINT */
+  uint32_t pad;
+  vector3  v;      /* its direction or position */
+  color    color;
+} gb_light;
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint32_t sizes[2]; /* double and header sizes */
+  uint32_t width;
+  uint32_t height;
+  vector3  eye;      /* the camera's view, always filled in */
+  vector3  at;
+  uint32_t fast_rays;
+  uint32_t single;   /* traced with the float kernels */
+  uint32_t nobjs;
+  uint32_t nlights;
+  uint32_t ntextures;
+  uint32_t bg_tag;
+  uint32_t bg_texture;
+  uint32_t pad;
+  color    bg;
+  color    amb;
+  double   light_cutoff;
+  uint64_t tex_len;  /* bytes of texture sources: uint32_t length, text, NUL */
+  uint64_t file_len;
+} gb_header;
+
+/* what a frame was rendered from */
+typedef struct {
+  gb_header    h;      /* width to light_cutoff */
+  gb_object   *objs;   /* by key */
+  gb_light    *lights;
+  const char **tex;    /* texture sources */
+} snapshot;
+
+struct gbuffer_plan {
+  uint          *prim;   /* by key: its primitive in the scene now */
+  uint           nkeys;  /* keys in the scene now */
+  unsigned char *state;  /* by old key: KEPT, RECOLORED or MOVED */
+  gb_object     *moved;  /* old and new forms of moved, new and gone objects */
+  uint           nmoved;
+  uint           nchanged; /* keys whose object moved, appeared or went */
+  int            relight;
+  int            rebackground;
+};
+
+enum { KEPT, RECOLORED, MOVED };
+
+/* ====================================== */
+/* === snapshots                      === */
+/* ====================================== */
+
+/* objects are keyed by their place in the scene file. the object list
+ * runs last to first, so the key of list position i is n - 1 - i */
+uint gbuffer_key(compiled_scene *cs, uint prim)
+{
+  return cs->nspheres + cs->nrects - 1 - cs_prim_id(cs, prim);
+}
+
+static uint32_t source_index(snapshot *sn, texture *t)
+{
+  const char *src = texture_source(t);
+  for (uint32_t i = 0; i < sn->h.ntextures; i++)
+    if (sn->tex[i] == src)
+      return i;
+  sn->tex[sn->h.ntextures] = src;
+  return sn->h.ntextures++;
+}
+
+static void take_material(snapshot *sn, gb_object *o, material *m)
+{
+  o->tag = m->tag;
+  o->k = m->tag == CONSTANT ? m->k : col(0, 0, 0);
+  o->tex = m->tag == TEXTURE ? source_index(sn, m->t) : NO_TEXTURE;
+  o->shine = m->shine;
+}
+
+/* the snapshot of e, which must be compiled; free with snapshot_free */
+static void snapshot_take(snapshot *sn, environment *e)
+{
+  scene *s = e->scene;
+  compiled_scene *cs = s->compiled;
+  memset(&sn->h, 0, sizeof(gb_header));
+  sn->h.width = e->image_width;
+  sn->h.height = e->image_height;
+  sn->h.eye = e->view ? e->view->eye : v3(0, 0, e->camera_z);
+  sn->h.at = e->view ? e->view->at : v3(0, 0, 0);
+  sn->h.fast_rays = e->fast_rays;
+  sn->h.single = simd_single();
+  sn->h.nobjs = cs->nspheres + cs->nrects;
+  sn->h.nlights = s->nlights;
+  sn->objs = (gb_object*)calloc(sn->h.nobjs + 1, sizeof(gb_object));
+  sn->lights = (gb_light*)calloc(sn->h.nlights + 1, sizeof(gb_light));
+  sn->tex = (const char**)malloc(sizeof(char*) * (cs->nmaterials + 2));
+  check_malloc("snapshot_take", sn->objs);
+  check_malloc("snapshot_take", sn->lights);
+  check_malloc("snapshot_take", sn->tex);
+  for (uint i = 0; i < cs->nspheres; i++) {
+    gb_object *o = &sn->objs[gbuffer_key(cs, i)];
+    o->kind = SPHERE;
+    o->g[0] = cs->sph_cx[i];
+    o->g[1] = cs->sph_cy[i];
+    o->g[2] = cs->sph_cz[i];
+    o->g[3] = cs->sph_r[i];
+    take_material(sn, o, &cs->materials[cs->sph_mat[i]]);
+  }
+  for (uint i = 0; i < cs->nrects; i++) {
+    gb_object *o = &sn->objs[gbuffer_key(cs, cs->nspheres + i)];
+    o->kind = RECTANGLE;
+    o->g[0] = cs->rect_x0[i];
+    o->g[1] = cs->rect_x1[i];
+    o->g[2] = cs->rect_y0[i];
+    o->g[3] = cs->rect_y1[i];
+    o->g[4] = cs->rect_z[i];
+    take_material(sn, o, &cs->materials[cs->rect_mat[i]]);
+  }
+  for (uint i = 0; i < s->nlights; i++) {
+    light *l = s->lights[i];
+    sn->lights[i].tag = l->tag;
+    sn->lights[i].v = l->tag == DIRECTIONAL ? *l->direction : *l->position;
+    sn->lights[i].color = *l->color;
+  }
+  sn->h.bg_tag = s->bg.tag;
+  sn->h.bg_texture = NO_TEXTURE;
+  if (s->bg.tag == CONSTANT)
+    sn->h.bg = *s->bg.c.k;
+  else if (s->bg.tag == TEXTURE)
+    sn->h.bg_texture = source_index(sn, s->bg.c.t);
+  sn->h.amb = *s->amb_light;
+  sn->h.light_cutoff = s->shading.light_cutoff;
+  for (uint32_t i = 0; i < sn->h.ntextures; i++)
+    sn->h.tex_len += sizeof(uint32_t) + strlen(sn->tex[i]) + 1;
+}
+
+static void snapshot_free(snapshot *sn)
+{
+  free(sn->objs);
+  free(sn->lights);
+  free(sn->tex);
+}
+
+static int same_source(snapshot *a, uint32_t i, snapshot *b, uint32_t j)
+{
+  return i < a->h.ntextures && j < b->h.ntextures &&
+    !strcmp(a->tex[i], b->tex[j]);
+}
+
+/* color functions cannot be compared, so they never count as the same */
+static int same_material(snapshot *a, gb_object *x, snapshot *b, gb_object *y)
+{
+  if (x->tag != y->tag || x->tag == FUNCTION ||
+      memcmp(&x->shine, &y->shine, sizeof(color)))
+    return 0;
+  if (x->tag == TEXTURE)
+    return same_source(a, x->tex, b, y->tex);
+  return !memcmp(&x->k, &y->k, sizeof(color));
+}
+
+static int same_lighting(snapshot *a, snapshot *b)
+{
+  return a->h.nlights == b->h.nlights &&
+    !memcmp(a->lights, b->lights, sizeof(gb_light) * a->h.nlights) &&
+    !memcmp(&a->h.amb, &b->h.amb, sizeof(color)) &&
+    !memcmp(&a->h.light_cutoff, &b->h.light_cutoff, sizeof(double));
+}
+
+static int same_background(snapshot *a, snapshot *b)
+{
+  if (a->h.bg_tag != b->h.bg_tag || a->h.bg_tag == FUNCTION)
+    return 0;
+  if (a->h.bg_tag == TEXTURE)
+    return same_source(a, a->h.bg_texture, b, b->h.bg_texture);
+  return !memcmp(&a->h.bg, &b->h.bg, sizeof(color));
+}
+
+/* ====================================== */
+/* === planning                       === */
+/* ====================================== */
+
+/* how prev, the g-buffer of an earlier frame, differs from now */
+static gbuffer_plan *plan_new(snapshot *old, environment *e)
+{
+  snapshot now;
+  snapshot_take(&now, e);
+  compiled_scene *cs = e->scene->compiled;
+  gbuffer_plan *p = (gbuffer_plan*)malloc(sizeof(gbuffer_plan));
+  check_malloc("plan_new", p);
+  p->nkeys = now.h.nobjs;
+  p->prim = (uint*)malloc(sizeof(uint) * (p->nkeys + 1));
+  p->state = (unsigned char*)malloc(old->h.nobjs + 1);
+  p->moved = (gb_object*)malloc(sizeof(gb_object) *
+                                (old->h.nobjs + now.h.nobjs + 1));
+  check_malloc("plan_new", p->prim);
+  check_malloc("plan_new", p->state);
+  check_malloc("plan_new", p->moved);
+  for (uint i = 0; i < p->nkeys; i++)
+    p->prim[gbuffer_key(cs, i)] = i;
+  p->nmoved = 0;
+  p->nchanged = 0;
+  for (uint k = 0; k < old->h.nobjs || k < now.h.nobjs; k++) {
+    gb_object *a = k < old->h.nobjs ? &old->objs[k] : NULL;
+    gb_object *b = k < now.h.nobjs ? &now.objs[k] : NULL;
+    if (a && b && a->kind == b->kind && !memcmp(a->g, b->g, sizeof(a->g))) {
+      p->state[k] = same_material(old, a, &now, b) ? KEPT : RECOLORED;
+      continue;
+    }
+    p->nchanged++;
+    if (a) {
+      p->state[k] = MOVED;
+      p->moved[p->nmoved++] = *a;
+    }
+    if (b)
+      p->moved[p->nmoved++] = *b;
+  }
+  p->relight = !same_lighting(old, &now);
+  p->rebackground = !same_background(old, &now);
+  snapshot_free(&now);
+  return p;
+}
+
+/* might the ray from o along d hit g, in either form? errs towards yes
+ * by slack relative to the magnitudes involved, well beyond the rounding
+ * of the kernels that trace it, and a sphere around the origin counts */
+static int touches(gb_object *g, vector3 o, vector3 d, double slack)
+{
+  if (g->kind == SPHERE) {
+    double r = g->g[3];
+    vector3 a = v3_sub(o, v3(g->g[0], g->g[1], g->g[2]));
+    double b = v3_dot(a, d);
+    double q = v3_dot(a, a);
+    double disc = b * b - (q - r * r);
+    return disc >= -slack * (q + r * r) &&
+      -b + sqrt(fmax(disc, 0)) > -slack * (sqrt(q) + r);
+  }
+  double t = (g->g[4] - o.z) / d.z;
+  if (!(t > -slack * (1 + fabs(g->g[4]) + fabs(o.z)) / fabs(d.z)))
+    return 0;
+  double x = o.x + t * d.x, y = o.y + t * d.y;
+  double eps = slack * (1 + fabs(o.x) + fabs(o.y) + fabs(x) + fabs(y) +
+                        fabs(t));
+  return x >= g->g[0] - eps && x <= g->g[1] + eps &&
+    y >= g->g[2] - eps && y <= g->g[3] + eps;
+}
+
+static int touches_moved(gbuffer_plan *p, vector3 o, vector3 d)
+{
+  double slack = simd_single() ? 1e-4 : 1e-9;
+  for (uint i = 0; i < p->nmoved; i++)
+    if (touches(&p->moved[i], o, d, slack))
+      return 1;
+  return 0;
+}
+
+/* what pixel i, seen along r, needs: the stored result, shading again
+ * from its stored hit on *prim, or tracing again */
+enum gbuffer_action gbuffer_action(gbuffer *prev, environment *e, size_t i,
+                                   ray3v r, uint *prim)
+{
+  gbuffer_plan *p = prev->plan;
+  uint key = prev->key[i];
+  scene *s = e->scene;
+  if (p->nmoved > 0 && touches_moved(p, r.origin, r.direction))
+    return GB_RETRACE;
+  *prim = NO_PRIM;
+  if (key == NO_PRIM)
+    return p->rebackground ? GB_RESHADE : GB_REUSE;
+  if (p->state[key] == MOVED)
+    return GB_RETRACE;
+  *prim = p->prim[key];
+  if (p->relight || p->state[key] == RECOLORED)
+    return GB_RESHADE;
+  if (p->nmoved == 0)
+    return GB_REUSE;
+  /* the shadow rays, as light_color_v casts them */
+  vector3 loc = ray3v_position(r, prev->t[i]);
+  for (uint k = 0; k < s->nlights; k++) {
+    light *li = s->lights[k];
+    vector3 l;
+    if (li->tag == DIRECTIONAL) {
+      l = *li->direction;
+    } else {
+      vector3 to = v3_sub(*li->position, loc);
+      l = v3_scale(1 / v3_magnitude(to), to);
+    }
+    if (touches_moved(p, v3_add(loc, v3_scale(0.0001, l)), l))
+      return GB_RESHADE;
+  }
+  return GB_REUSE;
+}
+
+/* ====================================== */
+/* === files                          === */
+/* ====================================== */
+
+gbuffer *gbuffer_new(uint w, uint h)
+{
+  gbuffer *g = (gbuffer*)malloc(sizeof(gbuffer));
+  check_malloc("gbuffer_new", g);
+  size_t n = (size_t)w * h;
+  g->width = w;
+  g->height = h;
+  g->key = (uint*)malloc(sizeof(uint) * (n + 1));
+  g->t = (double*)malloc(sizeof(double) * (n + 1));
+  check_malloc("gbuffer_new", g->key);
+  check_malloc("gbuffer_new", g->t);
+  g->rgb = NULL;
+  g->plan = NULL;
+  return g;
+}
+
+void gbuffer_free(gbuffer *g)
+{
+  if (g->plan) {
+    free(g->plan->prim);
+    free(g->plan->state);
+    free(g->plan->moved);
+    free(g->plan);
+  }
+  free(g->key);
+  free(g->t);
+  free(g->rgb);
+  free(g);
+}
+
+static void header_sizes(uint32_t sizes[2])
+{
+  sizes[0] = sizeof(double);
+  sizes[1] = sizeof(gb_header);
+}
+
+static uint64_t file_length(gb_header *h)
+{
+  uint64_t n = (uint64_t)h->width * h->height;
+  return sizeof(gb_header) + h->nobjs * sizeof(gb_object) +
+    h->nlights * sizeof(gb_light) + h->tex_len +
+    n * (sizeof(uint32_t) + sizeof(double) + 3);
+}
+
+/* write g, the hits of e rendered into fb, to path through a temporary
+ * file; returns 0, with a message on stderr, if it cannot */
+int gbuffer_save(const char *path, gbuffer *g, environment *e,
+                 framebuffer *fb)
+{
+  snapshot sn;
+  snapshot_take(&sn, e);
+  memcpy(sn.h.magic, GB_MAGIC, sizeof(GB_MAGIC));
+  sn.h.version = GB_VERSION;
+  sn.h.order = GB_ORDER;
+  header_sizes(sn.h.sizes);
+  sn.h.file_len = file_length(&sn.h);
+  size_t n = (size_t)g->width * g->height;
+  size_t plen = strlen(path);
+  char *tmp = (char*)malloc(plen + 5);
+  check_malloc("gbuffer_save", tmp);
+  memcpy(tmp, path, plen);
+  memcpy(tmp + plen, ".tmp", 5);
+  FILE *f = fopen(tmp, "wb");
+  int ok = f != NULL;
+  ok = ok && fwrite(&sn.h, sizeof(gb_header), 1, f) == 1;
+  ok = ok && fwrite(sn.objs, sizeof(gb_object), sn.h.nobjs, f) == sn.h.nobjs;
+  ok = ok && fwrite(sn.lights, sizeof(gb_light), sn.h.nlights, f) ==
+    sn.h.nlights;
+  for (uint32_t i = 0; ok && i < sn.h.ntextures; i++) {
+    uint32_t len = strlen(sn.tex[i]);
+    ok = fwrite(&len, sizeof(len), 1, f) == 1 &&
+      fwrite(sn.tex[i], 1, len + 1, f) == len + 1;
+  }
+  ok = ok && fwrite(g->key, sizeof(uint32_t), n, f) == n;
+  ok = ok && fwrite(g->t, sizeof(double), n, f) == n;
+  ok = ok && fwrite(fb->rgb, 3, n, f) == n;
+  if (f && fclose(f) != 0)
+    ok = 0;
+  if (ok && rename(tmp, path) != 0)
+    ok = 0;
+  if (!ok) {
+    fprintf(stderr, "gbuffer: cannot write %s\n", path);
+    remove(tmp);
+  }
+  free(tmp);
+  snapshot_free(&sn);
+  return ok;
+}
+
+static const char *check_header(gb_header *h, size_t size, environment *e)
+{
+  uint32_t sizes[2];
+  header_sizes(sizes);
+  if (memcmp(h->magic, GB_MAGIC, sizeof(GB_MAGIC)))
+    return "not a g-buffer";
+  if (h->order != GB_ORDER || h->version != GB_VERSION ||
+      memcmp(h->sizes, sizes, sizeof(sizes)))
+    return "from another version or machine";
+  vector3 eye = e->view ? e->view->eye : v3(0, 0, e->camera_z);
+  vector3 at = e->view ? e->view->at : v3(0, 0, 0);
+  if (h->width != e->image_width || h->height != e->image_height ||
+      memcmp(&h->eye, &eye, sizeof(vector3)) ||
+      memcmp(&h->at, &at, sizeof(vector3)) ||
+      h->fast_rays != (uint32_t)e->fast_rays)
+    return "for another image size or camera";
+  if (h->single != (uint32_t)simd_single())
+    return "traced in another precision";
+  if (h->file_len != size || file_length(h) != size)
+    return "truncated";
+  return NULL;
+}
+
+/* the g-buffer at path, planned against e, which must be compiled; NULL,
+ * saying why on stderr unless there is no file, if it cannot be used */
+gbuffer *gbuffer_load(const char *path, environment *e)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  char *buf = NULL;
+  size_t size = 0, cap = 0, got;
+  do {
+    if (size == cap) {
+      cap = cap ? 2 * cap : 1 << 16;
+      buf = (char*)realloc(buf, cap);
+      check_malloc("gbuffer_load", buf);
+    }
+    got = fread(buf + size, 1, cap - size, f);
+    size += got;
+  } while (got > 0);
+  fclose(f);
+
+  snapshot old;
+  const char *why = size < sizeof(gb_header) ? "not a g-buffer" : NULL;
+  if (!why) {
+    memcpy(&old.h, buf, sizeof(gb_header));
+    why = check_header(&old.h, size, e);
+  }
+  if (why) {
+    fprintf(stderr, "gbuffer: %s is %s, rendering everything\n", path, why);
+    free(buf);
+    return NULL;
+  }
+  char *p = buf + sizeof(gb_header);
+  old.objs = (gb_object*)malloc(sizeof(gb_object) * (old.h.nobjs + 1));
+  old.lights = (gb_light*)malloc(sizeof(gb_light) * (old.h.nlights + 1));
+  old.tex = (const char**)malloc(sizeof(char*) *
+                                 ((size_t)old.h.ntextures + 1));
+  check_malloc("gbuffer_load", old.objs);
+  check_malloc("gbuffer_load", old.lights);
+  check_malloc("gbuffer_load", old.tex);
+  memcpy(old.objs, p, sizeof(gb_object) * old.h.nobjs);
+  p += sizeof(gb_object) * old.h.nobjs;
+  memcpy(old.lights, p, sizeof(gb_light) * old.h.nlights);
+  p += sizeof(gb_light) * old.h.nlights;
+  char *end = p + old.h.tex_len;
+  for (uint32_t i = 0; !why && i < old.h.ntextures; i++) {
+    uint32_t len;
+    if ((size_t)(end - p) < sizeof(len)) {
+      why = "corrupt";
+      break;
+    }
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    if ((size_t)(end - p) <= len || p[len] != '\0')
+      why = "corrupt";
+    old.tex[i] = p;
+    p += len + 1;
+  }
+  if (!why && p != end)
+    why = "corrupt";
+  /* p may be anywhere once a texture is bad */
+  if (why) {
+    fprintf(stderr, "gbuffer: %s is %s, rendering everything\n", path, why);
+    snapshot_free(&old);
+    free(buf);
+    return NULL;
+  }
+
+  gbuffer *g = gbuffer_new(old.h.width, old.h.height);
+  size_t n = (size_t)old.h.width * old.h.height;
+  memcpy(g->key, p, sizeof(uint32_t) * n);
+  p += sizeof(uint32_t) * n;
+  memcpy(g->t, p, sizeof(double) * n);
+  p += sizeof(double) * n;
+  g->rgb = (unsigned char*)malloc(3 * n + 1);
+  check_malloc("gbuffer_load", g->rgb);
+  memcpy(g->rgb, p, 3 * n);
+  for (size_t i = 0; !why && i < n; i++)
+    if (g->key[i] != NO_PRIM && g->key[i] >= old.h.nobjs)
+      why = "corrupt";
+  if (why) {
+    fprintf(stderr, "gbuffer: %s is %s, rendering everything\n", path, why);
+    gbuffer_free(g);
+  } else {
+    g->plan = plan_new(&old, e);
+    fprintf(stderr, "gbuffer: %u of %u objects moved, added or removed, "
+            "lights %s, background %s\n", g->plan->nchanged,
+            g->plan->nkeys, g->plan->relight ? "changed" : "kept",
+            g->plan->rebackground ? "changed" : "kept");
+  }
+  snapshot_free(&old);
+  free(buf);
+  return why ? NULL : g;
+}
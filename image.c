@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+
+/* the framebuffer holds 8-bit RGB, written out in a single block */
+
+framebuffer *framebuffer_new(uint w, uint h)
+{
+  framebuffer *fb = (framebuffer*)malloc(sizeof(framebuffer));
+  check_malloc("framebuffer_new", fb);
+  fb->width = w;
+  fb->height = h;
+  fb->rgb = (unsigned char*)malloc(3 * (size_t)w * h + 1);
+  check_malloc("framebuffer_new", fb->rgb);
+  return fb;
+}
+
+void framebuffer_free(framebuffer *fb)
+{
+  free(fb->rgb);
+  free(fb);
+}
+
+/* x and y are 0-based */
+void framebuffer_set(framebuffer *fb, uint x, uint y, color c)
+{
+  unsigned char *p = fb->rgb + 3 * ((size_t)y * fb->width + x);
+  p[0] = channel_byte(c.r);
+  p[1] = channel_byte(c.g);
+  p[2] = channel_byte(c.b);
+}
+
+/* format v in decimal at p, returning the number of characters written */
+static int put_uint(char *p, uint v)
+{
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  for (int i = 0; i < n; i++)
+    p[i] = tmp[n - 1 - i];
+  return n;
+}
+
+/* write a header for fmt into buf (at least 32 bytes), returning its length */
+int image_header(char *buf, enum image_format fmt, uint w, uint h)
+{
+  switch (fmt) {
+  case PPM_P6:
+    return sprintf(buf, "P6\n%u %u\n255\n", w, h);
+  case PPM_P3:
+    return sprintf(buf, "P3\n%u %u\n255\n", w, h);
+  case RAW_RGB:
+    return 0;
+  default:
+    fprintf(stderr, "bad image format\n");
+    exit(1);
+  }
+}
+
+/* render rows [y0,y1) of fb as P3 text into buf, which needs room for
+ * 12 characters per pixel; returns the number of characters written */
+size_t p3_rows(char *buf, framebuffer *fb, uint y0, uint y1)
+{
+  char *p = buf;
+  unsigned char *px = fb->rgb + 3 * (size_t)y0 * fb->width;
+  size_t n = (size_t)(y1 - y0) * fb->width;
+  for (size_t i = 0; i < n; i++, px += 3) {
+    p += put_uint(p, px[0]);
+    *p++ = ' ';
+    p += put_uint(p, px[1]);
+    *p++ = ' ';
+    p += put_uint(p, px[2]);
+    *p++ = '\n';
+  }
+  return p - buf;
+}
+
+void framebuffer_write(FILE *f, framebuffer *fb, enum image_format fmt)
+{
+  char header[64];
+  int hlen = image_header(header, fmt, fb->width, fb->height);
+  size_t n = (size_t)fb->width * fb->height;
+  if (fmt == PPM_P3) {
+    /* format everything into one buffer so the file is a single write */
+    char *buf = (char*)malloc(hlen + 12 * n + 1);
+    check_malloc("framebuffer_write", buf);
+    memcpy(buf, header, hlen);
+    size_t len = hlen + p3_rows(buf + hlen, fb, 0, fb->height);
+    fwrite(buf, 1, len, f);
+    free(buf);
+  } else {
+    fwrite(header, 1, hlen, f);
+    fwrite(fb->rgb, 1, 3 * n, f);
+  }
+  fflush(f);
+}
+
+int parse_image_format(char *name, enum image_format *fmt)
+{
+  if (!strcmp(name, "p6"))
+    *fmt = PPM_P6;
+  else if (!strcmp(name, "p3"))
+    *fmt = PPM_P3;
+  else if (!strcmp(name, "raw"))
+    *fmt = RAW_RGB;
+  else
+    return 0;
+  return 1;
+}
+
+/* the next number of a ppm header, at buf[*i] after white space and
+ * comments; -1 if there is none */
+static long header_number(const char *buf, size_t n, size_t *i)
+{
+  while (*i < n && (buf[*i] == '#' || isspace((unsigned char)buf[*i]))) {
+    if (buf[*i] == '#')
+      while (*i < n && buf[*i] != '\n')
+        (*i)++;
+    else
+      (*i)++;
+  }
+  long v = -1;
+  for (; *i < n && isdigit((unsigned char)buf[*i]) && v < 100000000; (*i)++)
+    v = (v < 0 ? 0 : 10 * v) + (buf[*i] - '0');
+  return v;
+}
+
+/* overwrite rectangle rects[k] of the w by h image in f with fbs[k], for
+ * every k < n, leaving the other pixels as they are. f, open for update,
+ * must hold a binary ppm or headerless rgb image of that size; returns 0,
+ * saying why on stderr, if it does not or cannot be written */
+int image_patch(FILE *f, const char *name, uint w, uint h,
+                framebuffer **fbs, image_rect *rects, uint n)
+{
+  char buf[256];
+  size_t len = fread(buf, 1, sizeof(buf), f);
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0) {
+    fprintf(stderr, "%s: cannot read\n", name);
+    return 0;
+  }
+  uint64_t bytes = 3 * (uint64_t)w * h;
+  uint64_t off = 0;
+  size_t i = 2;
+  long fw = -1, fh = -1, depth = -1;
+  if (len >= 2 && buf[0] == 'P' && buf[1] == '6') {
+    fw = header_number(buf, len, &i);
+    fh = header_number(buf, len, &i);
+    depth = header_number(buf, len, &i);
+  }
+  if (fw >= 0 && fh >= 0 && depth >= 0 && i < len &&
+      isspace((unsigned char)buf[i])) {
+    if (fw != (long)w || fh != (long)h || depth != 255) {
+      fprintf(stderr, "%s: is %ldx%ld with maxval %ld, not %ux%u with "
+              "maxval 255\n", name, fw, fh, depth, w, h);
+      return 0;
+    }
+    off = i + 1;
+  } else if ((uint64_t)st.st_size != bytes) {
+    fprintf(stderr, "%s: neither a binary ppm nor %ux%u raw rgb\n", name,
+            w, h);
+    return 0;
+  }
+  if ((uint64_t)st.st_size < off + bytes) {
+    fprintf(stderr, "%s: truncated\n", name);
+    return 0;
+  }
+  int ok = 1;
+  for (uint k = 0; ok && k < n; k++) {
+    image_rect *r = &rects[k];
+    for (uint y = 0; ok && y < r->h; y++) {
+      uint64_t at = off + 3 * ((uint64_t)(r->y + y) * w + r->x);
+      ok = fseeko(f, (off_t)at, SEEK_SET) == 0 &&
+        fwrite(fbs[k]->rgb + 3 * (size_t)y * r->w, 3, r->w, f) == r->w;
+    }
+  }
+  if (!ok || fflush(f) != 0) {
+    fprintf(stderr, "%s: cannot write\n", name);
+    return 0;
+  }
+  return 1;
+}
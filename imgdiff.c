@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* imgdiff: compare two images of the same size, such as renders of one
+ * scene in float and double, and report the largest and mean difference
+ * of each channel in 8-bit steps.
+ *
+ *   imgdiff [-t max] [-p percent] a.ppm b.ppm
+ *
+ * images are binary or ascii ppm with a maxval of 255. the exit status is
+ * 0 if no channel differs by more than max (default 0), except in at most
+ * percent of the pixels (default 0), 1 if more do and 2 if the images
+ * cannot be compared */
+
+typedef struct {
+  unsigned       width;
+  unsigned       height;
+  unsigned char *rgb;
+} image;
+
+/* the next number of a ppm header, past blanks and comments; -1 if none */
+static long header_number(FILE *f)
+{
+  int c = fgetc(f);
+  for (;;) {
+    while (c != EOF && isspace(c))
+      c = fgetc(f);
+    if (c != '#')
+      break;
+    while (c != EOF && c != '\n')
+      c = fgetc(f);
+  }
+  if (!isdigit(c))
+    return -1;
+  long n = 0;
+  while (isdigit(c) && n < 1000000) {
+    n = n * 10 + (c - '0');
+    c = fgetc(f);
+  }
+  /* one blank ends the header before binary data */
+  if (c != EOF && !isspace(c))
+    return -1;
+  return n;
+}
+
+static int image_read(const char *path, image *im)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "imgdiff: cannot open %s\n", path);
+    return 0;
+  }
+  char magic[2];
+  int ok = fread(magic, 1, 2, f) == 2 && magic[0] == 'P' &&
+    (magic[1] == '6' || magic[1] == '3');
+  long w = ok ? header_number(f) : -1;
+  long h = w > 0 ? header_number(f) : -1;
+  long maxval = h > 0 ? header_number(f) : -1;
+  if (!ok || w <= 0 || h <= 0 || maxval != 255) {
+    fprintf(stderr, "imgdiff: %s is not a ppm image with maxval 255\n",
+            path);
+    fclose(f);
+    return 0;
+  }
+  size_t n = 3 * (size_t)w * h;
+  im->width = w;
+  im->height = h;
+  im->rgb = (unsigned char*)malloc(n);
+  if (!im->rgb) {
+    fprintf(stderr, "imgdiff: out of memory\n");
+    exit(2);
+  }
+  if (magic[1] == '6') {
+    ok = fread(im->rgb, 1, n, f) == n;
+  } else {
+    for (size_t i = 0; ok && i < n; i++) {
+      unsigned v;
+      ok = fscanf(f, "%u", &v) == 1 && v <= 255;
+      im->rgb[i] = v;
+    }
+  }
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "imgdiff: %s is truncated\n", path);
+    free(im->rgb);
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  long limit = 0;
+  double percent = 0;
+  int i = 1;
+  for (; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "-t"))
+      limit = atol(argv[i + 1]);
+    else if (!strcmp(argv[i], "-p"))
+      percent = atof(argv[i + 1]);
+    else
+      break;
+  }
+  if (argc - i != 2) {
+    fprintf(stderr, "usage: %s [-t max] [-p percent] a.ppm b.ppm\n",
+            argv[0]);
+    return 2;
+  }
+  image a, b;
+  if (!image_read(argv[i], &a))
+    return 2;
+  if (!image_read(argv[i + 1], &b))
+    return 2;
+  if (a.width != b.width || a.height != b.height) {
+    fprintf(stderr, "imgdiff: %ux%u and %ux%u differ in size\n", a.width,
+            a.height, b.width, b.height);
+    return 2;
+  }
+  size_t npix = (size_t)a.width * a.height, differing = 0, over = 0;
+  unsigned max[3] = { 0, 0, 0 };
+  unsigned long sum[3] = { 0, 0, 0 };
+  for (size_t p = 0; p < npix; p++) {
+    int any = 0, beyond = 0;
+    for (int c = 0; c < 3; c++) {
+      int d = abs(a.rgb[3 * p + c] - b.rgb[3 * p + c]);
+      sum[c] += d;
+      if ((unsigned)d > max[c])
+        max[c] = d;
+      any |= d != 0;
+      beyond |= d > limit;
+    }
+    differing += any;
+    over += beyond;
+  }
+  static const char *names[3] = { "r", "g", "b" };
+  unsigned worst = 0;
+  printf("{\"width\":%u,\"height\":%u,\"differing_pixels\":%zu,"
+         "\"pixels_over\":%zu", a.width, a.height, differing, over);
+  for (int c = 0; c < 3; c++) {
+    printf(",\"max_%s\":%u,\"mean_%s\":%.6f", names[c], max[c], names[c],
+           (double)sum[c] / npix);
+    if (max[c] > worst)
+      worst = max[c];
+  }
+  printf(",\"max\":%u,\"mean\":%.6f}\n", worst,
+         (double)(sum[0] + sum[1] + sum[2]) / (3 * npix));
+  free(a.rgb);
+  free(b.rgb);
+  return over > percent / 100 * npix ? 1 : 0;
+}
@@ -2,8 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "utils.h"
 #include "raytracer-project2.h"
+#include "vmath.h"
+#include "stats.h"
 
 /*** ran on valgrind. no memory leak.**/
 color* color_dup(color *c)
@@ -44,8 +47,15 @@ void hit_free(hit *h)
   }
 }
 
-vector3 *logical_coord(uint image_height, uint image_width,
-                       uint pixel_row, uint pixel_col)
+/* box a by-value hit for the pointer-based interface */
+hit *hit_box(hitv *h)
+{
+  return hit_new_deep(h->t, &h->surface_color, &h->shine, &h->surface_normal);
+}
+
+/* dx and dy, on [-0.5,0.5), move the point across and down the pixel */
+vector3 logical_coord_at(uint image_height, uint image_width,
+                         uint pixel_row, uint pixel_col, double dx, double dy)
 {
   //association : x ~ col ~ width
   //              y ~ row ~ height
@@ -57,263 +67,672 @@ vector3 *logical_coord(uint image_height, uint image_width,
     x_init *= ((double)image_width / (double)image_height);
     logical_sidelen = 2.0 / image_height;
   }
-  double x = x_init + 0.5 * logical_sidelen + (pixel_col - 1) * logical_sidelen;
-  double y = y_init - 0.5 * logical_sidelen - (pixel_row - 1) * logical_sidelen;
-  return vector3_new(x, y, 0);
+  double x = x_init + (0.5 + dx) * logical_sidelen +
+    (pixel_col - 1) * logical_sidelen;
+  double y = y_init - (0.5 + dy) * logical_sidelen -
+    (pixel_row - 1) * logical_sidelen;
+  return v3(x, y, 0);
 }
 
-int hit_sphere(vector3 *v1, vector3 *v2, sphere *s)
+vector3 logical_coord_v(uint image_height, uint image_width,
+                        uint pixel_row, uint pixel_col)
 {
-  vector3 *a = vector3_sub(v1, s->center);
-  double b = vector3_dot(a, v2);
-  double c = vector3_dot(a, a) - s->radius * s->radius;
+  return logical_coord_at(image_height, image_width, pixel_row, pixel_col,
+                          0, 0);
+}
+
+vector3 *logical_coord(uint image_height, uint image_width,
+                       uint pixel_row, uint pixel_col)
+{
+  return vector3_box(logical_coord_v(image_height, image_width,
+                                     pixel_row, pixel_col));
+}
+
+/* hit_sphere and hit_rect: does the ray hit at some 0 < t < tmax? */
+int hit_sphere(vector3 v1, vector3 v2, sphere *s, double tmax)
+{
+  vector3 a = v3_sub(v1, *s->center);
+  double b = v3_dot(a, v2);
+  double c = v3_dot(a, a) - s->radius * s->radius;
   double d = b * b - c;
   double t = - b - sqrt(d);
-  free(a);
-  return (d > 0 && t > 0) ? 1 : 0;
+  return (d > 0 && t > 0 && t < tmax) ? 1 : 0;
 }
 
-int hit_rect(vector3 *v1, vector3 *v2, rectangle *r)
+/* the rectangle plane is z = upper_left.z, with normal <0,0,-1> */
+int hit_rect(vector3 v1, vector3 v2, rectangle *r, double tmax)
 {
-  int result;
-  ray3 * rr = ray3_new(v1, v2);
-  vector3 *n = vector3_new(0, 0, -1);
+  vector3 n = v3(0, 0, -1);
   double d = r->upper_left->z;
-  double t = -(vector3_dot(v1, n) + d) / vector3_dot(v2, n);
-  vector3 *hitpoint = ray3_position(rr, t);
-  if (t > 0 && hitpoint->x >= r->upper_left->x &&
-      hitpoint->x <= r->upper_left->x + r->w &&
-      hitpoint->y >= r->upper_left->y - r->h &&
-      hitpoint->y <= r->upper_left->y) {
-    result = 1;
-  } else {
-    result = 0;
+  double t = -(v3_dot(v1, n) + d) / v3_dot(v2, n);
+  vector3 hitpoint = ray3v_position(ray3v_make(v1, v2), t);
+  return (t > 0 && t < tmax && hitpoint.x >= r->upper_left->x &&
+          hitpoint.x <= r->upper_left->x + r->w &&
+          hitpoint.y >= r->upper_left->y - r->h &&
+          hitpoint.y <= r->upper_left->y) ? 1 : 0;
+}
+
+/* does a ray from origin along dir hit obj closer than tmax? */
+int occludes(vector3 origin, vector3 dir, double tmax, object *obj)
+{
+  switch (obj->tag) {
+  case SPHERE:
+    return hit_sphere(origin, dir, obj->o.s, tmax);
+  case RECTANGLE:
+    return hit_rect(origin, dir, obj->o.r, tmax);
+  default:
+    fprintf(stderr, "bad tag in obj\n");
+    exit(1);
   }
-  free(rr);
-  free(n);
-  free(hitpoint);
-  return result;
 }
 
-int in_shadow(vector3 *loc, light *dl, object_list *objs)
+/* first object in the list hit by the ray, or NULL; stops at the first
+ * occluder and counts the primitive tests it performed */
+object *first_occluder(object_list *objs, vector3 origin, vector3 dir,
+                       double tmax, unsigned long *tests)
 {
-  int result = 0;
-  vector3 *nudge = vector3_scale(0.0001, dl->direction);
-  vector3 *lifted = vector3_add(loc, nudge);
   while (objs != NULL) {
-    switch (objs->first.tag) {
-    case SPHERE:
-      result += hit_sphere(lifted, dl->direction, objs->first.o.s);
-      break;
-    case RECTANGLE:
-      result += hit_rect(lifted, dl->direction, objs->first.o.r);
-      break;
-    default:
-      fprintf(stderr, "bad tag in obj\n");
-      exit(1);
-    }
+    (*tests)++;
+    if (occludes(origin, dir, tmax, &objs->first))
+      return &objs->first;
     objs = objs->rest;
   }
-  free(nudge);
-  free(lifted);
+  return NULL;
+}
+
+/* how far a ray leaving a surface at p starts off it. the double kernels
+ * need only a fixed 0.0001; the float kernels round p itself to float, so
+ * their margin grows with its distance from the origin, about 500 units
+ * in the last place */
+#define SURFACE_EPSILON 0.0001
+#define SINGLE_EPSILON  0x1p-14
+
+static double surface_epsilon(vector3 p)
+{
+  if (!simd_single())
+    return SURFACE_EPSILON;
+  double m = fmax(fabs(p.x), fmax(fabs(p.y), fabs(p.z)));
+  return fmax(SURFACE_EPSILON, m * SINGLE_EPSILON);
+}
+
+int in_shadow_v(vector3 loc, light *dl, object_list *objs)
+{
+  unsigned long tests = 0;
+  vector3 lifted = v3_add(loc, v3_scale(SURFACE_EPSILON, *dl->direction));
+  return first_occluder(objs, lifted, *dl->direction, INFINITY,
+                        &tests) != NULL;
+}
+
+/* === shadow query statistics and the per-thread occluder cache === */
+
+/* neighbouring pixels tend to be shadowed by the same object, so each thread
+ * remembers the last occluder toward each light and tests it before
+ * anything else. the cache is tagged with shadow_epoch, which is bumped
+ * whenever a compiled scene is freed, so a primitive index from another
+ * scene is never used. lights past SHADOW_CACHE_LIGHTS share slots */
+#define SHADOW_CACHE_LIGHTS 16
+
+static _Thread_local shadow_stats   local_stats;
+static _Thread_local uint           last_occluder[SHADOW_CACHE_LIGHTS];
+static _Thread_local unsigned long  last_epoch = 0;
+static unsigned long                shadow_epoch = 1;
+static shadow_stats                 total_stats;
+static pthread_mutex_t              stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void shadow_cache_invalidate()
+{
+  shadow_epoch++;
+}
+
+void shadow_stats_flush()
+{
+  pthread_mutex_lock(&stats_lock);
+  total_stats.rays += local_stats.rays;
+  total_stats.cache_hits += local_stats.cache_hits;
+  total_stats.tests += local_stats.tests;
+  pthread_mutex_unlock(&stats_lock);
+  memset(&local_stats, 0, sizeof(shadow_stats));
+}
+
+shadow_stats shadow_stats_total()
+{
+  pthread_mutex_lock(&stats_lock);
+  shadow_stats result = total_stats;
+  pthread_mutex_unlock(&stats_lock);
   return result;
 }
 
-//helper for background functional color, color is malloced
-color* bkg_color(ray3 *r, color * (*f)(vector3 *x, vector3 *y))
+void shadow_stats_report(FILE *f, scene *s)
 {
-  double n = (-r->origin->z) / r->direction->z;
-  vector3 *v = vector3_new(r->direction->x * n,
-                           r->direction->y * n, 0);
-  color *c = f(r->origin, v);
-  free(v);
+  unsigned long nobjs = 0;
+  if (s->compiled)
+    nobjs = s->compiled->nspheres + s->compiled->nrects;
+  else
+    for (object_list *ol = s->objects; ol != NULL; ol = ol->rest)
+      nobjs++;
+  shadow_stats st = shadow_stats_total();
+  unsigned long exhaustive = st.rays * nobjs;
+  fprintf(f, "shadow: %lu rays, %lu occluder cache hits, "
+          "%lu primitive tests (%lu avoided)\n",
+          st.rays, st.cache_hits, st.tests,
+          exhaustive > st.tests ? exhaustive - st.tests : 0);
+}
+
+/* shadow test toward light number i, in direction l and dist away
+ * (INFINITY for a directional light): the cached occluder first, then an
+ * early-exit any-hit query on the compiled scene */
+static int shadow_query(scene *s, uint i, vector3 loc, vector3 l, double dist)
+{
+  double eps = surface_epsilon(loc);
+  vector3 lifted = v3_add(loc, v3_scale(eps, l));
+  double tmax = dist - eps;
+  compiled_scene *cs = s->compiled;
+  uint *last = &last_occluder[i % SHADOW_CACHE_LIGHTS];
+  local_stats.rays++;
+  if (cs == NULL)
+    return first_occluder(s->objects, lifted, l, tmax,
+                          &local_stats.tests) != NULL;
+  if (last_epoch != shadow_epoch) {
+    for (int k = 0; k < SHADOW_CACHE_LIGHTS; k++)
+      last_occluder[k] = NO_PRIM;
+    last_epoch = shadow_epoch;
+  }
+  if (*last != NO_PRIM) {
+    /* through the kernels the full search uses, so that under --precision
+     * float a grazing ray is blocked or not whether its occluder was
+     * cached or not, and output does not depend on tile order */
+    uint p = *last, ns = cs->nspheres;
+    uint o = p < ns ? cs_occluder_run(cs, p, 1, 0, 0, lifted, l, tmax,
+                                      &local_stats.tests)
+                    : cs_occluder_run(cs, 0, 0, p - ns, 1, lifted, l, tmax,
+                                      &local_stats.tests);
+    if (o != NO_PRIM) {
+      local_stats.cache_hits++;
+      return 1;
+    }
+  }
+  uint o = cs_occluder(cs, lifted, l, tmax, &local_stats.tests);
+  if (o != NO_PRIM)
+    *last = o;
+  return o != NO_PRIM;
+}
+
+int scene_in_shadow(scene *s, uint light, vector3 loc, vector3 l, double dist)
+{
+  STAT_BEGIN(t0);
+  int shadowed = shadow_query(s, light, loc, l, dist);
+  STAT_END(SP_SHADOW, t0);
+  return shadowed;
+}
+
+int in_shadow(vector3 *loc, light *dl, object_list *objs)
+{
+  return in_shadow_v(*loc, dl, objs);
+}
+
+/* scratch space for short-lived results on the trace path, one arena per
+ * thread between scratch_begin and scratch_end. the renderer resets it
+ * after each batch of pixels, once their colors have been copied out */
+#define SCRATCH_BLOCK (64 << 10)
+
+static _Thread_local arena *scratch = NULL;
+
+void scratch_begin()
+{
+  if (!scratch)
+    scratch = arena_new(SCRATCH_BLOCK);
+}
+
+void scratch_reset()
+{
+  if (scratch)
+    arena_reset(scratch);
+}
+
+void scratch_end()
+{
+  if (scratch) {
+    arena_free(scratch);
+    scratch = NULL;
+  }
+}
+
+/* a color that lives until the next scratch_reset, or a heap color when
+ * this thread has no scratch arena */
+color *color_tmp(double r, double g, double b)
+{
+  if (!scratch)
+    return color_new(r, g, b);
+  color *c = (color*)arena_alloc(scratch, sizeof(color));
+  c->r = r;
+  c->g = g;
+  c->b = b;
   return c;
 }
 
+/* evaluate a functional color; the callback's result comes from
+ * color_tmp or color_new, and only the latter needs freeing */
+color fn_color(color * (*f)(vector3 *x, vector3 *y), vector3 x, vector3 y)
+{
+  color *c = f(&x, &y);
+  color result = *c;
+  STAT_ADD(ST_FUNCTION_CALLS, 1);
+  if (!scratch || !arena_owns(scratch, c))
+    free(c);
+  return result;
+}
+
+//helper for background functional color
+/* where r crosses the z = 0 plane, the point a background function sees */
+static vector3 bkg_point(ray3v r)
+{
+  double n = (-r.origin.z) / r.direction.z;
+  return v3(r.direction.x * n, r.direction.y * n, 0);
+}
+
+color bkg_color(ray3v r, color * (*f)(vector3 *x, vector3 *y))
+{
+  return fn_color(f, r.origin, bkg_point(r));
+}
+
 //this function does not change values from h
-color *light_color(scene * s, ray3 * r, hit * h)
+color light_color_v(scene *s, ray3v r, hitv *h)
 {
   if (h == NULL) {
     switch (s->bg.tag) {
     case CONSTANT:
-      return color_dup(s->bg.c.k);
+      return *s->bg.c.k;
     case FUNCTION:
       return bkg_color(r, s->bg.c.f);
+    case TEXTURE:
+      return texture_eval1(s->bg.c.t, r.origin, bkg_point(r));
     default:
       fprintf(stderr, "bad tag\n");
       exit(1);
     }
   }
-  color *k = h->surface_color;
-  color *d;
-  color *surf_color;
-  vector3 *n = h->surface_normal;
-  vector3 *l = s->dir_light->direction;
-  vector3 *loc = ray3_position(r, h->t);
-  double nl = vector3_dot(n, l);
-  if (in_shadow(loc, s->dir_light, s->objects)) {
-    free(loc);
-    return color_modulate(k, s->amb_light);
-  } else {
-    free(loc);
-    color *tmp1 = color_scale(fmax(nl, 0), s->dir_light->color);
-    color *tmp2 = color_add(s->amb_light, tmp1);
-    surf_color = color_modulate(k, tmp2);
-    free(tmp1);
-    free(tmp2);
-  }
-  if (nl <= 0) {
-    d = color_new(0, 0, 0);
-  } else {
-    vector3 *tmp = vector3_scale(2 * nl, n);
-    vector3 *refl = vector3_sub(tmp, l);
-    free(tmp);
-    vector3 *v = vector3_negate(r->direction);
-    double m = fmax(0, vector3_dot(refl, v));
-    free(refl);
-    free(v);
-    d = color_scale(pow(m, 6), h->shine);
+  color k = h->surface_color;
+  vector3 n = h->surface_normal;
+  vector3 loc = ray3v_position(r, h->t);
+  color sum = *s->amb_light;
+  color spec = col(0, 0, 0);
+  for (uint i = 0; i < s->nlights; i++) {
+    light *li = s->lights[i];
+    vector3 l;
+    color lc = *li->color;
+    double dist = INFINITY;
+    if (li->tag == DIRECTIONAL) {
+      l = *li->direction;
+    } else {
+      vector3 to = v3_sub(*li->position, loc);
+      dist = v3_magnitude(to);
+      l = v3_scale(1 / dist, to);
+      lc = col_scale(1 / (dist * dist), lc);
+    }
+    /* a light behind the surface adds nothing, lit or not */
+    double nl = v3_dot(n, l);
+    if (!(nl > 0)) {
+      STAT_ADD(ST_LIGHTS_BEHIND, 1);
+      continue;
+    }
+    color diffuse = col_scale(nl, lc);
+    vector3 refl = v3_sub(v3_scale(2 * nl, n), l);
+    double m = fmax(0, v3_dot(refl, v3_negate(r.direction)));
+    color d = col_scale(pow(m, 6), h->shine);
+    STAT_ADD(ST_SPECULAR, 1);
+    /* nor is one too dim to matter, so neither needs a shadow ray */
+    color add = col_add(col_modulate(k, diffuse), d);
+    double most = fmax(fabs(add.r), fmax(fabs(add.g), fabs(add.b)));
+    if (most <= s->shading.light_cutoff) {
+      STAT_ADD(ST_LIGHTS_CULLED, 1);
+      continue;
+    }
+    if (scene_in_shadow(s, i, loc, l, dist))
+      continue;
+    sum = col_add(sum, diffuse);
+    spec = col_add(spec, d);
   }
-  color *result = color_add(surf_color, d);
-  free(surf_color);
-  free(d);
-  return result;
+  return col_add(col_modulate(k, sum), spec);
 }
 
 
-hit *intersect_sphere(ray3 * r, sphere * s)
+color *light_color(scene * s, ray3 * r, hit * h)
 {
-  if (r == NULL || s == NULL) {
+  if (h == NULL)
+    return color_box(light_color_v(s, ray3v_of(r), NULL));
+  hitv hv;
+  hv.t = h->t;
+  hv.surface_color = *h->surface_color;
+  hv.shine = *h->shine;
+  hv.surface_normal = *h->surface_normal;
+  return color_box(light_color_v(s, ray3v_of(r), &hv));
+}
+
+int intersect_sphere(ray3v r, sphere * s, hitv *h)
+{
+  if (s == NULL) {
     fprintf(stderr, "null pointer\n");
     exit(1);
   }
-  vector3 *a = vector3_sub(r->origin, s->center);
-  double b = vector3_dot(a, r->direction);
-  double c = vector3_dot(a, a) - s->radius * s->radius;
-  free(a);
+  vector3 a = v3_sub(r.origin, *s->center);
+  double b = v3_dot(a, r.direction);
+  double c = v3_dot(a, a) - s->radius * s->radius;
   double d = b * b - c;
   double t = - b - sqrt(d);
   if (d > 0 && t > 0) {
-    vector3 *hitpoint = ray3_position(r, t);
-    vector3 *norm = vector3_sub(hitpoint, s->center);
-    vector3_normify(norm);
-    hit *h = NULL;
+    vector3 hitpoint = ray3v_position(r, t);
+    h->t = t;
+    h->shine = *s->shine;
+    h->surface_normal = v3_normalize(v3_sub(hitpoint, *s->center));
     switch (s->surf.tag) {
     case CONSTANT:
-    {
-      h = hit_new_deep(t, s->surf.c.k, s->shine, norm);
-      free(norm);
-      free(hitpoint);
-      return h;
-    }
+      h->surface_color = *s->surf.c.k;
+      return 1;
     case FUNCTION:
-    {
-      h = hit_new_shallow(t, (s->surf.c.f)(s->center, hitpoint),
-                          s->shine, norm);
-
-      free(norm);
-      free(hitpoint);
-      return h;
-    }
+      h->surface_color = fn_color(s->surf.c.f, *s->center, hitpoint);
+      return 1;
+    case TEXTURE:
+      h->surface_color = texture_eval1(s->surf.c.t, *s->center, hitpoint);
+      return 1;
     default:
       fprintf(stderr, "bad tag\n");
       exit(1);
     }
-  } else if (d > 0 && t <= 0) {
-    return NULL;
-  } else  {
-    return NULL;
   }
+  return 0;
 }
 
-hit *intersect_rect(ray3 * r, rectangle * rect)
+int intersect_rect(ray3v r, rectangle * rect, hitv *h)
 {
-  if (r == NULL || rect == NULL) {
+  if (rect == NULL) {
     fprintf(stderr, "null pointer\n");
     exit(1);
   }
-  vector3 *n = vector3_new(0, 0, -1);
+  vector3 n = v3(0, 0, -1);
   double d = rect->upper_left->z;
-  double t = -(vector3_dot(r->origin, n) + d) / vector3_dot(r->direction, n);
-  vector3 *hitpoint = ray3_position(r, t);
-  if (t > 0 && hitpoint->x >= rect->upper_left->x &&
-      hitpoint->x <= rect->upper_left->x + rect->w &&
-      hitpoint->y >= rect->upper_left->y - rect->h &&
-      hitpoint->y <= rect->upper_left->y) {
-    hit *h = NULL;
+  double t = -(v3_dot(r.origin, n) + d) / v3_dot(r.direction, n);
+  vector3 hitpoint = ray3v_position(r, t);
+  if (t > 0 && hitpoint.x >= rect->upper_left->x &&
+      hitpoint.x <= rect->upper_left->x + rect->w &&
+      hitpoint.y >= rect->upper_left->y - rect->h &&
+      hitpoint.y <= rect->upper_left->y) {
+    h->t = t;
+    h->shine = *rect->shine;
+    h->surface_normal = n;
     switch (rect->surf.tag) {
     case CONSTANT:
-    {
-      h = hit_new_deep(t, rect->surf.c.k, rect->shine, n);
-      free(hitpoint);
-      free(n);
-      return h;
-    }
+      h->surface_color = *rect->surf.c.k;
+      return 1;
     case FUNCTION:
-    {
-      h = hit_new_shallow(t, (rect->surf.c.f)(rect->upper_left, hitpoint),
-                          rect->shine, n);
-
-      free(hitpoint);
-      free(n);
-      return h;
-    }
+      h->surface_color = fn_color(rect->surf.c.f, *rect->upper_left, hitpoint);
+      return 1;
+    case TEXTURE:
+      h->surface_color = texture_eval1(rect->surf.c.t, *rect->upper_left,
+                                       hitpoint);
+      return 1;
     default :
       fprintf(stderr, "bad tag\n");
       exit(1);
     }
-  } else {
-    free(hitpoint);
-    free(n);
-    return NULL;
   }
+  return 0;
 }
 
-hit *intersect(ray3 * r, object * obj)
+int intersect_v(ray3v r, object * obj, hitv *h)
 {
-  if (r == NULL || obj == NULL) {
+  if (obj == NULL) {
     fprintf(stderr, "null pointer\n");
     exit(1);
   }
   switch (obj->tag) {
   case SPHERE:
-    return intersect_sphere(r, obj->o.s);
+    return intersect_sphere(r, obj->o.s, h);
   case RECTANGLE:
-    return intersect_rect(r, obj->o.r);
+    return intersect_rect(r, obj->o.r, h);
   default:
     fprintf(stderr, "bad tag in obj\n");
     exit(1);
   }
 }
 
-color *trace_ray(ray3 * r, scene * s)
+hit *intersect(ray3 * r, object * obj)
 {
-  if (r == NULL || s == NULL) {
+  if (r == NULL || obj == NULL) {
+    fprintf(stderr, "null pointer\n");
+    exit(1);
+  }
+  hitv h;
+  return intersect_v(ray3v_of(r), obj, &h) ? hit_box(&h) : NULL;
+}
+
+/* color for a hit found on the compiled scene, or the background */
+/* shade n hits from cs_closest into out, n <= TILE_PIXELS. surfaces and
+ * backgrounds with a texture are colored together, one batch per texture,
+ * before any lighting is done */
+void shade_batch(scene *s, ray3v *r, prim_hit *ph, uint n, hitv *h,
+                 color *out)
+{
+  texture *tex[n];
+  double in[TX_INPUTS][n], lanes[TX_INPUTS][n];
+  color tc[n];
+  uint lane[n];
+  texture *bg = s->bg.tag == TEXTURE ? s->bg.c.t : NULL;
+  for (uint k = 0; k < n; k++) {
+    vector3 anchor, point;
+    tex[k] = NULL;
+    if (ph[k].prim == NO_PRIM) {
+      if (!bg)
+        continue;
+      tex[k] = bg;
+      anchor = r[k].origin;
+      point = bkg_point(r[k]);
+    } else {
+      material *m = cs_hit_geometry(s->compiled, r[k], &ph[k], &h[k], &anchor);
+      point = ray3v_position(r[k], ph[k].t);
+      if (m->tag == CONSTANT) {
+        h[k].surface_color = m->k;
+        continue;
+      }
+      if (m->tag == FUNCTION) {
+        h[k].surface_color = fn_color(m->f, anchor, point);
+        continue;
+      }
+      tex[k] = m->t;
+    }
+    in[TX_X][k] = point.x;
+    in[TX_Y][k] = point.y;
+    in[TX_Z][k] = point.z;
+    in[TX_CX][k] = anchor.x;
+    in[TX_CY][k] = anchor.y;
+    in[TX_CZ][k] = anchor.z;
+  }
+  /* gather the points of each texture in turn and run it over all of them */
+  STAT_BEGIN(t0);
+  for (uint k = 0; k < n; k++) {
+    texture *t = tex[k];
+    if (!t)
+      continue;
+    uint m = 0;
+    for (uint j = k; j < n; j++) {
+      if (tex[j] != t)
+        continue;
+      lane[m] = j;
+      for (uint i = 0; i < TX_INPUTS; i++)
+        lanes[i][m] = in[i][j];
+      tex[j] = NULL;
+      m++;
+    }
+    double *cols[TX_INPUTS];
+    for (uint i = 0; i < TX_INPUTS; i++)
+      cols[i] = lanes[i];
+    texture_eval(t, m, cols, tc);
+    for (uint i = 0; i < m; i++) {
+      uint j = lane[i];
+      if (ph[j].prim == NO_PRIM)
+        out[j] = tc[i];
+      else
+        h[j].surface_color = tc[i];
+    }
+  }
+  STAT_END(SP_TEXTURE, t0);
+  STAT_BEGIN(t1);
+  for (uint k = 0; k < n; k++) {
+    if (ph[k].prim != NO_PRIM)
+      out[k] = light_color_v(s, r[k], &h[k]);
+    else if (!bg)
+      out[k] = light_color_v(s, r[k], NULL);
+  }
+  STAT_END(SP_LIGHT, t1);
+}
+
+/* === reflections === */
+
+/* a path reflects off a hit only while its weight, the product of the
+ * shines it has bounced off, stays above the cutoff */
+static int reflect_weight(scene *s, color w, hitv *h, color *out)
+{
+  *out = col_modulate(w, h->shine);
+  return fmax(out->r, fmax(out->g, out->b)) > s->shading.reflect_cutoff;
+}
+
+/* the mirror image of r about the normal at its hit, lifted off the
+ * surface as shadow rays are */
+static ray3v reflect_ray(ray3v r, hitv *h)
+{
+  vector3 n = h->surface_normal;
+  vector3 d = v3_sub(r.direction, v3_scale(2 * v3_dot(r.direction, n), n));
+  vector3 p = ray3v_position(r, h->t);
+  return ray3v_make(v3_add(p, v3_scale(surface_epsilon(p), d)), d);
+}
+
+/* the closest hit along r, colored but not lit; 0 for a miss */
+static int closest_hitv(scene *s, ray3v r, hitv *h)
+{
+  if (s->compiled != NULL) {
+    prim_hit ph;
+    if (!cs_closest(s->compiled, r, &ph))
+      return 0;
+    cs_shade_hit(s->compiled, r, &ph, h);
+    return 1;
+  }
+  hitv cur;
+  int found = 0;
+  for (object_list *ol = s->objects; ol != NULL; ol = ol->rest) {
+    if (intersect_v(r, &(ol->first), &cur) && (!found || h->t > cur.t)) {
+      *h = cur;
+      found = 1;
+    }
+  }
+  return found;
+}
+
+/* c, the lit color of the hit h along r, plus what the hit reflects, one
+ * bounce at a time; adds up in the same order as reflect_batch */
+static color reflect_path(scene *s, ray3v r, hitv *h, color c)
+{
+  color w = col(1, 1, 1);
+  hitv cur = *h;
+  for (uint depth = 0; depth < s->shading.reflect_depth; depth++) {
+    if (!reflect_weight(s, w, &cur, &w))
+      break;
+    r = reflect_ray(r, &cur);
+    STAT_ADD(ST_REFLECT_RAYS, 1);
+    int found = closest_hitv(s, r, &cur);
+    c = col_add(c, col_modulate(w, light_color_v(s, r, found ? &cur : NULL)));
+    if (!found)
+      break;
+  }
+  return c;
+}
+
+/* the reflections of a batch of hits, traced a bounce at a time: every
+ * path still carrying weight casts its reflected ray, and those rays are
+ * found and shaded together as the primary rays were. r, ph and h are
+ * the batch as shade_batch left it, and out its colors */
+void reflect_batch(scene *s, ray3v *r, prim_hit *ph, hitv *h, uint n,
+                   color *out)
+{
+  ray3v rr[n];
+  prim_hit rh[n];
+  hitv hh[n];
+  color w[n], c[n];
+  uint pix[n];
+  uint m = 0;
+  for (uint k = 0; k < n; k++) {
+    if (ph[k].prim == NO_PRIM)
+      continue;
+    rr[m] = r[k];
+    rh[m] = ph[k];
+    hh[m] = h[k];
+    w[m] = col(1, 1, 1);
+    pix[m++] = k;
+  }
+  for (uint depth = 0; depth < s->shading.reflect_depth; depth++) {
+    /* compact the paths that go on; entry i is read before any write */
+    uint next = 0;
+    for (uint i = 0; i < m; i++) {
+      color wi;
+      if (rh[i].prim == NO_PRIM || !reflect_weight(s, w[i], &hh[i], &wi))
+        continue;
+      rr[next] = reflect_ray(rr[i], &hh[i]);
+      w[next] = wi;
+      pix[next++] = pix[i];
+    }
+    m = next;
+    if (m == 0)
+      break;
+    STAT_ADD(ST_REFLECT_RAYS, m);
+    for (uint i = 0; i < m; i++)
+      cs_closest(s->compiled, rr[i], &rh[i]);
+    shade_batch(s, rr, rh, m, hh, c);
+    for (uint i = 0; i < m; i++)
+      out[pix[i]] = col_add(out[pix[i]], col_modulate(w[i], c[i]));
+  }
+}
+
+color shade_prim_hit(scene *s, ray3v r, prim_hit *ph)
+{
+  hitv h;
+  if (ph->prim == NO_PRIM)
+    return light_color_v(s, r, NULL);
+  cs_shade_hit(s->compiled, r, ph, &h);
+  return reflect_path(s, r, &h, light_color_v(s, r, &h));
+}
+
+color trace_ray_v(ray3v r, scene * s)
+{
+  if (s == NULL) {
     fprintf(stderr, "null pointer\n");
     exit(1);
   }
-  hit *closest = NULL;
+  hitv closest, h;
+  int found = 0;
+  if (s->compiled != NULL) {
+    prim_hit ph;
+    cs_closest(s->compiled, r, &ph);
+    return shade_prim_hit(s, r, &ph);
+  }
   object_list *ol = s->objects;
   while (ol != NULL) {
-    hit *h = intersect(r, &(ol->first));
-    if (h != NULL) {
-      if (closest == NULL) {
-        closest = h;
-      } else if (closest->t > h->t) {
-        hit_free(closest);
+    if (intersect_v(r, &(ol->first), &h)) {
+      if (!found || closest.t > h.t) {
         closest = h;
-      } else {
-        hit_free(h);
+        found = 1;
       }
     }
     ol = ol->rest;
   }
   //background
-  if (closest == NULL) {
-    return light_color(s, r, NULL);
-  } else {
-    color *c = light_color(s, r, closest);
-    hit_free(closest);
-    return c;
+  if (!found)
+    return light_color_v(s, r, NULL);
+  return reflect_path(s, r, &closest, light_color_v(s, r, &closest));
+}
+
+color *trace_ray(ray3 * r, scene * s)
+{
+  if (r == NULL || s == NULL) {
+    fprintf(stderr, "null pointer\n");
+    exit(1);
   }
+  return color_box(trace_ray_v(ray3v_of(r), s));
 }
@@ -2,16 +2,47 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <sys/resource.h>
 #include "utils.h"
 #include "raytracer-project2.h"
 
 /* some convenience constructors for objects, etc. */
 
-surface surf_const(double r, double g, double b)
+/* the constructors taking an arena allocate from it when it is not NULL,
+ * in which case the parts are released with the arena, not by the
+ * destructors below */
+static void *scene_alloc(arena *a, size_t n, char *function_name)
+{
+  if (a)
+    return arena_alloc(a, n);
+  void *p = malloc(n);
+  check_malloc(function_name, p);
+  return p;
+}
+
+static vector3 *vec_in(arena *a, double x, double y, double z)
+{
+  vector3 *v = (vector3*)scene_alloc(a, sizeof(vector3), "vector3_new");
+  v->x = x;
+  v->y = y;
+  v->z = z;
+  return v;
+}
+
+static color *col_in(arena *a, double r, double g, double b)
+{
+  color *c = (color*)scene_alloc(a, sizeof(color), "color_new");
+  c->r = r;
+  c->g = g;
+  c->b = b;
+  return c;
+}
+
+surface surf_const(arena *a, double r, double g, double b)
 {
   surface s;
   s.tag = CONSTANT;
-  s.c.k = color_new(r, g, b);
+  s.c.k = col_in(a, r, g, b);
   return s;
 }
 
@@ -23,69 +54,81 @@ surface surf_fn(color * (*f)(vector3*, vector3*))
   return s;
 }
 
+surface surf_tex(texture *t)
+{
+  surface s;
+  s.tag = TEXTURE;
+  s.c.t = t;
+  return s;
+}
+
 /* create a container object for a sphere */
-object *obj_sph(sphere *s)
+object *obj_sph(arena *a, sphere *s)
 {
   if (!s) {
     fprintf(stderr, "obj_sph given NULL\n");
     exit(1);
   }
-  object *o = (object*)malloc(sizeof(object));
-  check_malloc("obj_sph", o);
+  object *o = (object*)scene_alloc(a, sizeof(object), "obj_sph");
   o->tag = SPHERE;
   o->o.s = s;
   return o;
 }
 
 /* create a container object for a rectangle */
-object *obj_rect(rectangle *r)
+object *obj_rect(arena *a, rectangle *r)
 {
   if (!r) {
     fprintf(stderr, "obj_rect given NULL\n");
     exit(1);
   }
-  object *o = (object*)malloc(sizeof(object));
-  check_malloc("obj_rect", o);
+  object *o = (object*)scene_alloc(a, sizeof(object), "obj_rect");
   o->tag = RECTANGLE;
   o->o.r = r;
   return o;
 }
 
 /* private internal sphere constructor that leaves color slot uninitialized */
-sphere *sph(double cx, double cy, double cz, double r, double sr, double sg, double \
-            sb)
+sphere *sph(arena *a, double cx, double cy, double cz, double r,
+            double sr, double sg, double sb)
 {
-  sphere *s = (sphere*)malloc(sizeof(sphere));
-  check_malloc("sph", s);
-  s->center = vector3_new(cx, cy, cz);
+  sphere *s = (sphere*)scene_alloc(a, sizeof(sphere), "sph");
+  s->center = vec_in(a, cx, cy, cz);
   if (r < 0) {
     fprintf(stderr, "sph: r<0 (r=%lf)\n", r);
     exit(1);
   }
   s->radius = r;
-  s->shine = color_new(sr, sg, sb);
+  s->shine = col_in(a, sr, sg, sb);
   return s;
 }
 
 /* solid-color sphere constructor */
+object *sphere_new_in(arena *a, double cx, double cy, double cz,
+                      double r,
+                      double cr, double cg, double cb,
+                      double sr, double sg, double sb)
+{
+  sphere *s = sph(a, cx, cy, cz, r, sr, sg, sb);
+  s->surf   = surf_const(a, cr, cg, cb);
+  return obj_sph(a, s);
+}
+
 object *sphere_new(double cx, double cy, double cz,
                    double r,
                    double cr, double cg, double cb,
                    double sr, double sg, double sb)
 {
-  sphere *s = sph(cx, cy, cz, r, sr, sg, sb);
-  s->surf   = surf_const(cr, cg, cb);
-  return obj_sph(s);
+  return sphere_new_in(NULL, cx, cy, cz, r, cr, cg, cb, sr, sg, sb);
 }
 
 /* private internal rectangle constructor that leaves color slot uninitialized */
-rectangle *rect(double ulx, double uly, double ulz,
+rectangle *rect(arena *a, double ulx, double uly, double ulz,
                 double w, double h,
                 double sr, double sg, double sb)
 {
-  rectangle *r = (rectangle*)malloc(sizeof(rectangle));
-  check_malloc("rect", r);
-  r->upper_left = vector3_new(ulx, uly, ulz);
+  rectangle *r = (rectangle*)scene_alloc(a, sizeof(rectangle), "rect");
+  r->upper_left = vec_in(a, ulx, uly, ulz);
   if (w < 0) {
     fprintf(stderr, "rectangle_new: negative width (%lf)\n", w);
     exit(1);
@@ -96,19 +139,46 @@ rectangle *rect(double ulx, double uly, double ulz,
     exit(1);
   }
   r->h = h;
-  r->shine = color_new(sr, sg, sb);
+  r->shine = col_in(a, sr, sg, sb);
   return r;
 }
 
 /* solid-color rectangle constructor */
+object *rectangle_new_in(arena *a, double ulx, double uly, double ulz,
+                         double w, double h,
+                         double cr, double cg, double cb,
+                         double sr, double sg, double sb)
+{
+  rectangle *r = rect(a, ulx, uly, ulz, w, h, sr, sg, sb);
+  r->surf = surf_const(a, cr, cg, cb);
+  return obj_rect(a, r);
+}
+
 object *rectangle_new(double ulx, double uly, double ulz,
                       double w, double h,
                       double cr, double cg, double cb,
                       double sr, double sg, double sb)
 {
-  rectangle *r = rect(ulx, uly, ulz, w, h, sr, sg, sb);
-  r->surf = surf_const(cr, cg, cb);
-  return obj_rect(r);
+  return rectangle_new_in(NULL, ulx, uly, ulz, w, h, cr, cg, cb, sr, sg, sb);
+}
+
+/* sphere and rectangle colored by a compiled texture */
+object *sphere_new_tex_in(arena *a, double cx, double cy, double cz,
+                          double r, texture *t,
+                          double sr, double sg, double sb)
+{
+  sphere *s = sph(a, cx, cy, cz, r, sr, sg, sb);
+  s->surf   = surf_tex(t);
+  return obj_sph(a, s);
+}
+
+object *rectangle_new_tex_in(arena *a, double ulx, double uly, double ulz,
+                             double w, double h, texture *t,
+                             double sr, double sg, double sb)
+{
+  rectangle *r = rect(a, ulx, uly, ulz, w, h, sr, sg, sb);
+  r->surf = surf_tex(t);
+  return obj_rect(a, r);
 }
 
 /* shallow-copy object list cons */
@@ -121,10 +191,13 @@ object_list *cons(object *o, object_list *os)
   return l;
 }
 
+/* no light culling and no reflections */
+static const shade_settings default_shading = { 0, 0, 0.01 };
+
 /* (mostly) shallow-copy scene constructor */
 scene *scene_new(color *bg, color *amb, light *dl, object_list *objs)
 {
-  if (!bg || !amb || !dl) {
+  if (!bg || !amb) {
     fprintf(stderr, "scene_new: unexpected NULL\n");
     exit(1);
   }
@@ -133,23 +206,57 @@ scene *scene_new(color *bg, color *amb, light *dl, object_list *objs)
   sc->bg.tag = CONSTANT;
   sc->bg.c.k = bg;
   sc->amb_light = amb;
-  sc->dir_light = dl;
+  sc->lights = NULL;
+  sc->nlights = 0;
+  sc->shading = default_shading;
+  if (dl)
+    scene_add_light(sc, dl);
   sc->objects = objs;
+  sc->compiled = NULL;
+  sc->arena = NULL;
+  sc->anim = NULL;
   return sc;
 }
 
+/* the scene takes ownership of l */
+void scene_add_light(scene *sc, light *l)
+{
+  /* grow at powers of two */
+  if ((sc->nlights & (sc->nlights - 1)) == 0) {
+    uint cap = sc->nlights == 0 ? 1 : 2 * sc->nlights;
+    sc->lights = (light**)realloc(sc->lights, cap * sizeof(light*));
+    check_malloc("scene_add_light", sc->lights);
+  }
+  sc->lights[sc->nlights++] = l;
+}
+
 /* dl_new: new directional light */
 /* note: direction vector need not be a unit vector, it is normalized here */
 light *dl_new(double x, double y, double z, double r, double g, double b)
 {
   light *dl = (light*)malloc(sizeof(light));
   check_malloc("dl_new", dl);
+  dl->tag = DIRECTIONAL;
   dl->direction = vector3_new(x, y, z);
   vector3_normify(dl->direction);
+  dl->position = NULL;
   dl->color = color_new(r, g, b);
   return dl;
 }
 
+/* pl_new: new point light at (x, y, z) */
+/* note: the color is the light's strength one unit away */
+light *pl_new(double x, double y, double z, double r, double g, double b)
+{
+  light *pl = (light*)malloc(sizeof(light));
+  check_malloc("pl_new", pl);
+  pl->tag = POINT;
+  pl->direction = NULL;
+  pl->position = vector3_new(x, y, z);
+  pl->color = color_new(r, g, b);
+  return pl;
+}
+
 /* shallow copy environment constructor */
 environment *environment_new(double z, uint w, uint h, scene *sc)
 {
@@ -159,6 +266,12 @@ environment *environment_new(double z, uint w, uint h, scene *sc)
   e->image_width = w;
   e->image_height = h;
   e->scene = sc;
+  e->aa.min = 1;
+  e->aa.max = 1;
+  e->aa.threshold = 0.05;
+  e->view = NULL;
+  e->fast_rays = 0;
+  e->camera = NULL;
   return e;
 }
 
@@ -172,6 +285,7 @@ void surf_free(surface *surf)
     free(surf->c.k);
     break;
   case FUNCTION:
+  case TEXTURE: /* textures are shared, see textures_free */
     break;
   }
 }
@@ -203,19 +317,21 @@ void object_free(object *o) {
   }
 }
 
+/* iterative, so long lists cannot overflow the stack */
 void ol_free(object_list *ol)
 {
-  if (ol == NULL) return;
-  else {
-    ol_free(ol->rest);
+  while (ol != NULL) {
+    object_list *rest = ol->rest;
     object_free(&ol->first);
     free(ol);
+    ol = rest;
   }
 }
 
 void light_free(light *l)
 {
   free(l->direction);
+  free(l->position);
   free(l->color);
   free(l);
 }
@@ -224,122 +340,74 @@ void scene_free(scene *sc)
 {
   surf_free(&sc->bg);
   free(sc->amb_light);
-  light_free(sc->dir_light);
-  ol_free(sc->objects);
+  for (uint i = 0; i < sc->nlights; i++)
+    light_free(sc->lights[i]);
+  free(sc->lights);
+  /* objects built in the scene's arena go all at once */
+  if (sc->arena)
+    arena_free(sc->arena);
+  else
+    ol_free(sc->objects);
+  if (sc->compiled)
+    compiled_scene_free(sc->compiled);
+  if (sc->anim) {
+    free(sc->anim->keys);
+    free(sc->anim);
+  }
   free(sc);
 }
 
 void env_free(environment *e)
 {
   scene_free(e->scene);
+  free(e->view);
+  camera_free(e->camera);
   free(e);
 }
 
 /* *** rendering functions *** */
 
 void render_ppm(FILE *f, environment *e) {
-  fprintf(f, "P3\n");
-  fprintf(f, "%d %d\n", e->image_width, e->image_height);
-  fprintf(f, "255\n");
-  uint w = e->image_width;
-  uint h = e->image_height;
-  for (uint i = 1; i <= h; i++) {
-    for (uint j = 1; j <= w; j++) {
-      vector3 *cam = vector3_new(0, 0, e->camera_z);
-      vector3 *coord = logical_coord(h, w, i, j);
-      vector3 *diff = vector3_sub(coord, cam);
-      vector3_normify(diff);
-      ray3 *r = ray3_new(cam, diff);
-      color *c = trace_ray(r, e->scene);
-      fprintf(f, "%d %d %d\n",
-              (int)(c->r * 255), (int)(c->g * 255), (int)(c->b * 255));
-      free(c);
-      free(cam);
-      free(coord);
-      free(diff);
-      free(r);
-    }
-  }
-}
-
-int is_pre(char* test, char* str) {
-  int len = strlen(test);
-  for (int i = 0; i < len; i++) {
-    if (test[i] != str[i]) {
-      return 0;
-    }
-  }
-  return 1;
+  render_image(f, e, 0, PPM_P6);
 }
 
 environment *read_env()
 {
-  char buf[512];
-  double a[11];
-  color *dummy = color_new(0, 0, 0);
-  light *dummylight = dl_new(0, 0, 0, 0, 0, 0);
-  scene *sc = scene_new(dummy, dummy, dummylight, NULL);
-  environment *env = environment_new(0, 0, 0, sc);
-  while (fgets(buf, 512, stdin) != NULL) {
-    if (is_pre("ENV", buf)) {
-      sscanf(buf, "ENV %lf %lf %lf", &a[0], &a[1], &a[2]);
-      env->camera_z = a[0];
-      env->image_width = (unsigned int)a[1];
-      env->image_height = (unsigned int)a[2];
-    } else if (is_pre("BG", buf)) {
-      sscanf(buf, "BG %lf %lf %lf", &a[0], &a[1], &a[2]);
-      sc->bg.tag = CONSTANT;
-      sc->bg.c.k = color_new(a[0], a[1], a[2]);
-    } else if (is_pre("AMB", buf)) {
-      sscanf(buf, "AMB %lf %lf %lf", &a[0], &a[1], &a[2]);
-      sc->amb_light = color_new(a[0], a[1], a[2]);
-    } else if (is_pre("DL", buf)) {
-      sscanf(buf, "DL %lf %lf %lf %lf %lf %lf", &a[0], &a[1],
-             &a[2], &a[3], &a[4], &a[5]);
-      sc->dir_light = dl_new(a[0], a[1], a[2], a[3], a[4], a[5]);
-    } else if (is_pre("SPHERE", buf)) {
-      sscanf(buf, "SPHERE %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf",
-             &a[0], &a[1], &a[2], &a[3], &a[4],
-             &a[5], &a[6], &a[7], &a[8], &a[9]);
-      object *sp = sphere_new(a[0], a[1], a[2], a[3], a[4],
-                              a[5], a[6], a[7], a[8], a[9]);
-      sc->objects = cons(sp, sc->objects);
-    } else if (is_pre("RECTANGLE", buf)) {
-      sscanf(buf, "RECTANGLE %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf",
-             &a[0], &a[1], &a[2], &a[3], &a[4],
-             &a[5], &a[6], &a[7], &a[8], &a[9], &a[10]);
-      object *rect = rectangle_new(a[0], a[1], a[2], a[3], a[4],
-                                   a[5], a[6], a[7], a[8], a[9], a[10]);
-      sc->objects = cons(rect, sc->objects);
-    } else {
-      fprintf(stderr, "skipping \"%s\"\n", buf);
-    }
-  }
-  free(dummy);
-  light_free(dummylight);
-  return env;
+  return parse_env(stdin);
 }
 
 /* *** functional colors *** */
 
+/* these return scratch colors, which the renderer reclaims in bulk */
+
 color *sphere_color_fn1(vector3 *c, vector3 *hp)
 {
   double r = sin((hp->x + hp->y + hp->z) * 16);
   double d = r / 2.0 + 0.5;
-  return color_new(d / 2.0, d / 1.5, d);
+  return color_tmp(d / 2.0, d / 1.5, d);
 }
 
 color *sphere_color_fn2(vector3 *c, vector3 *hp)
 {
   double r = cos((hp->x + hp->y * hp->z) * 2);
   double d = r / 2.0 + 0.5;
-  return color_new(1.0, d / 1.5, d / 1.1);
+  return color_tmp(1.0, d / 1.5, d / 1.1);
 }
 
 color *sunset(vector3 *ro, vector3 *vp)
 {
   double grad = (1.0 - -vp->y) / 2.0;
-  return color_new((1.0 - grad) / 1.5, 0.0, grad / 2.0);
+  return color_tmp((1.0 - grad) / 1.5, 0.0, grad / 2.0);
+}
+
+object *sphere_new_fn_in(arena *a, double cx, double cy, double cz,
+                         double r,
+                         color * (*f)(vector3*, vector3*),
+                         double sr, double sg, double sb)
+{
+  sphere *s = sph(a, cx, cy, cz, r, sr, sg, sb);
+  s->surf   = surf_fn(f);
+  return obj_sph(a, s);
 }
 
 object *sphere_new_fn(double cx, double cy, double cz,
@@ -347,15 +415,13 @@ object *sphere_new_fn(double cx, double cy, double cz,
                       color * (*f)(vector3*, vector3*),
                       double sr, double sg, double sb)
 {
-  sphere *s = sph(cx, cy, cz, r, sr, sg, sb);
-  s->surf   = surf_fn(f);
-  return obj_sph(s);
+  return sphere_new_fn_in(NULL, cx, cy, cz, r, f, sr, sg, sb);
 }
 
 scene *scene_new_fn(color * (*f)(vector3*, vector3*),
                     color *amb, light *dl, object_list *objs)
 {
-  if (!f || !amb || !dl) {
+  if (!f || !amb) {
     fprintf(stderr, "scene_new: unexpected NULL\n");
     exit(1);
   }
@@ -363,49 +429,641 @@ scene *scene_new_fn(color * (*f)(vector3*, vector3*),
   check_malloc("scene_new_fn", sc);
   sc->bg = surf_fn(f);
   sc->amb_light = amb;
-  sc->dir_light = dl;
+  sc->lights = NULL;
+  sc->nlights = 0;
+  sc->shading = default_shading;
+  if (dl)
+    scene_add_light(sc, dl);
   sc->objects = objs;
+  sc->compiled = NULL;
+  sc->arena = NULL;
+  sc->anim = NULL;
   return sc;
 }
 
 /* *** main program *** */
 
-int main(int argc, char *argv[])
+void usage(char *prog)
 {
-  if (argc == 2 && !strcmp(argv[1], "1")) {
-    /* n.b. WHITE sphere (so you can tell this apart from other similar scenes) */
-    // object *sphere0    = sphere_new(1, 0, 3, 0.6, 1, 1, 1, 0, 0, 0);
-    // object *rectangle0 = rectangle_new(1, 1.3, 4, 1, 2.5, 0, 0, 1, 0, 0, 0);
-    // object_list *objs0 = cons(sphere0, cons(rectangle0, NULL));
-    // scene *scene0      = scene_new(color_new(0.8, 0.8, 0.8),
-    //                                color_new(0.2, 0.2, 0.2),
-    //                                dl_new(-1, 1, -1, 1, 1, 1),
-    //                                objs0);
-    // environment *env0  = environment_new(-3.3, 600, 400, scene0);
-    // render_ppm(stdout, env0);
-    // free(sphere0);
-    // free(rectangle0);
-    // env_free(env0);
-
-    // /****functional colored env****/
-     object *sphere1 = sphere_new_fn(-0.6, 0.2, 13.0, 1.1,
-                                    sphere_color_fn1, 0.8, 0.8, 0.8);
-     object *sphere2 = sphere_new_fn(1.4, -0.15, 16.0, 1.1,
+  fprintf(stderr, "usage: %s [-j threads [--pin]] [--linear] [--fast-rays] "
+          "[--format p6|p3|raw] "
+          "[--simd scalar|sse2|avx2] [--precision float|double] "
+          "[--simd-check] [--camera-check] [--stream] [--timings] "
+          "[--stats] "
+          "[--aa-min N] [--aa-max N] [--aa-threshold T] [--light-cutoff T] "
+          "[--reflect-depth N] [--reflect-cutoff W] "
+          "[--crop x,y,w,h] [--dirty x,y,w,h ... --patch file] "
+          "[--gbuffer file] "
+          "[--workers N] [--connect host:port ...] [--serve [host:]port] "
+          "[--sequence pattern [--frames N]] "
+          "[--scene-cache file] [--compile-scene file] "
+          "[--batch manifest | 1 | < scene]\n",
+          prog);
+  exit(1);
+}
+
+/* "x,y,w,h" for --crop and --dirty */
+static image_rect parse_rect(char *opt, char *arg)
+{
+  int x, y, w, h;
+  char extra;
+  if (sscanf(arg, "%d,%d,%d,%d%c", &x, &y, &w, &h, &extra) != 4 ||
+      x < 0 || y < 0 || w < 1 || h < 1) {
+    fprintf(stderr, "%s: expected x,y,w,h with a positive width and "
+            "height\n", opt);
+    exit(1);
+  }
+  image_rect r = { (uint)x, (uint)y, (uint)w, (uint)h };
+  return r;
+}
+
+/* the built-in scene selected by the "1" argument */
+environment *demo_env()
+{
+  /* n.b. WHITE sphere (so you can tell this apart from other similar scenes) */
+  // object *sphere0    = sphere_new(1, 0, 3, 0.6, 1, 1, 1, 0, 0, 0);
+  // object *rectangle0 = rectangle_new(1, 1.3, 4, 1, 2.5, 0, 0, 1, 0, 0, 0);
+  // object_list *objs0 = cons(sphere0, cons(rectangle0, NULL));
+  // scene *scene0      = scene_new(color_new(0.8, 0.8, 0.8),
+  //                                color_new(0.2, 0.2, 0.2),
+  //                                dl_new(-1, 1, -1, 1, 1, 1),
+  //                                objs0);
+  // environment *env0  = environment_new(-3.3, 600, 400, scene0);
+  // render_ppm(stdout, env0);
+  // free(sphere0);
+  // free(rectangle0);
+  // env_free(env0);
+
+  // /****functional colored env****/
+  object *sphere1 = sphere_new_fn(-0.6, 0.2, 13.0, 1.1,
+                                  sphere_color_fn1, 0.8, 0.8, 0.8);
+  object *sphere2 = sphere_new_fn(1.4, -0.15, 16.0, 1.1,
                                   sphere_color_fn2, 0.8, 0.8, 0.8);
-     object_list *objs1 =  cons(sphere2, cons(sphere1,  NULL));
-     scene *scene1      = scene_new_fn(sunset,
-                                        color_new(0.2, 0.2, 0.2),
-                                        dl_new(-1, 1, -1, 1, 1, 1),
-                                        objs1);
-     environment *env1  = environment_new(-3.3, 800, 240, scene1);
-     render_ppm(stdout, env1);
-     free(sphere1);
-     free(sphere2);
-     env_free(env1);
-  } else if (argc == 1) {
-    environment *e = read_env();
-    render_ppm(stdout, e);
+  object_list *objs1 =  cons(sphere2, cons(sphere1,  NULL));
+  scene *scene1      = scene_new_fn(sunset,
+                                    color_new(0.2, 0.2, 0.2),
+                                    dl_new(-1, 1, -1, 1, 1, 1),
+                                    objs1);
+  free(sphere1);
+  free(sphere2);
+  return environment_new(-3.3, 800, 240, scene1);
+}
+
+/* compile the scene, with a bvh unless a linear scan was requested */
+void prepare(environment *e, int linear)
+{
+  scene_compile(e->scene, !linear);
+}
+
+/* render every entry of a manifest, one "scene-file output-file" pair a
+ * line, on one pool. when an entry has the same objects as the one before
+ * it, it takes over that entry's compiled scene and bvh instead of
+ * building its own */
+void run_batch(char *manifest, worker_pool *p, enum image_format fmt,
+               int linear, int stream, aa_settings aa, shade_settings shading,
+               int fast_rays)
+{
+  FILE *mf = fopen(manifest, "r");
+  if (!mf) {
+    fprintf(stderr, "--batch: cannot open %s\n", manifest);
+    exit(1);
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  unsigned long lineno = 0;
+  uint frames = 0, reuses = 0;
+  environment *prev = NULL;
+  double start = wall_time();
+  while (getline(&line, &cap, mf) != -1) {
+    lineno++;
+    char *scene_path = strtok(line, " \t\r\n");
+    if (!scene_path || scene_path[0] == '#')
+      continue;
+    char *out_path = strtok(NULL, " \t\r\n");
+    if (!out_path || strtok(NULL, " \t\r\n")) {
+      fprintf(stderr, "%s:%lu: expected a scene file and an output file\n",
+              manifest, lineno);
+      exit(1);
+    }
+    double t0 = wall_time();
+    FILE *in = fopen(scene_path, "r");
+    if (!in) {
+      fprintf(stderr, "%s:%lu: cannot open %s\n", manifest, lineno,
+              scene_path);
+      exit(1);
+    }
+    environment *e = parse_env(in);
+    fclose(in);
+    e->aa = aa;
+    e->scene->shading = shading;
+    e->fast_rays = fast_rays;
+    int reused = prev && scene_reuse_compiled(e->scene, prev->scene);
+    if (reused)
+      reuses++;
+    else
+      prepare(e, linear);
+    if (prev)
+      env_free(prev);
+    prev = e;
+
+    FILE *out = fopen(out_path, "wb");
+    if (!out) {
+      fprintf(stderr, "%s:%lu: cannot create %s\n", manifest, lineno,
+              out_path);
+      exit(1);
+    }
+    if (stream) {
+      stream_stats ss;
+      render_stream(out, e, p, fmt, &ss);
+    } else {
+      framebuffer *fb = framebuffer_new(e->image_width, e->image_height);
+      render_frame(fb, e, p);
+      framebuffer_write(out, fb, fmt);
+      framebuffer_free(fb);
+    }
+    if (ferror(out) | fclose(out)) {
+      fprintf(stderr, "%s:%lu: error writing %s\n", manifest, lineno,
+              out_path);
+      exit(1);
+    }
+    frames++;
+    fprintf(stderr, "batch: %s -> %s, %ux%u%s, %.3f s\n", scene_path,
+            out_path, e->image_width, e->image_height,
+            reused ? ", reused previous scene" : "", wall_time() - t0);
+  }
+  if (prev)
+    env_free(prev);
+  textures_free();
+  free(line);
+  fclose(mf);
+  fprintf(stderr, "batch: %u frames, %u reused the previous scene, "
+          "%.3f s\n", frames, reuses, wall_time() - start);
+}
+
+/* wall-clock seconds for each phase of one run */
+typedef struct {
+  double parse;
+  double build;
+  double render;
+  double output;
+  double total;
+  double ttfb;     /* from the start of rendering to the first pixel bytes */
+  size_t buffered; /* most pixel data held before writing */
+} run_times;
+
+/* average primary samples per pixel over the frame */
+double pixel_samples(environment *e)
+{
+  phase_times pt = phase_times_total();
+  return pt.pixels > 0 ? (double)pt.samples / pt.pixels : 0;
+}
+
+/* a pool of nthreads, bound to cpus if pin is set */
+static worker_pool *pool_new_pinned(uint nthreads, int pin)
+{
+  worker_pool *p = pool_new(nthreads);
+  if (pin && !pool_pin(p))
+    fprintf(stderr, "--pin: threads cannot be bound here, running "
+            "unpinned\n");
+  return p;
+}
+
+/* each worker's seconds inside jobs, or idle while the others finished
+ * theirs, as a json array */
+static void print_thread_times(FILE *f, worker_pool *p, int idle)
+{
+  fputc('[', f);
+  for (uint i = 0; p && i < pool_size(p); i++)
+    fprintf(f, "%s%.6f", i ? "," : "",
+            idle ? pool_span(p) - pool_busy(p, i) : pool_busy(p, i));
+  fputc(']', f);
+}
+
+/* one line of json on f, for the benchmark driver. with a pool, the
+ * efficiency is the share of the workers' time in jobs they spent busy */
+void print_timings(FILE *f, environment *e, uint nthreads, worker_pool *p,
+                   run_times *rt)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  long peak_kb = ru.ru_maxrss / 1024; /* bytes on macos */
+#else
+  long peak_kb = ru.ru_maxrss;
+#endif
+  compiled_scene *cs = e->scene->compiled;
+  phase_times pt = phase_times_total();
+  unsigned long primary = pt.rays;
+  unsigned long shadow = shadow_stats_total().rays;
+  double rays = primary + shadow;
+  double busy = 0, efficiency = 1;
+  for (uint i = 0; p && i < pool_size(p); i++)
+    busy += pool_busy(p, i);
+  if (p && pool_span(p) > 0)
+    efficiency = busy / (pool_size(p) * pool_span(p));
+  fprintf(f, "{\"width\":%u,\"height\":%u,\"threads\":%u,"
+          "\"objects\":%u,\"simd\":\"%s\",\"parse_s\":%.6f,"
+          "\"build_s\":%.6f,\"render_s\":%.6f,\"trace_thread_s\":%.6f,"
+          "\"shade_thread_s\":%.6f,\"output_s\":%.6f,\"total_s\":%.6f,"
+          "\"spp\":%.3f,\"primary_rays\":%lu,\"shadow_rays\":%lu,\"rays_per_s\":%.0f,"
+          "\"ns_per_ray\":%.2f,\"ttfb_s\":%.6f,\"buffered_bytes\":%zu,"
+          "\"peak_rss_kb\":%ld,\"pinned\":%d,\"efficiency\":%.3f,"
+          "\"busy_s\":",
+          e->image_width, e->image_height, nthreads,
+          cs ? cs->nspheres + cs->nrects : 0, simd_name(),
+          rt->parse, rt->build, rt->render, pt.trace, pt.shade, rt->output,
+          rt->total, pixel_samples(e), primary, shadow,
+          rt->render > 0 ? rays / rt->render : 0,
+          rays > 0 ? rt->render * 1e9 / rays : 0, rt->ttfb, rt->buffered,
+          peak_kb, p && pool_pinned(p), efficiency);
+  print_thread_times(f, p, 0);
+  fprintf(f, ",\"idle_s\":");
+  print_thread_times(f, p, 1);
+  fprintf(f, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+  uint nthreads = 0;
+  int demo = 0;
+  int linear = 0;
+  int timings = 0;
+  int stats = 0;
+  int stream = 0;
+  char *batch = NULL;
+  char *cache = NULL;
+  int compile_only = 0;
+  enum image_format fmt = PPM_P6;
+  char *simd = NULL;
+  int simd_check = 0;
+  int camera_check = 0;
+  aa_settings aa = { 0, 1, 0.05 }; /* min 0: the larger of 1 and max/4 */
+  shade_settings shading = default_shading;
+  image_rect *rects = NULL; /* from --crop and --dirty */
+  uint nrects = 0, ndirty = 0;
+  char *patch = NULL;
+  char *gbuf = NULL;
+  int fast_rays = 0;
+  int pin = 0;
+  int single = 0;
+  int precision_set = 0;
+  uint nworkers = 0; /* from --workers */
+  char **hosts = NULL; /* from --connect */
+  uint nhosts = 0;
+  char *serve = NULL;
+  char *sequence = NULL;
+  uint frames = 0; /* 0: through the last KEY */
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1) {
+        fprintf(stderr, "-j: thread count must be positive\n");
+        exit(1);
+      }
+      nthreads = (uint)n;
+    } else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+      if (!parse_image_format(argv[++i], &fmt)) {
+        fprintf(stderr, "--format: expected p6, p3 or raw\n");
+        exit(1);
+      }
+    } else if (!strcmp(argv[i], "--simd") && i + 1 < argc) {
+      simd = argv[++i];
+    } else if (!strcmp(argv[i], "--precision") && i + 1 < argc) {
+      i++;
+      if (!strcmp(argv[i], "float") || !strcmp(argv[i], "double")) {
+        single = !strcmp(argv[i], "float");
+        precision_set = 1;
+      } else {
+        fprintf(stderr, "--precision: expected float or double\n");
+        exit(1);
+      }
+    } else if (!strcmp(argv[i], "--simd-check")) {
+      simd_check = 1;
+    } else if (!strcmp(argv[i], "--camera-check")) {
+      camera_check = 1;
+    } else if (!strcmp(argv[i], "--linear")) {
+      linear = 1;
+    } else if (!strcmp(argv[i], "--fast-rays")) {
+      fast_rays = 1;
+    } else if (!strcmp(argv[i], "--pin")) {
+      pin = 1;
+    } else if (!strcmp(argv[i], "--aa-min") && i + 1 < argc) {
+      aa.min = (uint)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--aa-max") && i + 1 < argc) {
+      aa.max = (uint)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--aa-threshold") && i + 1 < argc) {
+      aa.threshold = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--light-cutoff") && i + 1 < argc) {
+      shading.light_cutoff = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--reflect-depth") && i + 1 < argc) {
+      shading.reflect_depth = (uint)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--reflect-cutoff") && i + 1 < argc) {
+      shading.reflect_cutoff = atof(argv[++i]);
+    } else if ((!strcmp(argv[i], "--crop") || !strcmp(argv[i], "--dirty")) &&
+               i + 1 < argc) {
+      rects = (image_rect*)realloc(rects, sizeof(image_rect) * (nrects + 1));
+      check_malloc("main", rects);
+      rects[nrects++] = parse_rect(argv[i], argv[i + 1]);
+      ndirty += !strcmp(argv[i], "--dirty");
+      i++;
+    } else if (!strcmp(argv[i], "--patch") && i + 1 < argc) {
+      patch = argv[++i];
+    } else if (!strcmp(argv[i], "--gbuffer") && i + 1 < argc) {
+      gbuf = argv[++i];
+    } else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1) {
+        fprintf(stderr, "--workers: worker count must be positive\n");
+        exit(1);
+      }
+      nworkers = (uint)n;
+    } else if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+      hosts = (char**)realloc(hosts, sizeof(char*) * (nhosts + 1));
+      check_malloc("main", hosts);
+      hosts[nhosts++] = argv[++i];
+    } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+      serve = argv[++i];
+    } else if (!strcmp(argv[i], "--sequence") && i + 1 < argc) {
+      sequence = argv[++i];
+      if (!frame_pattern_ok(sequence)) {
+        fprintf(stderr, "--sequence: expected a file name with one %%d for "
+                "the frame number\n");
+        exit(1);
+      }
+    } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1) {
+        fprintf(stderr, "--frames: frame count must be positive\n");
+        exit(1);
+      }
+      frames = (uint)n;
+    } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+      batch = argv[++i];
+    } else if (!strcmp(argv[i], "--scene-cache") && i + 1 < argc) {
+      cache = argv[++i];
+    } else if (!strcmp(argv[i], "--compile-scene") && i + 1 < argc) {
+      cache = argv[++i];
+      compile_only = 1;
+    } else if (!strcmp(argv[i], "--stream")) {
+      stream = 1;
+    } else if (!strcmp(argv[i], "--timings")) {
+      timings = 1;
+    } else if (!strcmp(argv[i], "--stats")) {
+      stats = 1;
+    } else if (!strcmp(argv[i], "1")) {
+      demo = 1;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (camera_check)
+    return camera_self_check(stderr) ? 1 : 0;
+  /* --simd and --precision narrow the check to those kernels */
+  if (simd_check)
+    return simd_self_check(stderr, simd, precision_set ? single : -1) ? 1 : 0;
+  simd_select(simd, single);
+  if (aa.min == 0)
+    aa.min = aa.max >= 4 ? aa.max / 4 : 1;
+  if (aa.max < 1 || aa.max > 1024 || aa.min > aa.max) {
+    fprintf(stderr, "--aa-min, --aa-max: need 1 <= min <= max <= 1024\n");
+    exit(1);
+  }
+  if (!(aa.threshold >= 0)) {
+    fprintf(stderr, "--aa-threshold: must not be negative\n");
+    exit(1);
+  }
+  if (!(shading.light_cutoff >= 0)) {
+    fprintf(stderr, "--light-cutoff: must not be negative\n");
+    exit(1);
+  }
+  if (shading.reflect_depth > 64 || !(shading.reflect_cutoff >= 0)) {
+    fprintf(stderr, "--reflect-depth, --reflect-cutoff: need a depth of at "
+            "most 64 and a cutoff of at least 0\n");
+    exit(1);
+  }
+
+  if (pin && (nthreads == 0 || nworkers > 0 || nhosts > 0 || serve)) {
+    fprintf(stderr, "--pin: needs -j, and not with --workers, --connect or "
+            "--serve\n");
+    exit(1);
+  }
+  if (serve)
+    dist_serve(serve, nthreads, simd);
+
+  if (stats && !stats_enabled()) {
+    fprintf(stderr, "--stats: not compiled in, rebuild with make STATS=1\n");
+    exit(1);
+  }
+  if (stats)
+    stats_start();
+  if (nrects > 0 && (stream || batch || compile_only)) {
+    fprintf(stderr, "--crop, --dirty: not with --stream, --batch or "
+            "--compile-scene\n");
+    exit(1);
+  }
+  if (patch && nrects == 0) {
+    fprintf(stderr, "--patch: give the regions with --dirty or --crop\n");
+    exit(1);
+  }
+  if (!patch && ndirty > 0) {
+    fprintf(stderr, "--dirty: needs --patch\n");
+    exit(1);
+  }
+  if (!patch && nrects > 1) {
+    fprintf(stderr, "--crop: only one without --patch\n");
+    exit(1);
+  }
+  if (gbuf && (stream || batch || compile_only || nrects > 0 || aa.max > 1 ||
+               shading.reflect_depth > 0)) {
+    fprintf(stderr, "--gbuffer: not with --stream, --batch, --compile-scene, "
+            "--crop, --dirty, --aa-max or --reflect-depth\n");
+    exit(1);
+  }
+  int distributed = nworkers > 0 || nhosts > 0;
+  if (distributed && (stream || batch || compile_only || nrects > 0 ||
+                      gbuf)) {
+    fprintf(stderr, "--workers, --connect: not with --stream, --batch, "
+            "--compile-scene, --crop, --dirty or --gbuffer\n");
+    exit(1);
+  }
+  if (frames > 0 && !sequence) {
+    fprintf(stderr, "--frames: needs --sequence\n");
+    exit(1);
+  }
+  if (sequence && (stream || batch || compile_only || nrects > 0 || gbuf ||
+                   distributed || cache)) {
+    fprintf(stderr, "--sequence: not with --stream, --batch, --crop, "
+            "--dirty, --gbuffer, --workers, --connect or --scene-cache\n");
+    exit(1);
+  }
+  if (cache && (demo || batch)) {
+    fprintf(stderr, "--scene-cache, --compile-scene: only for a scene read "
+            "from standard input\n");
+    exit(1);
+  }
+  if (compile_only) {
+    scene_text text = scene_text_load(stdin);
+    environment *e = parse_scene_text(&text);
+    prepare(e, linear);
+    int ok = scene_cache_write(cache, e,
+                               scene_text_hash(text.data, text.len),
+                               text.len);
+    if (ok)
+      fprintf(stderr, "scene cache: wrote %s\n", cache);
+    scene_text_free(&text);
     env_free(e);
+    textures_free();
+    return ok ? 0 : 1;
+  }
+
+  if (batch) {
+    worker_pool *p = nthreads > 0 ? pool_new_pinned(nthreads, pin) : NULL;
+    run_batch(batch, p, fmt, linear, stream, aa, shading, fast_rays);
+    if (stats)
+      stats_report(stderr, 0); /* summed over frames; output is not timed */
+    if (p)
+      pool_free(p);
+    return 0;
   }
-  return 0;
+
+  run_times rt;
+  double t0 = wall_time();
+  /* a cached scene arrives compiled, so its build time is part of parse_s */
+  environment *e;
+  if (cache)
+    e = read_env_cached(stdin, cache, linear);
+  else
+    e = demo ? demo_env() : read_env();
+  double t1 = wall_time();
+  e->aa = aa;
+  e->scene->shading = shading;
+  e->fast_rays = fast_rays;
+  if (!cache)
+    prepare(e, linear);
+  for (uint i = 0; i < nrects; i++) {
+    if ((unsigned long)rects[i].x + rects[i].w > e->image_width ||
+        (unsigned long)rects[i].y + rects[i].h > e->image_height) {
+      fprintf(stderr, "--crop, --dirty: %u,%u,%u,%u is not inside the %ux%u "
+              "image\n", rects[i].x, rects[i].y, rects[i].w, rects[i].h,
+              e->image_width, e->image_height);
+      exit(1);
+    }
+  }
+  FILE *pf = NULL;
+  if (patch && !(pf = fopen(patch, "r+b"))) {
+    fprintf(stderr, "--patch: cannot open %s\n", patch);
+    exit(1);
+  }
+  gbuffer *prev = gbuf ? gbuffer_load(gbuf, e) : NULL;
+  double t2 = wall_time();
+  /* with no thread count, render serially on this thread; with workers,
+   * the thread count is theirs */
+  worker_pool *p = nthreads > 0 && !distributed ?
+    pool_new_pinned(nthreads, pin) : NULL;
+  double t3, t4;
+  int failed = 0;
+  if (nrects > 0) {
+    /* only the regions are traced; they go out as an image of the one
+     * crop, or into the patched file */
+    framebuffer **fbs = (framebuffer**)malloc(sizeof(framebuffer*) * nrects);
+    check_malloc("main", fbs);
+    rt.buffered = 0;
+    for (uint i = 0; i < nrects; i++) {
+      fbs[i] = framebuffer_new(rects[i].w, rects[i].h);
+      rt.buffered += 3 * (size_t)rects[i].w * rects[i].h;
+    }
+    render_regions(fbs, rects, nrects, e, p);
+    t3 = wall_time();
+    if (pf)
+      failed = !image_patch(pf, patch, e->image_width, e->image_height, fbs,
+                            rects, nrects);
+    else
+      framebuffer_write(stdout, fbs[0], fmt);
+    t4 = wall_time();
+    rt.ttfb = t3 - t2;
+    if (fmt == PPM_P3 && !pf)
+      rt.buffered *= 5;
+    for (uint i = 0; i < nrects; i++)
+      framebuffer_free(fbs[i]);
+    free(fbs);
+    if (pf && fclose(pf) != 0)
+      failed = 1;
+  } else if (stream) {
+    /* rows are written as they finish, so rendering includes output */
+    stream_stats ss;
+    render_stream(stdout, e, p, fmt, &ss);
+    t3 = t4 = wall_time();
+    rt.ttfb = ss.ttfb;
+    rt.buffered = ss.peak_bytes;
+    fprintf(stderr, "stream: first rows after %.3f ms, at most %zu bytes "
+            "in %u of %u bands buffered\n", ss.ttfb * 1e3, ss.peak_bytes,
+            ss.bands, ss.window);
+  } else if (sequence) {
+    /* frames are written as the next one is traced */
+    animation *an = e->scene->anim;
+    if (frames == 0)
+      frames = an ? an->frames : 1;
+    render_sequence(e, p, sequence, frames, fmt);
+    t3 = t4 = wall_time();
+    rt.ttfb = t3 - t2;
+    rt.buffered = 6 * (size_t)e->image_width * e->image_height;
+  } else if (gbuf) {
+    /* the pixels are kept with their hits for the next run to start from */
+    framebuffer *fb = framebuffer_new(e->image_width, e->image_height);
+    gbuffer *g = gbuffer_new(e->image_width, e->image_height);
+    render_gbuffer(fb, g, prev, e, p);
+    t3 = wall_time();
+    framebuffer_write(stdout, fb, fmt);
+    t4 = wall_time();
+    rt.ttfb = t3 - t2;
+    rt.buffered = 3 * (size_t)e->image_width * e->image_height;
+    if (fmt == PPM_P3)
+      rt.buffered *= 5;
+    failed = !gbuffer_save(gbuf, g, e, fb);
+    phase_times pt = phase_times_total();
+    fprintf(stderr, "gbuffer: %lu of %lu pixels reused, %lu shaded again, "
+            "%lu traced\n", pt.reused, pt.pixels, pt.reshaded, pt.rays);
+    gbuffer_free(g);
+    if (prev)
+      gbuffer_free(prev);
+    framebuffer_free(fb);
+  } else {
+    framebuffer *fb = framebuffer_new(e->image_width, e->image_height);
+    if (distributed)
+      dist_render(fb, e, nworkers, hosts, nhosts, nthreads, simd, linear);
+    else
+      render_frame(fb, e, p);
+    t3 = wall_time();
+    framebuffer_write(stdout, fb, fmt);
+    t4 = wall_time();
+    rt.ttfb = t3 - t2;
+    rt.buffered = 3 * (size_t)e->image_width * e->image_height;
+    if (fmt == PPM_P3)
+      rt.buffered *= 5; /* the formatted text is 12 bytes a pixel */
+    framebuffer_free(fb);
+  }
+  rt.parse = t1 - t0;
+  rt.build = t2 - t1;
+  rt.render = t3 - t2;
+  rt.output = t4 - t3;
+  rt.total = t4 - t0;
+
+  /* workers keep their own counts */
+  if (!distributed)
+    shadow_stats_report(stderr, e->scene);
+  if (aa.max > 1)
+    fprintf(stderr, "aa: %.2f samples per pixel (min %u, max %u, "
+            "threshold %g)\n", pixel_samples(e), aa.min, aa.max,
+            aa.threshold);
+  if (timings)
+    print_timings(stderr, e, nthreads, p, &rt);
+  if (stats)
+    stats_report(stderr, rt.output);
+  if (p)
+    pool_free(p);
+  env_free(e);
+  textures_free();
+  free(rects);
+  free(hosts);
+  return failed ? 1 : 0;
 }
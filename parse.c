@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+
+/* scene file parser. the whole input is mapped (or read in large blocks
+ * when it is a pipe) and scanned once with a cursor, so there is no limit
+ * on line length. numbers are converted by hand, falling back to strtod
+ * only for inputs the fast path cannot convert exactly */
+
+/* ====================================== */
+/* === input                          === */
+/* ====================================== */
+
+#define READ_BLOCK (1 << 20)
+
+scene_text scene_text_load(FILE *f)
+{
+  scene_text in = { NULL, 0, 0 };
+  int fd = fileno(f);
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      lseek(fd, 0, SEEK_CUR) == 0) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      in.data = (char*)p;
+      in.len = st.st_size;
+      in.mapped = 1;
+      return in;
+    }
+  }
+  size_t cap = 0;
+  for (;;) {
+    if (cap - in.len < READ_BLOCK) {
+      cap = cap ? 2 * cap : READ_BLOCK;
+      in.data = (char*)realloc(in.data, cap);
+      check_malloc("scene_text_load", in.data);
+    }
+    size_t n = fread(in.data + in.len, 1, cap - in.len, f);
+    in.len += n;
+    if (n == 0)
+      break;
+  }
+  if (ferror(f)) {
+    fprintf(stderr, "read_env: error reading scene\n");
+    exit(1);
+  }
+  return in;
+}
+
+void scene_text_free(scene_text *in)
+{
+  if (in->mapped)
+    munmap(in->data, in->len);
+  else
+    free(in->data);
+}
+
+/* ====================================== */
+/* === tokens                         === */
+/* ====================================== */
+
+typedef struct {
+  const char   *p;
+  const char   *end;
+  unsigned long line;
+} cursor;
+
+static int is_blank(char ch)
+{
+  return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+}
+
+/* skip blanks on the current line; returns 0 at end of line or input */
+static int skip_blanks(cursor *c)
+{
+  while (c->p < c->end && is_blank(*c->p))
+    c->p++;
+  return c->p < c->end && *c->p != '\n';
+}
+
+/* the token at c->p runs to the next blank or newline */
+static const char *token_end(cursor *c)
+{
+  const char *q = c->p;
+  while (q < c->end && !is_blank(*q) && *q != '\n')
+    q++;
+  return q;
+}
+
+/* move past the rest of this line, complaining if anything is left on it */
+static void end_line(cursor *c, char *kw)
+{
+  if (skip_blanks(c)) {
+    const char *q = token_end(c);
+    fprintf(stderr, "line %lu: unexpected \"%.*s\" after %s\n",
+            c->line, (int)(q - c->p), c->p, kw);
+    exit(1);
+  }
+}
+
+/* ====================================== */
+/* === numbers                        === */
+/* ====================================== */
+
+/* powers of ten that are exact in a double */
+static const double exact_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* strtod on a copy of [s, e), which is not NUL-terminated in the input */
+static int slow_number(const char *s, const char *e, double *out)
+{
+  char small[64];
+  size_t n = e - s;
+  char *buf = n < sizeof(small) ? small : (char*)malloc(n + 1);
+  check_malloc("slow_number", buf);
+  memcpy(buf, s, n);
+  buf[n] = '\0';
+  char *stop;
+  *out = strtod(buf, &stop);
+  int ok = n > 0 && stop == buf + n;
+  if (buf != small)
+    free(buf);
+  return ok;
+}
+
+/* convert [s, e) to a double. decimal mantissas of up to 19 digits are
+ * gathered in an integer; when that integer and the power of ten are both
+ * exact in a double, one multiply or divide gives the correctly rounded
+ * result (Clinger's fast path). anything else goes to strtod */
+static int parse_number(const char *s, const char *e, double *out)
+{
+  const char *p = s;
+  int neg = 0;
+  if (p < e && (*p == '-' || *p == '+'))
+    neg = *p++ == '-';
+  uint64_t m = 0;
+  int ndigits = 0;    /* significant digits gathered in m */
+  int exp10 = 0;
+  int seen = 0;
+  int inexact = 0;
+  for (; p < e && *p >= '0' && *p <= '9'; p++, seen = 1) {
+    if (ndigits < 19) {
+      m = m * 10 + (*p - '0');
+      ndigits += m != 0;
+    } else {
+      exp10++;
+      inexact |= *p != '0';
+    }
+  }
+  if (p < e && *p == '.') {
+    for (p++; p < e && *p >= '0' && *p <= '9'; p++, seen = 1) {
+      if (ndigits < 19) {
+        m = m * 10 + (*p - '0');
+        ndigits += m != 0;
+        exp10--;
+      } else {
+        inexact |= *p != '0';
+      }
+    }
+  }
+  if (!seen)
+    return slow_number(s, e, out);
+  if (p < e && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    int eneg = 0;
+    if (q < e && (*q == '-' || *q == '+'))
+      eneg = *q++ == '-';
+    if (q == e || *q < '0' || *q > '9')
+      return slow_number(s, e, out);
+    int x = 0;
+    for (; q < e && *q >= '0' && *q <= '9'; q++)
+      if (x < 100000)
+        x = x * 10 + (*q - '0');
+    exp10 += eneg ? -x : x;
+    p = q;
+  }
+  if (p != e || inexact || m > (1ULL << 53) || exp10 < -22 || exp10 > 22)
+    return slow_number(s, e, out);
+  double v = (double)m;
+  if (exp10 < 0)
+    v /= exact_pow10[-exp10];
+  else
+    v *= exact_pow10[exp10];
+  *out = neg ? -v : v;
+  return 1;
+}
+
+/* read n numbers from the current line into a */
+static void numbers(cursor *c, char *kw, double *a, int n)
+{
+  for (int i = 0; i < n; i++) {
+    if (!skip_blanks(c)) {
+      fprintf(stderr, "line %lu: %s expects %d numbers, found %d\n",
+              c->line, kw, n, i);
+      exit(1);
+    }
+    const char *q = token_end(c);
+    if (!parse_number(c->p, q, &a[i])) {
+      fprintf(stderr, "line %lu: expected a number, found \"%.*s\"\n",
+              c->line, (int)(q - c->p), c->p);
+      exit(1);
+    }
+    c->p = q;
+  }
+}
+
+/* ====================================== */
+/* === textures                       === */
+/* ====================================== */
+
+/* textures named by TEXTURE records so far; the names point into the
+ * input, which outlives the parse */
+typedef struct {
+  const char *name;
+  size_t      len;
+  texture    *t;
+} named_texture;
+
+typedef struct {
+  named_texture *v;
+  size_t         n;
+  size_t         cap;
+} texture_table;
+
+static texture *texture_lookup(texture_table *tt, const char *name, size_t n)
+{
+  /* the latest definition wins */
+  for (size_t i = tt->n; i-- > 0; )
+    if (tt->v[i].len == n && !memcmp(tt->v[i].name, name, n))
+      return tt->v[i].t;
+  return texture_builtin(name, n);
+}
+
+/* TEXTURE name expression: the expression runs to the end of the line */
+static void texture_define(cursor *c, texture_table *tt, char *kw)
+{
+  if (!skip_blanks(c)) {
+    fprintf(stderr, "line %lu: %s expects a name\n", c->line, kw);
+    exit(1);
+  }
+  const char *name = c->p;
+  const char *q = token_end(c);
+  c->p = q;
+  skip_blanks(c);
+  const char *eol = memchr(c->p, '\n', c->end - c->p);
+  if (!eol)
+    eol = c->end;
+  char err[128];
+  texture *t = texture_compile(c->p, eol - c->p, err, sizeof(err));
+  if (!t) {
+    fprintf(stderr, "line %lu: texture %.*s: %s\n", c->line,
+            (int)(q - name), name, err);
+    exit(1);
+  }
+  if (tt->n == tt->cap) {
+    tt->cap = tt->cap ? 2 * tt->cap : 8;
+    tt->v = (named_texture*)realloc(tt->v, tt->cap * sizeof(named_texture));
+    check_malloc("texture_define", tt->v);
+  }
+  tt->v[tt->n].name = name;
+  tt->v[tt->n].len = q - name;
+  tt->v[tt->n].t = t;
+  tt->n++;
+  c->p = eol;
+}
+
+/* read the name of a texture from the current line */
+static texture *texture_ref(cursor *c, texture_table *tt, char *kw)
+{
+  if (!skip_blanks(c)) {
+    fprintf(stderr, "line %lu: %s expects a texture\n", c->line, kw);
+    exit(1);
+  }
+  const char *q = token_end(c);
+  size_t n = q - c->p;
+  texture *t = texture_lookup(tt, c->p, n);
+  if (!t) {
+    fprintf(stderr, "line %lu: unknown texture \"%.*s\"\n",
+            c->line, (int)n, c->p);
+    exit(1);
+  }
+  c->p = q;
+  return t;
+}
+
+/* ====================================== */
+/* === records                        === */
+/* ====================================== */
+
+enum record { R_UNKNOWN, R_ENV, R_CAMERA, R_BG, R_BGFN, R_AMB, R_DL, R_PL,
+              R_SPHERE, R_SPHEREFN, R_RECTANGLE, R_RECTANGLEFN, R_TEXTURE,
+              R_KEY };
+
+#define KW(lit) (n == sizeof(lit) - 1 && !memcmp(s, lit, n))
+
+/* identify the keyword [s, s+n) by its first letter and length */
+static enum record keyword(const char *s, size_t n)
+{
+  switch (s[0]) {
+  case 'A':
+    return KW("AMB") ? R_AMB : R_UNKNOWN;
+  case 'B':
+    return KW("BG") ? R_BG : KW("BGFN") ? R_BGFN : R_UNKNOWN;
+  case 'C':
+    return KW("CAMERA") ? R_CAMERA : R_UNKNOWN;
+  case 'D':
+    return KW("DL") ? R_DL : R_UNKNOWN;
+  case 'E':
+    return KW("ENV") ? R_ENV : R_UNKNOWN;
+  case 'K':
+    return KW("KEY") ? R_KEY : R_UNKNOWN;
+  case 'P':
+    return KW("PL") ? R_PL : R_UNKNOWN;
+  case 'R':
+    return KW("RECTANGLE") ? R_RECTANGLE :
+           KW("RECTANGLEFN") ? R_RECTANGLEFN : R_UNKNOWN;
+  case 'S':
+    return KW("SPHERE") ? R_SPHERE : KW("SPHEREFN") ? R_SPHEREFN : R_UNKNOWN;
+  case 'T':
+    return KW("TEXTURE") ? R_TEXTURE : R_UNKNOWN;
+  default:
+    return R_UNKNOWN;
+  }
+}
+
+#undef KW
+
+static unsigned long count_lines(scene_text *in)
+{
+  unsigned long n = 1;
+  const char *p = in->data;
+  const char *end = in->data + in->len;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    n++;
+    p++;
+  }
+  return n;
+}
+
+static void check_nonneg(cursor *c, char *what, double v)
+{
+  if (v < 0) {
+    fprintf(stderr, "line %lu: negative %s (%lf)\n", c->line, what, v);
+    exit(1);
+  }
+}
+
+/* the object or light record a KEY record moves: the latest one */
+typedef struct {
+  int     set;
+  int     light;
+  uint    index;
+  vector3 from;  /* where its record puts it */
+} key_target;
+
+/* KEY frame x y z: the target at frame, a whole number past 0 and past its
+ * last key */
+static void key_add(cursor *c, scene *sc, key_target *last, double *a)
+{
+  if (!last->set) {
+    fprintf(stderr, "line %lu: KEY follows no object or light\n", c->line);
+    exit(1);
+  }
+  if (!(a[0] >= 1 && a[0] <= 1e6) || a[0] != (uint)a[0]) {
+    fprintf(stderr, "line %lu: KEY frame must be a whole number from 1 to "
+            "1000000\n", c->line);
+    exit(1);
+  }
+  if (!sc->anim) {
+    sc->anim = (animation*)calloc(1, sizeof(animation));
+    check_malloc("key_add", sc->anim);
+  }
+  animation *an = sc->anim;
+  keyframe *prev = an->nkeys > 0 ? &an->keys[an->nkeys - 1] : NULL;
+  if (prev && prev->light == last->light && prev->target == last->index &&
+      prev->frame >= (uint)a[0]) {
+    fprintf(stderr, "line %lu: KEY frames must increase\n", c->line);
+    exit(1);
+  }
+  if (an->nkeys == an->cap) {
+    an->cap = an->cap ? 2 * an->cap : 16;
+    an->keys = (keyframe*)realloc(an->keys, an->cap * sizeof(keyframe));
+    check_malloc("key_add", an->keys);
+  }
+  keyframe *k = &an->keys[an->nkeys++];
+  k->frame = (uint)a[0];
+  k->target = last->index;
+  k->light = last->light;
+  k->v = v3(a[1], a[2], a[3]);
+  k->from = last->from;
+  if (k->frame + 1 > an->frames)
+    an->frames = k->frame + 1;
+}
+
+/* parse the record starting at c->p, leaving c->p at the end of its line */
+static void parse_record(cursor *c, environment *env, texture_table *tt,
+                         object **objs, size_t *nobjs, key_target *last)
+{
+  scene *sc = env->scene;
+  const char *q = token_end(c);
+  size_t n = q - c->p;
+  enum record r = keyword(c->p, n);
+  if (r == R_UNKNOWN) {
+    const char *eol = memchr(c->p, '\n', c->end - c->p);
+    if (!eol)
+      eol = c->end;
+    fprintf(stderr, "line %lu: skipping \"%.*s\"\n", c->line,
+            (int)(eol - c->p), c->p);
+    c->p = eol;
+    return;
+  }
+  char kw[16];
+  memcpy(kw, c->p, n);
+  kw[n] = '\0';
+  c->p = q;
+  double a[11];
+  texture *t;
+  switch (r) {
+  case R_ENV:
+    numbers(c, kw, a, 3);
+    check_nonneg(c, "image width", a[1]);
+    check_nonneg(c, "image height", a[2]);
+    env->camera_z = a[0];
+    env->image_width = (unsigned int)a[1];
+    env->image_height = (unsigned int)a[2];
+    break;
+  case R_CAMERA:
+    numbers(c, kw, a, 6);
+    if (a[0] == a[3] && a[1] == a[4] && a[2] == a[5]) {
+      fprintf(stderr, "line %lu: CAMERA looks at its own position\n",
+              c->line);
+      exit(1);
+    }
+    if (!env->view) {
+      env->view = (camera_view*)malloc(sizeof(camera_view));
+      check_malloc("parse_record", env->view);
+    }
+    env->view->eye = v3(a[0], a[1], a[2]);
+    env->view->at = v3(a[3], a[4], a[5]);
+    break;
+  case R_BG:
+    numbers(c, kw, a, 3);
+    surf_free(&sc->bg);
+    sc->bg.tag = CONSTANT;
+    sc->bg.c.k = color_new(a[0], a[1], a[2]);
+    break;
+  case R_BGFN:
+    t = texture_ref(c, tt, kw);
+    surf_free(&sc->bg);
+    sc->bg.tag = TEXTURE;
+    sc->bg.c.t = t;
+    break;
+  case R_AMB:
+    numbers(c, kw, a, 3);
+    free(sc->amb_light);
+    sc->amb_light = color_new(a[0], a[1], a[2]);
+    break;
+  case R_DL:
+    numbers(c, kw, a, 6);
+    scene_add_light(sc, dl_new(a[0], a[1], a[2], a[3], a[4], a[5]));
+    break;
+  case R_PL:
+    numbers(c, kw, a, 6);
+    scene_add_light(sc, pl_new(a[0], a[1], a[2], a[3], a[4], a[5]));
+    break;
+  case R_SPHERE:
+    numbers(c, kw, a, 10);
+    check_nonneg(c, "radius", a[3]);
+    objs[(*nobjs)++] = sphere_new_in(sc->arena, a[0], a[1], a[2], a[3], a[4],
+                                  a[5], a[6], a[7], a[8], a[9]);
+    break;
+  case R_SPHEREFN:
+    numbers(c, kw, a, 4);
+    check_nonneg(c, "radius", a[3]);
+    t = texture_ref(c, tt, kw);
+    numbers(c, kw, a + 4, 3);
+    objs[(*nobjs)++] = sphere_new_tex_in(sc->arena, a[0], a[1], a[2], a[3],
+                                         t, a[4], a[5], a[6]);
+    break;
+  case R_RECTANGLE:
+    numbers(c, kw, a, 11);
+    check_nonneg(c, "width", a[3]);
+    check_nonneg(c, "height", a[4]);
+    objs[(*nobjs)++] = rectangle_new_in(sc->arena, a[0], a[1], a[2], a[3],
+                                        a[4], a[5], a[6], a[7], a[8], a[9],
+                                        a[10]);
+    break;
+  case R_RECTANGLEFN:
+    numbers(c, kw, a, 5);
+    check_nonneg(c, "width", a[3]);
+    check_nonneg(c, "height", a[4]);
+    t = texture_ref(c, tt, kw);
+    numbers(c, kw, a + 5, 3);
+    objs[(*nobjs)++] = rectangle_new_tex_in(sc->arena, a[0], a[1], a[2], a[3],
+                                            a[4], t, a[5], a[6], a[7]);
+    break;
+  case R_TEXTURE:
+    texture_define(c, tt, kw);
+    break;
+  case R_KEY:
+    numbers(c, kw, a, 4);
+    key_add(c, sc, last, a);
+    break;
+  default:
+    break;
+  }
+  /* every record that can be keyed starts with the point it places */
+  if (r == R_DL || r == R_PL) {
+    last->set = last->light = 1;
+    last->index = sc->nlights - 1;
+    last->from = v3(a[0], a[1], a[2]);
+  } else if (r >= R_SPHERE && r <= R_RECTANGLEFN) {
+    last->set = 1;
+    last->light = 0;
+    last->index = *nobjs - 1;
+    last->from = v3(a[0], a[1], a[2]);
+  }
+  end_line(c, kw);
+}
+
+environment *parse_scene_text(scene_text *text)
+{
+  scene_text in = *text;
+  /* every object takes a line, so the line count bounds the object count */
+  object **objs = (object**)malloc(count_lines(&in) * sizeof(object*));
+  check_malloc("parse_env", objs);
+  size_t nobjs = 0;
+  texture_table tt = { NULL, 0, 0 };
+
+  scene *sc = scene_new(color_new(0, 0, 0), color_new(0, 0, 0), NULL, NULL);
+  environment *env = environment_new(0, 0, 0, sc);
+  /* objects and list cells live in one arena owned by the scene */
+  sc->arena = arena_new(in.len < (1 << 16) ? 4096 : in.len / 4);
+  cursor c = { in.data, in.data + in.len, 1 };
+  key_target last = { 0, 0, 0, { 0, 0, 0 } };
+  for (;;) {
+    if (skip_blanks(&c))
+      parse_record(&c, env, &tt, objs, &nobjs, &last);
+    if (c.p == c.end)
+      break;
+    c.p++;
+    c.line++;
+  }
+
+  /* link the list last to first, the order the objects were always in,
+   * with the cells contiguous in list order */
+  if (nobjs > 0) {
+    object_list *cells =
+      (object_list*)arena_alloc(sc->arena, nobjs * sizeof(object_list));
+    for (size_t i = 0; i < nobjs; i++) {
+      cells[i].first = *objs[nobjs - 1 - i];
+      cells[i].rest = i + 1 < nobjs ? &cells[i + 1] : NULL;
+    }
+    sc->objects = cells;
+  }
+  free(objs);
+  free(tt.v);
+  /* a scene without lights keeps the black one scenes always had, whose
+   * highlights still show */
+  if (sc->nlights == 0)
+    scene_add_light(sc, dl_new(0, 0, -1, 0, 0, 0));
+  return env;
+}
+
+environment *parse_env(FILE *f)
+{
+  scene_text in = scene_text_load(f);
+  environment *env = parse_scene_text(&in);
+  scene_text_free(&in);
+  return env;
+}
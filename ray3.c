@@ -3,6 +3,7 @@
 #include <string.h>
 #include "utils.h"
 #include "raytracer-project2.h"
+#include "vmath.h"
 
 ray3 *ray3_new(vector3 *origin, vector3 *direction)
 {
@@ -20,10 +21,7 @@ void ray3_free(ray3 *r)
 }
 vector3 *ray3_position(ray3 *r, double t)
 {
-  vector3 *t1 = vector3_scale(t, r->direction);
-  vector3 *t2 = vector3_add(r->origin, t1);
-  free(t1);
-  return t2;
+  return vector3_box(ray3v_position(ray3v_of(r), t));
 }
 
 char* ray_format = "src <%lf,%lf,%lf>, dir <%lf,%lf,%lf>";
@@ -2,6 +2,7 @@
 #define __RAYTRACER_H__
 
 #include <stdio.h>
+#include "utils.h"
 
 /* ====================================== */
 /* ====================================== */
@@ -29,14 +30,25 @@ typedef struct {
   vector3 *direction; /* note: direction must be a unit vector */
 } ray3;
 
+/* by-value ray for the allocation-free operations in vmath.h */
+typedef struct {
+  vector3 origin;
+  vector3 direction; /* note: direction must be a unit vector */
+} ray3v;
+
 enum color_tag {
   CONSTANT,
-  FUNCTION
+  FUNCTION,
+  TEXTURE
 };
 
+/* a compiled texture expression, see texture.c */
+typedef struct texture texture;
+
 union color_union {
   color *k;
   color*(*f)(vector3*, vector3*);
+  texture *t;
 };
 
 typedef struct {
@@ -82,16 +94,119 @@ struct object_list {
 };
 /* convention: NULL is the empty object list */
 
+enum light_tag {
+  DIRECTIONAL,
+  POINT
+};
+
 typedef struct {
-  vector3 *direction; /* unit vector pointing AT the light */
-  color   *color;
+  enum light_tag tag;
+  vector3 *direction; /* DIRECTIONAL: unit vector pointing AT the light */
+  vector3 *position;  /* POINT */
+  color   *color;     /* POINT: at unit distance, falling off as 1/d^2 */
 } light;
 
+typedef struct bvh bvh;
+
+/* a surface and highlight shared by objects in a compiled scene */
+typedef struct {
+  enum color_tag tag;
+  color          k;                      /* CONSTANT */
+  color        *(*f)(vector3*, vector3*); /* FUNCTION */
+  texture       *t;                      /* TEXTURE */
+  color          shine;
+} material;
+
+/* single-precision copies of a compiled scene's geometry for the float
+ * kernels, in the same order and with the same padding */
+typedef struct {
+  float *sph_cx;
+  float *sph_cy;
+  float *sph_cz;
+  float *sph_r;
+  float *rect_x0;
+  float *rect_x1;
+  float *rect_y0;
+  float *rect_y1;
+  float *rect_z;
+} compiled_single;
+
+/* structure-of-arrays form of an object list, built by compile_scene */
+/* every array has SIMD_PAD zeroed entries past its end so the vector
+ * kernels in simd.c can load whole registers */
+#define SIMD_PAD 8
+/* primitives are numbered spheres first: prim i < nspheres is sphere i,
+ * otherwise rectangle i - nspheres */
+typedef struct {
+  uint      nspheres;
+  double   *sph_cx;
+  double   *sph_cy;
+  double   *sph_cz;
+  double   *sph_r;
+  uint     *sph_mat;  /* index into materials */
+  uint     *sph_id;   /* position in the object list; earlier wins ties */
+  uint      nrects;   /* rectangle i spans [x0,x1] x [y0,y1] at z */
+  double   *rect_x0;
+  double   *rect_x1;
+  double   *rect_y0;
+  double   *rect_y1;
+  double   *rect_z;
+  uint     *rect_mat;
+  uint     *rect_id;
+  uint      nmaterials;
+  material *materials;
+  bvh      *accel;    /* NULL means scan the arrays linearly */
+  compiled_single *single; /* NULL unless tracing in float */
+  void     *mapping;  /* the scene cache the arrays live in, or NULL */
+  size_t    mapping_len;
+} compiled_scene;
+
+#define NO_PRIM ((uint)-1)
+
+typedef struct {
+  double t;
+  uint   prim; /* NO_PRIM for a miss */
+} prim_hit;
+
+/* shading options from the command line. reflections use each surface's
+ * shine as its reflectance */
 typedef struct {
-  surface      bg;
-  color       *amb_light;
-  light       *dir_light;
-  object_list *objects;
+  double light_cutoff;   /* skip lights adding at most this */
+  uint   reflect_depth;  /* most mirror bounces a path takes; 0 for none */
+  double reflect_cutoff; /* end paths whose weight is at most this */
+} shade_settings;
+
+/* a KEY record: where an object or light is at a later frame. objects are
+ * numbered in scene file order and lights in the order they were given */
+typedef struct {
+  uint    frame;
+  uint    target;
+  int     light;  /* 1 if target is a light */
+  vector3 v;      /* sphere centre, rectangle upper-left corner, light
+                   * position or direction */
+  vector3 from;   /* the same in frame 0, as its record gives it; for a
+                   * directional light, before it is normalized */
+} keyframe;
+
+/* the KEY records of a scene, in file order; one target's keys are
+ * together, in increasing frame order */
+typedef struct {
+  keyframe *keys;
+  uint      nkeys;
+  uint      cap;
+  uint      frames; /* one past the last frame keyed */
+} animation;
+
+typedef struct {
+  surface         bg;
+  color          *amb_light;
+  light         **lights;
+  uint            nlights;
+  shade_settings  shading;
+  object_list    *objects;
+  compiled_scene *compiled; /* NULL means trace the object list directly */
+  arena          *arena;    /* owns the objects, or NULL if they are heap */
+  animation      *anim;     /* KEY records, or NULL for a still scene */
 } scene;
 
 typedef struct {
@@ -101,16 +216,114 @@ typedef struct {
   vector3 *surface_normal;
 } hit;
 
+/* by-value hit, filled in by intersect_v */
+typedef struct {
+  double  t;
+  color   surface_color;
+  color   shine;
+  vector3 surface_normal;
+} hitv;
+
+/* shadow query counters, kept per thread and summed by shadow_stats_flush */
 typedef struct {
-  double camera_z;
-  uint   image_height;
-  uint   image_width;
-  scene  *scene;
+  unsigned long rays;       /* shadow rays cast */
+  unsigned long cache_hits; /* rays answered by the last-occluder cache */
+  unsigned long tests;      /* primitive tests actually performed */
+} shadow_stats;
+
+/* seconds spent in the render passes, and samples taken, summed over
+ * threads. with anti-aliasing the passes interleave and count as trace */
+typedef struct {
+  double        trace;   /* primary rays to closest hit */
+  double        shade;   /* surface colors, lighting and shadow rays */
+  unsigned long rays;    /* primary rays traced */
+  unsigned long samples; /* of those, the ones averaged into pixels */
+  unsigned long pixels;  /* pixels rendered */
+  unsigned long reused;   /* pixels copied from a g-buffer */
+  unsigned long reshaded; /* pixels shaded from a g-buffer's hits */
+} phase_times;
+
+/* adaptive anti-aliasing: every pixel takes min samples, and those whose
+ * samples disagree or that differ from a neighbour take more, up to max */
+typedef struct {
+  uint   min;
+  uint   max;       /* 1 turns anti-aliasing off */
+  double threshold; /* color difference that marks an edge */
+} aa_settings;
+
+/* a view from a CAMERA record: the image plane passes through at, square
+ * to the line of sight */
+typedef struct {
+  vector3 eye;
+  vector3 at;
+} camera_view;
+
+/* the primary rays of a frame, see camera.c */
+typedef struct camera camera;
+
+typedef struct {
+  double      camera_z;
+  uint        image_height;
+  uint        image_width;
+  scene       *scene;
+  aa_settings aa;
+  camera_view *view;     /* NULL: from (0,0,camera_z) towards the origin */
+  int         fast_rays; /* normalize primary rays approximately */
+  camera      *camera;   /* built by camera_prepare */
 } environment;
 
+typedef struct {
+  uint           width;
+  uint           height;
+  unsigned char *rgb; /* row-major, 3 bytes per pixel */
+} framebuffer;
+
+/* a rectangle of an image, in pixels from its upper left corner */
+typedef struct {
+  uint x, y;
+  uint w, h;
+} image_rect;
+
+/* what each pixel of a frame hit: the key of its object, numbered in scene
+ * file order, or NO_PRIM, and the distance along its primary ray. one
+ * loaded from a file also has its pixels and a plan, how the scene it was
+ * rendered from differs from the one now */
+typedef struct gbuffer_plan gbuffer_plan;
+typedef struct {
+  uint           width;
+  uint           height;
+  uint          *key;
+  double        *t;
+  unsigned char *rgb;
+  gbuffer_plan  *plan;
+} gbuffer;
+
+enum gbuffer_action {
+  GB_REUSE,   /* copy the stored pixel */
+  GB_RESHADE, /* shade the stored hit again */
+  GB_RETRACE  /* trace the primary ray again */
+};
+
+enum image_format {
+  PPM_P6, /* binary ppm, the default */
+  PPM_P3, /* ascii ppm */
+  RAW_RGB /* headerless rgb bytes */
+};
+
+typedef struct worker_pool worker_pool;
+
+/* what a streamed frame held back, from render_stream */
+typedef struct {
+  double ttfb;       /* seconds from the start of rendering to the first rows */
+  size_t peak_bytes; /* most pixel data buffered at once */
+  uint   bands;      /* most row bands buffered at once */
+  uint   window;     /* the bound on bands */
+} stream_stats;
+
 /* === project 2 operations === */
 
 vector3 *vector3_new(double x, double y, double z);
+vector3 *vector3_box(vector3 v);
 vector3 *vector3_add(vector3 *v1, vector3 *v2);
 vector3 *vector3_sub(vector3 *v1, vector3 *v2);
 vector3 *vector3_negate(vector3 *v);
@@ -123,6 +336,7 @@ char    *vector3_tos(vector3 *v);
 void     vector3_show(FILE *f, vector3 *v);
 
 color   *color_new(double r, double g, double b);
+color   *color_box(color c);
 char    *color_tos(color *c);
 void     color_show(FILE *f, color *c);
 
@@ -146,7 +360,241 @@ hit     *intersect(ray3 *r, object *obj); /* return NULL for miss */
 color   *trace_ray(ray3 *r, scene *s);
 void     render_ppm(FILE *f, environment *e);
 
-/* ---> read environment from standard input */
-environment *read_env();
+/* ---> allocation-free equivalents of the above, used on the hot paths */
+int      occludes(vector3 origin, vector3 dir, double tmax, object *obj);
+int      in_shadow_v(vector3 loc, light *dl, object_list *objs);
+object  *first_occluder(object_list *objs, vector3 origin, vector3 dir,
+                        double tmax, unsigned long *tests);
+int      scene_in_shadow(scene *s, uint light, vector3 loc, vector3 l,
+                         double dist); /* dist is INFINITY if directional */
+color    fn_color(color *(*f)(vector3*, vector3*), vector3 x, vector3 y);
+void     scratch_begin();           /* per-thread arena for trace temporaries */
+void     scratch_reset();
+void     scratch_end();
+color   *color_tmp(double r, double g, double b); /* for functional colors */
+void     shadow_cache_invalidate(); /* call when objects are freed */
+void     shadow_stats_flush();      /* add this thread's counters to the total */
+shadow_stats shadow_stats_total();
+void     shadow_stats_report(FILE *f, scene *s);
+color    light_color_v(scene *s, ray3v r, hitv *h); /* h is NULL for a miss */
+vector3  logical_coord_v(uint ih, uint iw, uint pixel_row, uint pixel_col);
+vector3  logical_coord_at(uint ih, uint iw, uint pixel_row, uint pixel_col,
+                          double dx, double dy); /* offset from the centre */
+int      intersect_v(ray3v r, object *obj, hitv *h); /* return 0 for miss */
+color    trace_ray_v(ray3v r, scene *s);
+color    shade_prim_hit(scene *s, ray3v r, prim_hit *ph);
+void     shade_batch(scene *s, ray3v *r, prim_hit *ph, uint n, hitv *h,
+                     color *out); /* leaves the hits in h */
+void     reflect_batch(scene *s, ray3v *r, prim_hit *ph, hitv *h, uint n,
+                       color *out); /* adds reflections to shade_batch's */
+
+/* ---> compiled scenes */
+compiled_scene *compile_scene(object_list *objs);
+void     compiled_scene_free(compiled_scene *cs);
+void     scene_compile(scene *s, int build_bvh); /* reports stats on stderr */
+int      scene_reuse_compiled(scene *s, scene *prev);
+void     cs_build_single(compiled_scene *cs); /* after any bvh_build */
+compiled_scene *cs_clone(compiled_scene *cs); /* with its bvh */
+void     cs_place_sphere(compiled_scene *cs, uint i, vector3 c);
+void     cs_place_rect(compiled_scene *cs, uint i, vector3 ul, double w,
+                       double h);
+int      cs_sphere_hit(compiled_scene *cs, uint i, vector3 o, vector3 d,
+                       double *t);
+int      cs_rect_hit(compiled_scene *cs, uint i, vector3 o, vector3 d,
+                     double *t);
+int      cs_prim_hit(compiled_scene *cs, uint prim, vector3 o, vector3 d,
+                     double *t);
+uint     cs_prim_id(compiled_scene *cs, uint prim);
+void     cs_consider(compiled_scene *cs, prim_hit *best, uint prim, double t);
+int      cs_closest(compiled_scene *cs, ray3v r, prim_hit *h); /* 0 for miss */
+uint     cs_occluder(compiled_scene *cs, vector3 o, vector3 d, double tmax,
+                     unsigned long *tests); /* NO_PRIM if unoccluded */
+void     cs_shade_hit(compiled_scene *cs, ray3v r, prim_hit *ph, hitv *h);
+material *cs_hit_geometry(compiled_scene *cs, ray3v r, prim_hit *ph, hitv *h,
+                          vector3 *anchor); /* all but the surface color */
+
+void     cs_closest_run(compiled_scene *cs, uint sph_first, uint nsph,
+                        uint rect_first, uint nrect, ray3v r, prim_hit *h);
+uint     cs_occluder_run(compiled_scene *cs, uint sph_first, uint nsph,
+                         uint rect_first, uint nrect, vector3 o, vector3 d,
+                         double tmax, unsigned long *tests);
+
+/* ---> simd intersection kernels, chosen at run time */
+/* test one ray against primitives [first, first + n) of a compiled scene,
+ * n <= 32; returns a mask of the hits and stores their t values in t */
+typedef uint (*hit_kernel)(compiled_scene *cs, uint first, uint n,
+                           vector3 o, vector3 d, double *t);
+extern hit_kernel sphere_hits;
+extern hit_kernel rect_hits;
+void     simd_select(char *force, int single); /* force NULL: widest */
+char    *simd_name();
+int      simd_single(); /* tracing with the float kernels */
+int      simd_self_check(FILE *f, char *only, int single); /* mismatches */
+
+/* ---> bounding volume hierarchy over a compiled scene */
+bvh     *bvh_build(compiled_scene *cs); /* reorders the arrays of cs */
+void     bvh_free(bvh *t);
+size_t   bvh_export(bvh *t, const void **nodes); /* returns their size */
+bvh     *bvh_import(void *nodes, size_t bytes, compiled_scene *cs);
+uint     bvh_node_count(bvh *t);
+bvh     *bvh_clone(bvh *t);
+void     bvh_refit(bvh *t, compiled_scene *cs); /* after objects move */
+int      bvh_closest(bvh *t, compiled_scene *cs, ray3v r, prim_hit *h);
+uint     bvh_occluder(bvh *t, compiled_scene *cs, vector3 o, vector3 d,
+                      double tmax, unsigned long *tests);
+
+/* ---> camera and primary rays */
+camera  *camera_new(environment *e);
+void     camera_prepare(environment *e); /* builds e->camera if it has none */
+void     camera_free(camera *c);
+ray3v    camera_ray(camera *c, uint x, uint y); /* pixel (x, y), 0-based */
+ray3v    camera_ray_at(camera *c, uint x, uint y, double dx, double dy);
+void     camera_rays(camera *c, uint x, uint y, uint n, ray3v *out);
+int      camera_self_check(FILE *f); /* returns the rays that differ */
+
+/* ---> parallel tile renderer */
+worker_pool *pool_new(uint nthreads);
+uint         pool_size(worker_pool *p);
+int          pool_pin(worker_pool *p); /* 0 where threads cannot be bound */
+int          pool_pinned(worker_pool *p);
+double       pool_busy(worker_pool *p, uint id);
+double       pool_span(worker_pool *p);
+void         pool_run(worker_pool *p, void (*job)(void *ctx, uint id), void *ctx);
+void         pool_free(worker_pool *p);
+
+color       *pixel_color(environment *e, uint pixel_row, uint pixel_col);
+color        pixel_color_v(environment *e, uint pixel_row, uint pixel_col);
+ray3v        primary_ray(environment *e, uint pixel_row, uint pixel_col);
+ray3v        primary_ray_at(environment *e, uint pixel_row, uint pixel_col,
+                            double dx, double dy);
+void         render_serial(framebuffer *fb, environment *e);
+void         render_tiles(framebuffer *fb, environment *e, worker_pool *p);
+void         render_frame(framebuffer *fb, environment *e, worker_pool *p);
+void         render_regions(framebuffer **fbs, image_rect *rects, uint n,
+                            environment *e, worker_pool *p);
+void         phase_times_flush();
+phase_times  phase_times_total();
+void         render_image(FILE *f, environment *e, uint nthreads,
+                          enum image_format fmt);
+void         render_stream(FILE *f, environment *e, worker_pool *p,
+                           enum image_format fmt, stream_stats *st);
+void         render_gbuffer(framebuffer *fb, gbuffer *out, gbuffer *prev,
+                            environment *e, worker_pool *p); /* prev or NULL */
+
+/* ---> framebuffer and image output */
+framebuffer *framebuffer_new(uint w, uint h);
+void         framebuffer_free(framebuffer *fb);
+void         framebuffer_set(framebuffer *fb, uint x, uint y, color c);
+int          image_header(char *buf, enum image_format fmt, uint w, uint h);
+size_t       p3_rows(char *buf, framebuffer *fb, uint y0, uint y1);
+void         framebuffer_write(FILE *f, framebuffer *fb, enum image_format fmt);
+int          parse_image_format(char *name, enum image_format *fmt);
+int          image_patch(FILE *f, const char *name, uint w, uint h,
+                         framebuffer **fbs, image_rect *rects, uint n);
+
+/* ---> g-buffers for incremental rendering, see gbuffer.c */
+gbuffer *gbuffer_new(uint w, uint h);
+void     gbuffer_free(gbuffer *g);
+gbuffer *gbuffer_load(const char *path, environment *e); /* NULL if unusable */
+int      gbuffer_save(const char *path, gbuffer *g, environment *e,
+                      framebuffer *fb); /* 0 on failure */
+uint     gbuffer_key(compiled_scene *cs, uint prim);
+enum gbuffer_action gbuffer_action(gbuffer *prev, environment *e, size_t i,
+                                   ray3v r, uint *prim);
+
+/* ---> keyframed sequences, see sequence.c */
+int      frame_pattern_ok(const char *pattern); /* one %d, as in f%03d.ppm */
+void     render_sequence(environment *e, worker_pool *p, char *pattern,
+                         uint nframes, enum image_format fmt);
+
+/* ---> rendering on worker processes, see distrib.c */
+void     dist_render(framebuffer *fb, environment *e, uint nlocal,
+                     char **hosts, uint nhosts, uint nthreads, char *simd,
+                     int linear);
+void     dist_serve(char *addr, uint nthreads, char *simd); /* never returns */
+
+/* ---> instrumentation for --stats, see stats.h */
+int      stats_enabled(); /* 0 unless built with -DRT_STATS */
+void     stats_start();   /* the run the report covers starts now */
+void     stats_flush();   /* add this thread's counts to the totals */
+void     stats_report(FILE *f, double output_s); /* one line of json */
+
+/* ---> texture expressions */
+/* inputs of a texture: the hit point and the object's anchor */
+enum { TX_X, TX_Y, TX_Z, TX_CX, TX_CY, TX_CZ, TX_INPUTS };
+texture *texture_compile(const char *src, size_t len, char *err,
+                         size_t errlen); /* NULL with a message in err */
+texture *texture_builtin(const char *name, size_t len); /* fn1, fn2, sunset */
+void     texture_eval(texture *t, uint n, double *in[TX_INPUTS], color *out);
+color    texture_eval1(texture *t, vector3 anchor, vector3 point);
+void     textures_free(); /* every texture compiled so far */
+const char *texture_source(texture *t);
+
+/* ---> scene constructors and destructors */
+/* the _in forms allocate every part from arena a, or the heap if a is NULL */
+object      *sphere_new(double cx, double cy, double cz, double r,
+                        double cr, double cg, double cb,
+                        double sr, double sg, double sb);
+object      *sphere_new_in(arena *a, double cx, double cy, double cz,
+                           double r, double cr, double cg, double cb,
+                           double sr, double sg, double sb);
+object      *sphere_new_fn(double cx, double cy, double cz, double r,
+                           color *(*f)(vector3*, vector3*),
+                           double sr, double sg, double sb);
+object      *sphere_new_fn_in(arena *a, double cx, double cy, double cz,
+                              double r, color *(*f)(vector3*, vector3*),
+                              double sr, double sg, double sb);
+object      *sphere_new_tex_in(arena *a, double cx, double cy, double cz,
+                               double r, texture *t,
+                               double sr, double sg, double sb);
+object      *rectangle_new_tex_in(arena *a, double ulx, double uly, double ulz,
+                                  double w, double h, texture *t,
+                                  double sr, double sg, double sb);
+object      *rectangle_new(double ulx, double uly, double ulz,
+                           double w, double h,
+                           double cr, double cg, double cb,
+                           double sr, double sg, double sb);
+object      *rectangle_new_in(arena *a, double ulx, double uly, double ulz,
+                              double w, double h,
+                              double cr, double cg, double cb,
+                              double sr, double sg, double sb);
+object_list *cons(object *o, object_list *os);
+scene       *scene_new(color *bg, color *amb, light *dl, object_list *objs);
+void         scene_add_light(scene *sc, light *l);
+light       *dl_new(double x, double y, double z,
+                    double r, double g, double b);
+light       *pl_new(double x, double y, double z,
+                    double r, double g, double b);
+environment *environment_new(double z, uint w, uint h, scene *sc);
+void         env_free(environment *e);
+void         surf_free(surface *surf);
+void         light_free(light *l);
+
+/* ---> read environment from a scene file */
+/* the text of a scene file, mapped or read whole */
+typedef struct {
+  char  *data;
+  size_t len;
+  int    mapped;
+} scene_text;
+scene_text   scene_text_load(FILE *f);
+void         scene_text_free(scene_text *t);
+environment *parse_scene_text(scene_text *t);
+environment *parse_env(FILE *f);
+environment *read_env(); /* from standard input */
+
+/* ---> binary scene cache */
+unsigned long scene_text_hash(const char *p, size_t n);
+environment  *scene_cache_load(const char *path, unsigned long hash,
+                               size_t len, int linear); /* NULL if stale */
+int           scene_cache_write(const char *path, environment *e,
+                                unsigned long hash, size_t len);
+int           scene_cache_put(FILE *f, environment *e, unsigned long hash,
+                              size_t len); /* f seekable */
+environment  *scene_cache_map(int fd, const char *name, unsigned long hash,
+                              size_t len, int linear);
+/* the compiled scene on f, loaded from the cache at path if it was built
+ * from the same text and otherwise compiled and written there */
+environment  *read_env_cached(FILE *f, const char *path, int linear);
 
 #endif /* __RAYTRACER_H__ */
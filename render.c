@@ -0,0 +1,1032 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* for sched_getaffinity and pthread_setaffinity_np */
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+#include "stats.h"
+
+/* side length, in pixels, of the square tiles handed to workers */
+#define TILE_SIZE 16
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+/* ====================================== */
+/* === worker pool                    === */
+/* ====================================== */
+
+/* the calling thread acts as worker 0, so a pool of n runs n-1 threads.
+ * each thread's time inside jobs is kept apart from the span of the jobs,
+ * so the time it spent idle, waiting for the others, can be reported */
+
+typedef struct {
+  worker_pool *pool;
+  uint         id;
+} worker_arg;
+
+struct worker_pool {
+  uint            nthreads;
+  pthread_t      *threads;
+  worker_arg     *args;
+  pthread_mutex_t lock;
+  pthread_cond_t  start;
+  pthread_cond_t  done;
+  unsigned long   generation; /* bumped once per pool_run */
+  uint            running;    /* helper threads still inside the job */
+  int             shutdown;
+  void          (*job)(void *ctx, uint id);
+  void           *ctx;
+  int             pinned;     /* threads are bound to cpus, see pool_pin */
+  double         *busy;       /* seconds each thread spent inside jobs */
+  double          span;       /* seconds from the start to the end of jobs */
+};
+
+static void *pool_main(void *p)
+{
+  worker_arg *arg = (worker_arg*)p;
+  worker_pool *pool = arg->pool;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown && pool->generation == seen)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->shutdown)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+    double t0 = wall_time();
+    pool->job(pool->ctx, arg->id);
+    pool->busy[arg->id] += wall_time() - t0;
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+worker_pool *pool_new(uint nthreads)
+{
+  if (nthreads == 0) {
+    fprintf(stderr, "pool_new: need at least one thread\n");
+    exit(1);
+  }
+  worker_pool *p = (worker_pool*)malloc(sizeof(worker_pool));
+  check_malloc("pool_new", p);
+  p->nthreads = nthreads;
+  p->generation = 0;
+  p->running = 0;
+  p->shutdown = 0;
+  p->job = NULL;
+  p->ctx = NULL;
+  p->pinned = 0;
+  p->span = 0;
+  p->busy = (double*)calloc(nthreads, sizeof(double));
+  check_malloc("pool_new", p->busy);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->threads = (pthread_t*)malloc(sizeof(pthread_t) * nthreads);
+  check_malloc("pool_new", p->threads);
+  p->args = (worker_arg*)malloc(sizeof(worker_arg) * nthreads);
+  check_malloc("pool_new", p->args);
+  for (uint i = 1; i < nthreads; i++) {
+    p->args[i].pool = p;
+    p->args[i].id = i;
+    if (pthread_create(&p->threads[i], NULL, pool_main, &p->args[i]) != 0) {
+      fprintf(stderr, "pool_new: pthread_create failed\n");
+      exit(1);
+    }
+  }
+  return p;
+}
+
+uint pool_size(worker_pool *p)
+{
+  return p->nthreads;
+}
+
+/* bind worker i, the calling thread being worker 0, to the i-th cpu this
+ * process may run on, in the order the system numbers them, wrapping
+ * around if there are more workers than cpus. neighbouring workers then
+ * share a node, and memory a worker touches first is placed on its node.
+ * returns 0, binding nothing, where threads cannot be bound */
+int pool_pin(worker_pool *p)
+{
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return 0;
+  int ncpus = CPU_COUNT(&allowed);
+  if (ncpus == 0)
+    return 0;
+  int *cpus = (int*)malloc(sizeof(int) * ncpus);
+  check_malloc("pool_pin", cpus);
+  for (int c = 0, n = 0; n < ncpus; c++) {
+    if (CPU_ISSET(c, &allowed))
+      cpus[n++] = c;
+  }
+  for (uint i = 0; i < p->nthreads; i++) {
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpus[i % ncpus], &one);
+    pthread_t t = i == 0 ? pthread_self() : p->threads[i];
+    if (pthread_setaffinity_np(t, sizeof(one), &one) != 0) {
+      fprintf(stderr, "pool_pin: cannot bind worker %u to cpu %d\n", i,
+              cpus[i % ncpus]);
+      exit(1);
+    }
+  }
+  free(cpus);
+  p->pinned = 1;
+  return 1;
+#else
+  (void)p;
+  return 0;
+#endif
+}
+
+int pool_pinned(worker_pool *p)
+{
+  return p->pinned;
+}
+
+/* seconds worker id spent inside jobs so far; the rest of pool_span it
+ * was idle */
+double pool_busy(worker_pool *p, uint id)
+{
+  return p->busy[id];
+}
+
+/* seconds from the start of each job to its end, summed over jobs */
+double pool_span(worker_pool *p)
+{
+  return p->span;
+}
+
+void pool_run(worker_pool *p, void (*job)(void *ctx, uint id), void *ctx)
+{
+  double t0 = wall_time();
+  pthread_mutex_lock(&p->lock);
+  p->job = job;
+  p->ctx = ctx;
+  p->running = p->nthreads - 1;
+  p->generation++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  double t1 = wall_time();
+  job(ctx, 0);
+  p->busy[0] += wall_time() - t1;
+
+  pthread_mutex_lock(&p->lock);
+  while (p->running > 0)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+  p->span += wall_time() - t0;
+}
+
+void pool_free(worker_pool *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (uint i = 1; i < p->nthreads; i++)
+    pthread_join(p->threads[i], NULL);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->start);
+  pthread_cond_destroy(&p->done);
+  free(p->threads);
+  free(p->args);
+  free(p->busy);
+  free(p);
+}
+
+/* ====================================== */
+/* === work-stealing tile queue       === */
+/* ====================================== */
+
+/* every worker owns a deque of tile indices: it pops its own work from the
+ * head and, once empty, steals from the tail of the other deques. a deque
+ * is filled before the job starts and only shrinks while it runs, so its
+ * head and tail share one atomic word and either end is taken with a
+ * single compare-and-swap, without locks. each deque has a cache line to
+ * itself, so a worker popping its own does not slow down the others */
+
+#define CACHE_LINE 64
+
+typedef struct {
+  _Atomic uint64_t ends;  /* head in the low 32 bits, tail in the high */
+  uint            *tiles;
+  char             pad[CACHE_LINE - sizeof(uint64_t) - sizeof(uint*)];
+} tile_deque;
+
+typedef struct {
+  uint x0, y0; /* upper-left pixel, 0-based */
+  uint x1, y1; /* one past the lower-right pixel */
+} tile;
+
+typedef struct {
+  environment *env;
+  framebuffer *fb;
+  framebuffer **fbs;   /* for render_regions: one per rectangle */
+  image_rect  *rects;
+  uint        *region; /* the rectangle each tile is part of */
+  gbuffer     *gb_out; /* for render_gbuffer: the hits to record */
+  gbuffer     *gb_prev; /* and those of the frame before, or NULL */
+  tile        *tiles;
+  uint         ntiles;
+  tile_deque  *deques;
+  uint         ndeques;
+} tile_job;
+
+static uint64_t deque_ends(uint head, uint tail)
+{
+  return (uint64_t)tail << 32 | head;
+}
+
+/* take a tile from the head of d, or with from_tail, from its tail */
+static int deque_take(tile_deque *d, int from_tail, uint *out)
+{
+  uint64_t ends = atomic_load_explicit(&d->ends, memory_order_relaxed);
+  for (;;) {
+    uint head = (uint)ends, tail = (uint)(ends >> 32);
+    if (head >= tail)
+      return 0;
+    uint64_t rest = from_tail ? deque_ends(head, tail - 1)
+                              : deque_ends(head + 1, tail);
+    if (atomic_compare_exchange_weak_explicit(&d->ends, &ends, rest,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      *out = d->tiles[from_tail ? tail - 1 : head];
+      return 1;
+    }
+  }
+}
+
+static int next_tile(tile_job *job, uint id, uint *out)
+{
+  if (deque_take(&job->deques[id], 0, out))
+    return 1;
+  for (uint k = 1; k < job->ndeques; k++) {
+    if (deque_take(&job->deques[(id + k) % job->ndeques], 1, out))
+      return 1;
+  }
+  return 0;
+}
+
+/* ====================================== */
+/* === rendering                      === */
+/* ====================================== */
+
+/* time spent in the trace and shade passes, summed over threads */
+static _Thread_local phase_times local_times;
+static phase_times               total_times;
+static pthread_mutex_t           times_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void phase_times_flush()
+{
+  pthread_mutex_lock(&times_lock);
+  total_times.trace += local_times.trace;
+  total_times.shade += local_times.shade;
+  total_times.rays += local_times.rays;
+  total_times.samples += local_times.samples;
+  total_times.pixels += local_times.pixels;
+  total_times.reused += local_times.reused;
+  total_times.reshaded += local_times.reshaded;
+  pthread_mutex_unlock(&times_lock);
+  memset(&local_times, 0, sizeof(phase_times));
+}
+
+phase_times phase_times_total()
+{
+  pthread_mutex_lock(&times_lock);
+  phase_times result = total_times;
+  pthread_mutex_unlock(&times_lock);
+  return result;
+}
+
+/* pixel_row and pixel_col are 1-based, as in logical_coord; e must have
+ * its camera */
+ray3v primary_ray_at(environment *e, uint pixel_row, uint pixel_col,
+                     double dx, double dy)
+{
+  return camera_ray_at(e->camera, pixel_col - 1, pixel_row - 1, dx, dy);
+}
+
+ray3v primary_ray(environment *e, uint pixel_row, uint pixel_col)
+{
+  return camera_ray(e->camera, pixel_col - 1, pixel_row - 1);
+}
+
+/* the primary rays of pixels [base, base + m) of t, in row-major order */
+static void tile_rays(environment *e, tile *t, size_t base, uint m,
+                      ray3v *out)
+{
+  uint w = t->x1 - t->x0;
+  for (uint k = 0; k < m; ) {
+    uint x = t->x0 + (base + k) % w, y = t->y0 + (base + k) / w;
+    uint run = t->x1 - x < m - k ? t->x1 - x : m - k;
+    camera_rays(e->camera, x, y, run, out + k);
+    k += run;
+  }
+}
+
+color pixel_color_v(environment *e, uint pixel_row, uint pixel_col)
+{
+  return trace_ray_v(primary_ray(e, pixel_row, pixel_col), e->scene);
+}
+
+color *pixel_color(environment *e, uint pixel_row, uint pixel_col)
+{
+  return color_box(pixel_color_v(e, pixel_row, pixel_col));
+}
+
+/* ====================================== */
+/* === adaptive anti-aliasing         === */
+/* ====================================== */
+
+/* sample k of a pixel sits at the k-th point of the R2 sequence, which
+ * starts at the centre, so one sample per pixel is the unaliased image and
+ * any prefix of the sequence covers the pixel evenly */
+#define R2_A1 0.7548776662466927 /* 1/g and 1/g^2, g the plastic number */
+#define R2_A2 0.5698402909980532
+
+/* running statistics of one pixel's samples */
+typedef struct {
+  color sum;
+  color sq;    /* sums of squares, for the variance */
+  uint  n;
+  uint  id;    /* primitive hit by the first sample */
+  int   mixed; /* the samples hit different primitives */
+} pixel_acc;
+
+/* one pixel of the tile being anti-aliased, with a one-pixel apron so
+ * edges between tiles are found the same way as edges inside them */
+#define AA_SPAN (TILE_SIZE + 2)
+
+static void take_samples(environment *e, pixel_acc *a, uint x, uint y,
+                         uint upto)
+{
+  scene *s = e->scene;
+  for (uint k = a->n; k < upto; k++) {
+    double u = 0.5 + R2_A1 * k, v = 0.5 + R2_A2 * k;
+    ray3v r = primary_ray_at(e, y + 1, x + 1, u - floor(u) - 0.5,
+                             v - floor(v) - 0.5);
+    color c;
+    uint id = NO_PRIM;
+    if (s->compiled) {
+      prim_hit ph;
+      cs_closest(s->compiled, r, &ph);
+      c = shade_prim_hit(s, r, &ph);
+      id = ph.prim;
+    } else {
+      c = trace_ray_v(r, s);
+    }
+    if (k == 0)
+      a->id = id;
+    else if (id != a->id)
+      a->mixed = 1;
+    a->sum = col(a->sum.r + c.r, a->sum.g + c.g, a->sum.b + c.b);
+    a->sq = col(a->sq.r + c.r * c.r, a->sq.g + c.g * c.g,
+                a->sq.b + c.b * c.b);
+  }
+  local_times.rays += upto - a->n;
+  a->n = upto;
+}
+
+static color acc_mean(pixel_acc *a)
+{
+  return col(a->sum.r / a->n, a->sum.g / a->n, a->sum.b / a->n);
+}
+
+/* largest standard error of the mean over the three channels */
+static double acc_error(pixel_acc *a)
+{
+  color m = acc_mean(a);
+  double vr = a->sq.r / a->n - m.r * m.r;
+  double vg = a->sq.g / a->n - m.g * m.g;
+  double vb = a->sq.b / a->n - m.b * m.b;
+  double v = vr > vg ? vr : vg;
+  v = v > vb ? v : vb;
+  return v > 0 ? sqrt(v / a->n) : 0;
+}
+
+static int acc_differ(pixel_acc *a, pixel_acc *b, double threshold)
+{
+  if (a->id != b->id)
+    return 1;
+  color ma = acc_mean(a), mb = acc_mean(b);
+  return fabs(ma.r - mb.r) > threshold || fabs(ma.g - mb.g) > threshold ||
+    fabs(ma.b - mb.b) > threshold;
+}
+
+/* every pixel of t and its apron takes aa.min samples. a pixel whose own
+ * samples disagree, or that differs from one of its four neighbours, then
+ * takes more in doubling rounds, starting at four times the minimum and
+ * stopping at aa.max or once the error of its mean is under half the
+ * threshold */
+static void render_tile_aa(environment *e, framebuffer *fb, tile *t,
+                           uint col0, uint row0)
+{
+  aa_settings *aa = &e->aa;
+  uint ax0 = t->x0 > 0 ? t->x0 - 1 : 0;
+  uint ay0 = t->y0 > 0 ? t->y0 - 1 : 0;
+  uint ax1 = t->x1 < e->image_width ? t->x1 + 1 : t->x1;
+  uint ay1 = t->y1 < e->image_height ? t->y1 + 1 : t->y1;
+  pixel_acc acc[AA_SPAN * AA_SPAN];
+  double t0 = wall_time();
+  for (uint y = ay0; y < ay1; y++) {
+    for (uint x = ax0; x < ax1; x++) {
+      pixel_acc *a = &acc[(y - ay0) * AA_SPAN + (x - ax0)];
+      memset(a, 0, sizeof(pixel_acc));
+      take_samples(e, a, x, y, aa->min);
+    }
+  }
+  scratch_reset();
+  for (uint y = t->y0; y < t->y1; y++) {
+    for (uint x = t->x0; x < t->x1; x++) {
+      pixel_acc *a = &acc[(y - ay0) * AA_SPAN + (x - ax0)];
+      int edge = a->mixed || acc_error(a) > aa->threshold / 2;
+      if (!edge && x > ax0)
+        edge = acc_differ(a, a - 1, aa->threshold);
+      if (!edge && x + 1 < ax1)
+        edge = acc_differ(a, a + 1, aa->threshold);
+      if (!edge && y > ay0)
+        edge = acc_differ(a, a - AA_SPAN, aa->threshold);
+      if (!edge && y + 1 < ay1)
+        edge = acc_differ(a, a + AA_SPAN, aa->threshold);
+      pixel_acc p = *a; /* neighbours still compare against the base */
+      if (edge) {
+        uint n = 4 * p.n;
+        for (;;) {
+          take_samples(e, &p, x, y, n < aa->max ? n : aa->max);
+          if (p.n >= aa->max || acc_error(&p) < aa->threshold / 2)
+            break;
+          n = 2 * p.n;
+        }
+        scratch_reset();
+      }
+      framebuffer_set(fb, x - col0, y - row0, acc_mean(&p));
+      local_times.samples += p.n;
+    }
+  }
+  local_times.trace += wall_time() - t0;
+}
+
+/* render the pixels of t in chunks of TILE_PIXELS: first find the closest
+ * hit of every primary ray, then shade them all, then trace their
+ * reflections a bounce at a time. the upper left pixel of fb is image
+ * pixel (col0, row0) */
+static void render_tile(environment *e, framebuffer *fb, tile *t, uint col0,
+                        uint row0)
+{
+  scene *s = e->scene;
+  uint w = t->x1 - t->x0;
+  size_t n = (size_t)w * (t->y1 - t->y0);
+  local_times.pixels += n;
+  if (e->aa.max > 1) {
+    /* the serial path passes the whole frame; sample it tile by tile */
+    for (uint y = t->y0; y < t->y1; y += TILE_SIZE) {
+      for (uint x = t->x0; x < t->x1; x += TILE_SIZE) {
+        tile sub = { x, y, x + TILE_SIZE < t->x1 ? x + TILE_SIZE : t->x1,
+                     y + TILE_SIZE < t->y1 ? y + TILE_SIZE : t->y1 };
+        render_tile_aa(e, fb, &sub, col0, row0);
+      }
+    }
+    return;
+  }
+  local_times.rays += n;
+  local_times.samples += n;
+  if (s->compiled == NULL) {
+    double t0 = wall_time();
+    for (size_t k = 0; k < n; k++) {
+      uint x = t->x0 + k % w, y = t->y0 + k / w;
+      framebuffer_set(fb, x - col0, y - row0,
+                      pixel_color_v(e, y + 1, x + 1));
+      scratch_reset();
+    }
+    local_times.trace += wall_time() - t0;
+    return;
+  }
+  ray3v rays[TILE_PIXELS];
+  prim_hit hits[TILE_PIXELS];
+  hitv shaded[TILE_PIXELS];
+  color cols[TILE_PIXELS];
+  for (size_t base = 0; base < n; base += TILE_PIXELS) {
+    uint m = n - base < TILE_PIXELS ? n - base : TILE_PIXELS;
+    double t0 = wall_time();
+    tile_rays(e, t, base, m, rays);
+    for (uint k = 0; k < m; k++)
+      cs_closest(s->compiled, rays[k], &hits[k]);
+    double t1 = wall_time();
+    shade_batch(s, rays, hits, m, shaded, cols);
+    if (s->shading.reflect_depth > 0)
+      reflect_batch(s, rays, hits, shaded, m, cols);
+    for (uint k = 0; k < m; k++) {
+      uint x = t->x0 + (base + k) % w, y = t->y0 + (base + k) / w;
+      framebuffer_set(fb, x - col0, y - row0, cols[k]);
+    }
+    scratch_reset();
+    double t2 = wall_time();
+    local_times.trace += t1 - t0;
+    local_times.shade += t2 - t1;
+  }
+}
+
+/* render_tile, recording every pixel's hit in out. with prev, the pixels
+ * gbuffer_action finds unaffected by the changes since it was rendered are
+ * copied from it, and those that only need shading start from its hits */
+static void render_tile_gbuffer(environment *e, framebuffer *fb, tile *t,
+                                gbuffer *out, gbuffer *prev)
+{
+  scene *s = e->scene;
+  compiled_scene *cs = s->compiled;
+  uint w = t->x1 - t->x0;
+  size_t n = (size_t)w * (t->y1 - t->y0);
+  local_times.pixels += n;
+  ray3v all[TILE_PIXELS];
+  ray3v rays[TILE_PIXELS];
+  prim_hit hits[TILE_PIXELS];
+  hitv shaded[TILE_PIXELS];
+  color cols[TILE_PIXELS];
+  size_t at[TILE_PIXELS]; /* the pixel of each ray */
+  for (size_t base = 0; base < n; base += TILE_PIXELS) {
+    uint m = n - base < TILE_PIXELS ? n - base : TILE_PIXELS;
+    uint k = 0;
+    double t0 = wall_time();
+    tile_rays(e, t, base, m, all);
+    for (uint j = 0; j < m; j++) {
+      uint x = t->x0 + (base + j) % w, y = t->y0 + (base + j) / w;
+      size_t i = (size_t)y * fb->width + x;
+      ray3v r = all[j];
+      uint prim;
+      enum gbuffer_action a = prev ? gbuffer_action(prev, e, i, r, &prim)
+        : GB_RETRACE;
+      if (a == GB_REUSE) {
+        memcpy(fb->rgb + 3 * i, prev->rgb + 3 * i, 3);
+        out->key[i] = prev->key[i];
+        out->t[i] = prev->t[i];
+        local_times.reused++;
+        continue;
+      }
+      rays[k] = r;
+      at[k] = i;
+      if (a == GB_RESHADE) {
+        hits[k].prim = prim;
+        hits[k].t = prev->t[i];
+        local_times.reshaded++;
+      } else {
+        cs_closest(cs, r, &hits[k]);
+        local_times.rays++;
+      }
+      k++;
+    }
+    local_times.samples += k;
+    double t1 = wall_time();
+    if (k > 0)
+      shade_batch(s, rays, hits, k, shaded, cols);
+    for (uint j = 0; j < k; j++) {
+      size_t i = at[j];
+      framebuffer_set(fb, i % fb->width, i / fb->width, cols[j]);
+      out->key[i] = hits[j].prim == NO_PRIM ? NO_PRIM
+        : gbuffer_key(cs, hits[j].prim);
+      out->t[i] = hits[j].prim == NO_PRIM ? 0 : hits[j].t;
+    }
+    scratch_reset();
+    double t2 = wall_time();
+    local_times.trace += t1 - t0;
+    local_times.shade += t2 - t1;
+  }
+}
+
+static void tile_worker(void *ctx, uint id)
+{
+  tile_job *job = (tile_job*)ctx;
+  uint t;
+  scratch_begin();
+  while (next_tile(job, id, &t)) {
+    if (job->gb_out) {
+      render_tile_gbuffer(job->env, job->fb, &job->tiles[t], job->gb_out,
+                          job->gb_prev);
+    } else if (job->region) {
+      uint r = job->region[t];
+      render_tile(job->env, job->fbs[r], &job->tiles[t], job->rects[r].x,
+                  job->rects[r].y);
+    } else {
+      render_tile(job->env, job->fb, &job->tiles[t], 0, 0);
+    }
+  }
+  scratch_end();
+  shadow_stats_flush();
+  phase_times_flush();
+  stats_flush();
+}
+
+static uint tile_count(uint w, uint h)
+{
+  return ((w + TILE_SIZE - 1) / TILE_SIZE) * ((h + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+/* cut the w by h rectangle at (x, y) into tiles, in row-major order, at
+ * tiles; returns how many */
+static uint tile_rect(tile *tiles, uint x, uint y, uint w, uint h)
+{
+  uint tw = (w + TILE_SIZE - 1) / TILE_SIZE;
+  uint th = (h + TILE_SIZE - 1) / TILE_SIZE;
+  for (uint ty = 0; ty < th; ty++) {
+    for (uint tx = 0; tx < tw; tx++) {
+      tile *t = &tiles[ty * tw + tx];
+      t->x0 = x + tx * TILE_SIZE;
+      t->y0 = y + ty * TILE_SIZE;
+      t->x1 = (tx + 1) * TILE_SIZE < w ? t->x0 + TILE_SIZE : x + w;
+      t->y1 = (ty + 1) * TILE_SIZE < h ? t->y0 + TILE_SIZE : y + h;
+    }
+  }
+  return tw * th;
+}
+
+/* cut a w by h image into tiles, in row-major order */
+static tile *tile_grid(uint w, uint h, uint *ntiles)
+{
+  tile *tiles = (tile*)malloc(sizeof(tile) * (tile_count(w, h) + 1));
+  check_malloc("tile_grid", tiles);
+  *ntiles = tile_rect(tiles, 0, 0, w, h);
+  return tiles;
+}
+
+/* the band of tile rows a pinned worker owns, [*r0, *r1) of th */
+static void tile_band(uint id, uint n, uint th, uint *r0, uint *r1)
+{
+  *r0 = (uint)((unsigned long)id * th / n);
+  *r1 = (uint)((unsigned long)(id + 1) * th / n);
+}
+
+/* zero the pixel rows of the worker's band, so the pages holding them are
+ * placed on its node before it renders there */
+static void touch_worker(void *ctx, uint id)
+{
+  tile_job *job = (tile_job*)ctx;
+  framebuffer *fb = job->fb;
+  uint r0, r1;
+  tile_band(id, job->ndeques, (fb->height + TILE_SIZE - 1) / TILE_SIZE, &r0,
+            &r1);
+  uint y0 = r0 * TILE_SIZE, y1 = r1 * TILE_SIZE;
+  if (y1 > fb->height)
+    y1 = fb->height;
+  if (y0 < y1)
+    memset(fb->rgb + 3 * (size_t)fb->width * y0, 0,
+           3 * (size_t)fb->width * (y1 - y0));
+}
+
+/* render the tiles of job on the pool */
+static void run_tile_job(tile_job *job, worker_pool *p)
+{
+  uint n = job->ndeques = pool_size(p);
+  /* deal tiles round-robin so every worker starts near the top of the
+   * frame; on a pinned pool, a whole frame is dealt in bands of tile rows
+   * instead, each written first by its owner, so most pixels are written
+   * from the node holding them */
+  int banded = p->pinned && job->region == NULL;
+  uint tw = banded ? (job->fb->width + TILE_SIZE - 1) / TILE_SIZE : 0;
+  uint th = banded ? (job->fb->height + TILE_SIZE - 1) / TILE_SIZE : 0;
+  uint *owner = (uint*)malloc(sizeof(uint) * (job->ntiles + 1));
+  uint *count = (uint*)calloc(n, sizeof(uint));
+  check_malloc("run_tile_job", owner);
+  check_malloc("run_tile_job", count);
+  for (uint t = 0; t < job->ntiles; t++)
+    owner[t] = t % n;
+  for (uint i = 0; banded && i < n; i++) {
+    uint r0, r1;
+    tile_band(i, n, th, &r0, &r1);
+    for (uint t = r0 * tw; t < r1 * tw; t++)
+      owner[t] = i;
+  }
+  for (uint t = 0; t < job->ntiles; t++)
+    count[owner[t]]++;
+  job->deques = (tile_deque*)aligned_alloc(CACHE_LINE,
+                                           sizeof(tile_deque) * n);
+  check_malloc("run_tile_job", job->deques);
+  for (uint i = 0; i < n; i++) {
+    job->deques[i].tiles = (uint*)malloc(sizeof(uint) * (count[i] + 1));
+    check_malloc("run_tile_job", job->deques[i].tiles);
+    count[i] = 0;
+  }
+  for (uint t = 0; t < job->ntiles; t++)
+    job->deques[owner[t]].tiles[count[owner[t]]++] = t;
+  for (uint i = 0; i < n; i++)
+    atomic_init(&job->deques[i].ends, deque_ends(0, count[i]));
+  free(owner);
+  free(count);
+
+  if (banded)
+    pool_run(p, touch_worker, job);
+  pool_run(p, tile_worker, job);
+
+  for (uint i = 0; i < n; i++)
+    free(job->deques[i].tiles);
+  free(job->deques);
+}
+
+void render_tiles(framebuffer *fb, environment *e, worker_pool *p)
+{
+  camera_prepare(e);
+  tile_job job;
+  job.env = e;
+  job.fb = fb;
+  job.region = NULL;
+  job.gb_out = NULL;
+  job.tiles = tile_grid(fb->width, fb->height, &job.ntiles);
+  run_tile_job(&job, p);
+  free(job.tiles);
+}
+
+/* reference path: every pixel in order on the calling thread */
+void render_serial(framebuffer *fb, environment *e)
+{
+  camera_prepare(e);
+  tile all = { 0, 0, fb->width, fb->height };
+  scratch_begin();
+  render_tile(e, fb, &all, 0, 0);
+  scratch_end();
+  shadow_stats_flush();
+  phase_times_flush();
+  stats_flush();
+}
+
+void render_frame(framebuffer *fb, environment *e, worker_pool *p)
+{
+  if (p == NULL)
+    render_serial(fb, e);
+  else
+    render_tiles(fb, e, p);
+}
+
+/* render only rects[0..n) of the image, rectangle i into fbs[i], which is
+ * its size. every pixel comes out as it would in the whole frame, so the
+ * results can be pasted into it; p may be NULL */
+void render_regions(framebuffer **fbs, image_rect *rects, uint n,
+                    environment *e, worker_pool *p)
+{
+  camera_prepare(e);
+  if (p == NULL) {
+    scratch_begin();
+    for (uint i = 0; i < n; i++) {
+      image_rect *r = &rects[i];
+      tile all = { r->x, r->y, r->x + r->w, r->y + r->h };
+      render_tile(e, fbs[i], &all, r->x, r->y);
+    }
+    scratch_end();
+    shadow_stats_flush();
+    phase_times_flush();
+    stats_flush();
+    return;
+  }
+  tile_job job;
+  job.env = e;
+  job.fbs = fbs;
+  job.rects = rects;
+  job.gb_out = NULL;
+  uint total = 0;
+  for (uint i = 0; i < n; i++)
+    total += tile_count(rects[i].w, rects[i].h);
+  job.tiles = (tile*)malloc(sizeof(tile) * (total + 1));
+  job.region = (uint*)malloc(sizeof(uint) * (total + 1));
+  check_malloc("render_regions", job.tiles);
+  check_malloc("render_regions", job.region);
+  job.ntiles = 0;
+  for (uint i = 0; i < n; i++) {
+    uint k = tile_rect(job.tiles + job.ntiles, rects[i].x, rects[i].y,
+                       rects[i].w, rects[i].h);
+    for (uint j = 0; j < k; j++)
+      job.region[job.ntiles++] = i;
+  }
+  run_tile_job(&job, p);
+  free(job.tiles);
+  free(job.region);
+}
+
+/* render the frame into fb, recording its hits in out, and starting from
+ * prev, the g-buffer of an earlier frame, if it is not NULL. the scene must
+ * be compiled and without anti-aliasing or reflections; p may be NULL */
+void render_gbuffer(framebuffer *fb, gbuffer *out, gbuffer *prev,
+                    environment *e, worker_pool *p)
+{
+  camera_prepare(e);
+  if (p == NULL) {
+    tile all = { 0, 0, fb->width, fb->height };
+    scratch_begin();
+    render_tile_gbuffer(e, fb, &all, out, prev);
+    scratch_end();
+    shadow_stats_flush();
+    phase_times_flush();
+    stats_flush();
+    return;
+  }
+  tile_job job;
+  job.env = e;
+  job.fb = fb;
+  job.region = NULL;
+  job.gb_out = out;
+  job.gb_prev = prev;
+  job.tiles = tile_grid(fb->width, fb->height, &job.ntiles);
+  run_tile_job(&job, p);
+  free(job.tiles);
+}
+
+/* ====================================== */
+/* === streaming output               === */
+/* ====================================== */
+
+/* tiles are handed out in row-major order and rendered into a ring of
+ * band buffers, each TILE_SIZE rows high. a band is written as soon as
+ * all of its tiles are done and every band above it has been written, so
+ * the output is in order; a worker may not start a band more than
+ * `window` bands past the oldest unwritten one, which bounds the memory
+ * held to window bands whatever the image height */
+
+typedef struct {
+  environment      *env;
+  FILE             *f;
+  enum image_format fmt;
+  tile             *tiles;
+  uint              ntiles;
+  uint              tiles_per_band;
+  uint              nbands;
+  uint              window;
+  framebuffer     **slots;    /* band b renders into slots[b % window] */
+  uint             *pending;  /* tiles of the slot's band not yet done */
+  char             *text;     /* P3 formatting buffer for one band */
+  pthread_mutex_t   lock;
+  pthread_cond_t    moved;    /* signalled when a band is written */
+  uint              next;     /* next tile to hand out */
+  uint              written;  /* bands written so far */
+  int               writing;  /* some worker is writing bands */
+  uint              peak_live;
+  double            start;
+  double            ttfb;
+} stream_job;
+
+static int stream_next(stream_job *s, uint *out)
+{
+  pthread_mutex_lock(&s->lock);
+  while (s->next < s->ntiles &&
+         s->next / s->tiles_per_band >= s->written + s->window)
+    pthread_cond_wait(&s->moved, &s->lock);
+  int ok = s->next < s->ntiles;
+  if (ok) {
+    uint t = s->next++;
+    uint band = t / s->tiles_per_band;
+    if (t % s->tiles_per_band == 0)
+      s->pending[band % s->window] = s->tiles_per_band;
+    if (band - s->written + 1 > s->peak_live)
+      s->peak_live = band - s->written + 1;
+    *out = t;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return ok;
+}
+
+/* band b is ready once all of its tiles were handed out and finished */
+static int band_ready(stream_job *s, uint b)
+{
+  return b < s->nbands && (b + 1) * s->tiles_per_band <= s->next &&
+    s->pending[b % s->window] == 0;
+}
+
+static void band_write(stream_job *s, uint b)
+{
+  framebuffer *fb = s->slots[b % s->window];
+  uint rows = s->env->image_height - b * TILE_SIZE;
+  if (rows > TILE_SIZE)
+    rows = TILE_SIZE;
+  if (s->fmt == PPM_P3)
+    fwrite(s->text, 1, p3_rows(s->text, fb, 0, rows), s->f);
+  else
+    fwrite(fb->rgb, 1, 3 * (size_t)fb->width * rows, s->f);
+  fflush(s->f);
+  if (b == 0)
+    s->ttfb = wall_time() - s->start;
+}
+
+/* record tile t as done, then write every band that became ready. only
+ * one worker writes at a time, outside the lock; the others carry on */
+static void stream_done(stream_job *s, uint t)
+{
+  pthread_mutex_lock(&s->lock);
+  s->pending[(t / s->tiles_per_band) % s->window]--;
+  if (!s->writing) {
+    s->writing = 1;
+    while (band_ready(s, s->written)) {
+      uint b = s->written;
+      pthread_mutex_unlock(&s->lock);
+      band_write(s, b);
+      pthread_mutex_lock(&s->lock);
+      s->written++;
+      pthread_cond_broadcast(&s->moved);
+    }
+    s->writing = 0;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void stream_worker(void *ctx, uint id)
+{
+  stream_job *s = (stream_job*)ctx;
+  uint t;
+  scratch_begin();
+  while (stream_next(s, &t)) {
+    uint band = t / s->tiles_per_band;
+    render_tile(s->env, s->slots[band % s->window], &s->tiles[t], 0,
+                band * TILE_SIZE);
+    stream_done(s, t);
+  }
+  scratch_end();
+  shadow_stats_flush();
+  phase_times_flush();
+  stats_flush();
+}
+
+/* render e straight to f in fmt, band by band; p may be NULL */
+void render_stream(FILE *f, environment *e, worker_pool *p,
+                   enum image_format fmt, stream_stats *st)
+{
+  camera_prepare(e);
+  uint w = e->image_width, h = e->image_height;
+  stream_job s;
+  s.env = e;
+  s.f = f;
+  s.fmt = fmt;
+  s.start = wall_time();
+  s.ttfb = 0;
+  char header[64];
+  fwrite(header, 1, image_header(header, fmt, w, h), f);
+  fflush(f);
+
+  s.tiles = tile_grid(w, h, &s.ntiles);
+  s.tiles_per_band = (w + TILE_SIZE - 1) / TILE_SIZE;
+  s.nbands = s.tiles_per_band ? s.ntiles / s.tiles_per_band : 0;
+  /* two bands keep workers busy while the older one drains; add more when
+   * there are more workers than tiles in a band */
+  uint nworkers = p ? pool_size(p) : 1;
+  s.window = s.tiles_per_band ? 2 + (nworkers - 1) / s.tiles_per_band : 1;
+  if (s.window > s.nbands)
+    s.window = s.nbands ? s.nbands : 1;
+  s.slots = (framebuffer**)malloc(sizeof(framebuffer*) * s.window);
+  check_malloc("render_stream", s.slots);
+  s.pending = (uint*)calloc(s.window, sizeof(uint));
+  check_malloc("render_stream", s.pending);
+  for (uint i = 0; i < s.window; i++)
+    s.slots[i] = framebuffer_new(w, TILE_SIZE);
+  size_t text_bytes = fmt == PPM_P3 ? 12 * (size_t)w * TILE_SIZE : 0;
+  s.text = fmt == PPM_P3 ? (char*)malloc(text_bytes + 1) : NULL;
+  if (fmt == PPM_P3)
+    check_malloc("render_stream", s.text);
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.moved, NULL);
+  s.next = 0;
+  s.written = 0;
+  s.writing = 0;
+  s.peak_live = 0;
+
+  if (s.ntiles > 0) {
+    if (p)
+      pool_run(p, stream_worker, &s);
+    else
+      stream_worker(&s, 0);
+  }
+
+  st->ttfb = s.ntiles > 0 ? s.ttfb : wall_time() - s.start;
+  st->peak_bytes = s.peak_live * 3 * (size_t)w * TILE_SIZE + text_bytes;
+  st->bands = s.peak_live;
+  st->window = s.window;
+  pthread_cond_destroy(&s.moved);
+  pthread_mutex_destroy(&s.lock);
+  for (uint i = 0; i < s.window; i++)
+    framebuffer_free(s.slots[i]);
+  free(s.slots);
+  free(s.pending);
+  free(s.text);
+  free(s.tiles);
+}
+
+/* render e and write it to f; nthreads == 0 selects the serial path */
+void render_image(FILE *f, environment *e, uint nthreads,
+                  enum image_format fmt)
+{
+  framebuffer *fb = framebuffer_new(e->image_width, e->image_height);
+  worker_pool *p = nthreads > 0 ? pool_new(nthreads) : NULL;
+  render_frame(fb, e, p);
+  if (p)
+    pool_free(p);
+  framebuffer_write(f, fb, fmt);
+  framebuffer_free(fb);
+}
@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+
+/* binary scene cache. a cache file holds a compiled scene and its bvh in
+ * exactly the layout the renderer uses, so loading one is an mmap and a
+ * few checks: the arrays are used where they lie in the mapping. the
+ * header records the format version, the byte order and type sizes of the
+ * writer, and a hash of the scene text it was built from; a cache that
+ * disagrees with any of them is rebuilt from the text */
+
+#define CACHE_MAGIC   "RTSCENE"
+#define CACHE_VERSION 3
+#define CACHE_ORDER   0x01020304u /* reads back permuted on other machines */
+#define CACHE_ALIGN   64
+#define NO_TEXTURE    ((uint32_t)-1)
+
+enum section {
+  S_SPH_CX, S_SPH_CY, S_SPH_CZ, S_SPH_R, S_SPH_MAT, S_SPH_ID,
+  S_RECT_X0, S_RECT_X1, S_RECT_Y0, S_RECT_Y1, S_RECT_Z, S_RECT_MAT,
+  S_RECT_ID,
+  S_MATERIALS, /* material structs with their pointers zeroed */
+  S_MAT_TEX,   /* each material's texture index, or NO_TEXTURE */
+  S_LIGHTS,    /* cached_light records */
+  S_NODES,     /* bvh nodes, empty when the scene was built without one */
+  S_TEXTURES,  /* texture sources: a uint32_t length, the text and a NUL */
+  NSECTIONS
+};
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint32_t sizes[4];   /* pointer, double, material and header sizes */
+  uint64_t text_hash;
+  uint64_t text_len;
+  uint64_t file_len;
+  double   camera_z;
+  uint32_t width;
+  uint32_t height;
+  uint32_t has_view;   /* a CAMERA record gave eye and at */
+  uint32_t view_pad;
+  vector3  eye;
+  vector3  at;
+  uint32_t bg_tag;     /* CONSTANT or TEXTURE */
+  uint32_t bg_texture;
+  color    bg;
+  color    amb;
+  uint32_t nlights;
+  uint32_t nspheres;
+  uint32_t nrects;
+  uint32_t nmaterials;
+  uint32_t ntextures;
+  uint64_t off[NSECTIONS];
+  uint64_t len[NSECTIONS];
+} cache_header;
+
+typedef struct {
+  uint32_t tag;        /* DIRECTIONAL or POINT */
+  uint32_t pad;
+  vector3  v;          /* its direction or position */
+  color    color;
+} cached_light;
+
+static void header_sizes(uint32_t sizes[4])
+{
+  sizes[0] = sizeof(void*);
+  sizes[1] = sizeof(double);
+  sizes[2] = sizeof(material);
+  sizes[3] = sizeof(cache_header);
+}
+
+/* 64-bit hash of the scene text, taken a word at a time so that checking
+ * a cache costs a small fraction of parsing the text */
+unsigned long scene_text_hash(const char *p, size_t n)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  uint64_t w = 0;
+  if (n > i)
+    memcpy(&w, p + i, n - i);
+  h = (h ^ w) * 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (unsigned long)h;
+}
+
+/* sizes of the array sections for the given counts; the arrays carry
+ * their SIMD_PAD entries so the vector kernels can use them in place */
+static void array_lengths(uint64_t len[NSECTIONS], uint32_t ns, uint32_t nr,
+                          uint32_t nm, uint32_t nl)
+{
+  for (int s = S_SPH_CX; s <= S_SPH_R; s++)
+    len[s] = ((uint64_t)ns + SIMD_PAD) * sizeof(double);
+  len[S_SPH_MAT] = len[S_SPH_ID] = ((uint64_t)ns + SIMD_PAD) * sizeof(uint);
+  for (int s = S_RECT_X0; s <= S_RECT_Z; s++)
+    len[s] = ((uint64_t)nr + SIMD_PAD) * sizeof(double);
+  len[S_RECT_MAT] = len[S_RECT_ID] = ((uint64_t)nr + SIMD_PAD) * sizeof(uint);
+  len[S_MATERIALS] = (uint64_t)nm * sizeof(material);
+  len[S_MAT_TEX] = (uint64_t)nm * sizeof(uint32_t);
+  len[S_LIGHTS] = (uint64_t)nl * sizeof(cached_light);
+}
+
+/* ====================================== */
+/* === writing                        === */
+/* ====================================== */
+
+/* the distinct textures of a scene, in order of first use */
+typedef struct {
+  texture **v;
+  uint32_t  n;
+} texture_list;
+
+static uint32_t texture_index(texture_list *tl, texture *t)
+{
+  for (uint32_t i = 0; i < tl->n; i++)
+    if (tl->v[i] == t)
+      return i;
+  tl->v[tl->n] = t;
+  return tl->n++;
+}
+
+static int write_at(FILE *f, uint64_t off, const void *p, uint64_t n)
+{
+  if (n == 0)
+    return 1;
+  return fseeko(f, (off_t)off, SEEK_SET) == 0 && fwrite(p, 1, n, f) == n;
+}
+
+/* 0, with a message on stderr, if e cannot be cached */
+static int cacheable(environment *e)
+{
+  scene *s = e->scene;
+  compiled_scene *cs = s->compiled;
+  if (!cs) {
+    fprintf(stderr, "scene cache: scene is not compiled\n");
+    return 0;
+  }
+  int ok = s->bg.tag != FUNCTION;
+  for (uint i = 0; i < cs->nmaterials; i++)
+    ok &= cs->materials[i].tag != FUNCTION;
+  if (!ok)
+    fprintf(stderr, "scene cache: scenes with C color functions cannot be "
+            "cached\n");
+  return ok;
+}
+
+/* write the compiled scene of e as a cache to f, which must be seekable,
+ * from its start. returns 0 if it cannot be cached or written */
+int scene_cache_put(FILE *f, environment *e, unsigned long hash, size_t len)
+{
+  if (!cacheable(e))
+    return 0;
+  scene *s = e->scene;
+  compiled_scene *cs = s->compiled;
+  cache_header h;
+  memset(&h, 0, sizeof(cache_header));
+  memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  h.version = CACHE_VERSION;
+  h.order = CACHE_ORDER;
+  header_sizes(h.sizes);
+  h.text_hash = hash;
+  h.text_len = len;
+  h.camera_z = e->camera_z;
+  if (e->view) {
+    h.has_view = 1;
+    h.eye = e->view->eye;
+    h.at = e->view->at;
+  }
+  h.width = e->image_width;
+  h.height = e->image_height;
+  h.amb = *s->amb_light;
+  h.nlights = s->nlights;
+  h.nspheres = cs->nspheres;
+  h.nrects = cs->nrects;
+  h.nmaterials = cs->nmaterials;
+
+  /* materials go out with their pointers cleared, and textures as their
+   * source, to be compiled again when the cache is loaded */
+  texture_list tl;
+  tl.v = (texture**)malloc(sizeof(texture*) * (cs->nmaterials + 1));
+  check_malloc("scene_cache_put", tl.v);
+  tl.n = 0;
+  h.bg_tag = s->bg.tag;
+  h.bg_texture = NO_TEXTURE;
+  if (s->bg.tag == TEXTURE)
+    h.bg_texture = texture_index(&tl, s->bg.c.t);
+  else
+    h.bg = *s->bg.c.k;
+  material *mats = (material*)calloc(cs->nmaterials + 1, sizeof(material));
+  uint32_t *mat_tex = (uint32_t*)malloc(sizeof(uint32_t) *
+                                        (cs->nmaterials + 1));
+  check_malloc("scene_cache_put", mats);
+  check_malloc("scene_cache_put", mat_tex);
+  for (uint i = 0; i < cs->nmaterials; i++) {
+    material *m = &cs->materials[i];
+    mats[i].tag = m->tag;
+    mats[i].k = m->k;
+    mats[i].shine = m->shine;
+    mat_tex[i] = m->tag == TEXTURE ? texture_index(&tl, m->t) : NO_TEXTURE;
+  }
+  h.ntextures = tl.n;
+  uint64_t tex_len = 0;
+  for (uint32_t i = 0; i < tl.n; i++)
+    tex_len += sizeof(uint32_t) + strlen(texture_source(tl.v[i])) + 1;
+
+  cached_light *lights = (cached_light*)calloc(s->nlights + 1,
+                                               sizeof(cached_light));
+  check_malloc("scene_cache_put", lights);
+  for (uint i = 0; i < s->nlights; i++) {
+    light *l = s->lights[i];
+    lights[i].tag = l->tag;
+    lights[i].v = l->tag == DIRECTIONAL ? *l->direction : *l->position;
+    lights[i].color = *l->color;
+  }
+
+  const void *nodes = NULL;
+  array_lengths(h.len, cs->nspheres, cs->nrects, cs->nmaterials, s->nlights);
+  h.len[S_NODES] = cs->accel ? bvh_export(cs->accel, &nodes) : 0;
+  h.len[S_TEXTURES] = tex_len;
+  uint64_t off = sizeof(cache_header);
+  for (int i = 0; i < NSECTIONS; i++) {
+    off = (off + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+    h.off[i] = off;
+    off += h.len[i];
+  }
+  h.file_len = off;
+
+  const void *arrays[S_RECT_ID + 1] = {
+    cs->sph_cx, cs->sph_cy, cs->sph_cz, cs->sph_r, cs->sph_mat, cs->sph_id,
+    cs->rect_x0, cs->rect_x1, cs->rect_y0, cs->rect_y1, cs->rect_z,
+    cs->rect_mat, cs->rect_id
+  };
+  int ok = write_at(f, 0, &h, sizeof(cache_header));
+  for (int i = 0; ok && i <= S_RECT_ID; i++)
+    ok = write_at(f, h.off[i], arrays[i], h.len[i]);
+  ok = ok && write_at(f, h.off[S_MATERIALS], mats, h.len[S_MATERIALS]);
+  ok = ok && write_at(f, h.off[S_MAT_TEX], mat_tex, h.len[S_MAT_TEX]);
+  ok = ok && write_at(f, h.off[S_LIGHTS], lights, h.len[S_LIGHTS]);
+  ok = ok && write_at(f, h.off[S_NODES], nodes, h.len[S_NODES]);
+  ok = ok && fseeko(f, (off_t)h.off[S_TEXTURES], SEEK_SET) == 0;
+  for (uint32_t i = 0; ok && i < tl.n; i++) {
+    const char *src = texture_source(tl.v[i]);
+    uint32_t n = strlen(src);
+    ok = fwrite(&n, sizeof(n), 1, f) == 1 && fwrite(src, 1, n + 1, f) == n + 1;
+  }
+  /* the last sections may be empty, leaving the file short of file_len */
+  ok = ok && fflush(f) == 0 && ftruncate(fileno(f), (off_t)h.file_len) == 0;
+  free(mats);
+  free(mat_tex);
+  free(lights);
+  free(tl.v);
+  return ok;
+}
+
+/* write the compiled scene of e to path, going through a temporary file
+ * so a reader never sees half a cache. returns 0, with a message on
+ * stderr, if the scene cannot be cached */
+int scene_cache_write(const char *path, environment *e, unsigned long hash,
+                      size_t len)
+{
+  if (!cacheable(e))
+    return 0;
+  size_t plen = strlen(path);
+  char *tmp = (char*)malloc(plen + 5);
+  check_malloc("scene_cache_write", tmp);
+  memcpy(tmp, path, plen);
+  memcpy(tmp + plen, ".tmp", 5);
+  FILE *f = fopen(tmp, "wb");
+  int ok = f != NULL && scene_cache_put(f, e, hash, len);
+  if (f && fclose(f) != 0)
+    ok = 0;
+  if (ok && rename(tmp, path) != 0)
+    ok = 0;
+  if (!ok) {
+    fprintf(stderr, "scene cache: cannot write %s\n", path);
+    remove(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+/* ====================================== */
+/* === loading                        === */
+/* ====================================== */
+
+/* why a cache cannot be used, or NULL if it can */
+static const char *check_header(cache_header *h, size_t size,
+                                unsigned long hash, size_t len)
+{
+  uint32_t sizes[4];
+  header_sizes(sizes);
+  if (memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)))
+    return "not a scene cache";
+  if (h->order != CACHE_ORDER)
+    return "written on a machine of the other byte order";
+  if (h->version != CACHE_VERSION)
+    return "written by another version";
+  if (memcmp(h->sizes, sizes, sizeof(sizes)))
+    return "written with another memory layout";
+  if (h->file_len != size)
+    return "truncated";
+  if (h->text_hash != hash || h->text_len != len)
+    return "built from another scene";
+  if (h->bg_tag != CONSTANT && h->bg_tag != TEXTURE)
+    return "corrupt";
+  uint64_t expect[NSECTIONS];
+  array_lengths(expect, h->nspheres, h->nrects, h->nmaterials, h->nlights);
+  for (int i = 0; i < NSECTIONS; i++) {
+    if (h->off[i] % CACHE_ALIGN != 0 || h->off[i] > size ||
+        h->len[i] > size - h->off[i])
+      return "corrupt";
+    if (i < S_NODES && h->len[i] != expect[i])
+      return "corrupt";
+  }
+  /* each texture is at least its length and the nul after its source */
+  if (h->ntextures > h->len[S_TEXTURES] / (sizeof(uint32_t) + 1))
+    return "corrupt";
+  return NULL;
+}
+
+/* compile the texture sources of a cache into v; 0 if any is bad */
+static int load_textures(cache_header *h, char *base, texture **v)
+{
+  char *p = base + h->off[S_TEXTURES];
+  char *end = p + h->len[S_TEXTURES];
+  char err[128];
+  for (uint32_t i = 0; i < h->ntextures; i++) {
+    uint32_t n;
+    if ((size_t)(end - p) < sizeof(n))
+      return 0;
+    memcpy(&n, p, sizeof(n));
+    p += sizeof(n);
+    if ((size_t)(end - p) <= n || p[n] != '\0')
+      return 0;
+    v[i] = texture_compile(p, n, err, sizeof(err));
+    if (!v[i])
+      return 0;
+    p += n + 1;
+  }
+  return 1;
+}
+
+/* the environment cached in the file open on fd, called path in messages,
+ * as for scene_cache_load; a message saying it cannot be used ends with
+ * then. fd may be closed once it returns */
+static environment *cache_map(int fd, const char *path, unsigned long hash,
+                              size_t len, int linear, const char *then)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache_header)) {
+    fprintf(stderr, "scene cache: %s is not a scene cache%s\n", path, then);
+    return NULL;
+  }
+  /* private and writable: the few pointers patched in below, and the
+   * arrays if a bvh has to be built over them, are copied on write */
+  size_t size = st.st_size;
+  char *base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                           fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "scene cache: cannot map %s%s\n", path, then);
+    return NULL;
+  }
+  cache_header *h = (cache_header*)base;
+  const char *why = check_header(h, size, hash, len);
+  texture **tex = NULL;
+  if (!why) {
+    tex = (texture**)malloc(sizeof(texture*) * ((size_t)h->ntextures + 1));
+    check_malloc("cache_map", tex);
+    if (!load_textures(h, base, tex) ||
+        (h->bg_tag == TEXTURE && h->bg_texture >= h->ntextures))
+      why = "corrupt";
+  }
+  cached_light *lights = why ? NULL
+                             : (cached_light*)(base + h->off[S_LIGHTS]);
+  for (uint32_t i = 0; !why && i < h->nlights; i++)
+    if (lights[i].tag != DIRECTIONAL && lights[i].tag != POINT)
+      why = "corrupt";
+  material *mats = why ? NULL : (material*)(base + h->off[S_MATERIALS]);
+  uint32_t *mat_tex = why ? NULL : (uint32_t*)(base + h->off[S_MAT_TEX]);
+  for (uint32_t i = 0; !why && i < h->nmaterials; i++) {
+    if (mats[i].tag == TEXTURE && mat_tex[i] < h->ntextures)
+      mats[i].t = tex[mat_tex[i]];
+    else if (mats[i].tag != CONSTANT)
+      why = "corrupt";
+  }
+  if (why) {
+    fprintf(stderr, "scene cache: %s is %s%s\n", path, why, then);
+    munmap(base, size);
+    free(tex);
+    return NULL;
+  }
+
+  compiled_scene *cs = (compiled_scene*)malloc(sizeof(compiled_scene));
+  check_malloc("cache_map", cs);
+  cs->nspheres = h->nspheres;
+  cs->sph_cx = (double*)(base + h->off[S_SPH_CX]);
+  cs->sph_cy = (double*)(base + h->off[S_SPH_CY]);
+  cs->sph_cz = (double*)(base + h->off[S_SPH_CZ]);
+  cs->sph_r = (double*)(base + h->off[S_SPH_R]);
+  cs->sph_mat = (uint*)(base + h->off[S_SPH_MAT]);
+  cs->sph_id = (uint*)(base + h->off[S_SPH_ID]);
+  cs->nrects = h->nrects;
+  cs->rect_x0 = (double*)(base + h->off[S_RECT_X0]);
+  cs->rect_x1 = (double*)(base + h->off[S_RECT_X1]);
+  cs->rect_y0 = (double*)(base + h->off[S_RECT_Y0]);
+  cs->rect_y1 = (double*)(base + h->off[S_RECT_Y1]);
+  cs->rect_z = (double*)(base + h->off[S_RECT_Z]);
+  cs->rect_mat = (uint*)(base + h->off[S_RECT_MAT]);
+  cs->rect_id = (uint*)(base + h->off[S_RECT_ID]);
+  cs->nmaterials = h->nmaterials;
+  cs->materials = mats;
+  cs->accel = NULL;
+  cs->single = NULL;
+  cs->mapping = base;
+  cs->mapping_len = size;
+  for (uint i = 0; i < cs->nspheres; i++)
+    if (cs->sph_mat[i] >= cs->nmaterials)
+      why = "corrupt";
+  for (uint i = 0; i < cs->nrects; i++)
+    if (cs->rect_mat[i] >= cs->nmaterials)
+      why = "corrupt";
+  if (!why && !linear && h->len[S_NODES] > 0) {
+    cs->accel = bvh_import(base + h->off[S_NODES], h->len[S_NODES], cs);
+    if (!cs->accel)
+      why = "corrupt";
+  }
+  if (why) {
+    fprintf(stderr, "scene cache: %s is %s%s\n", path, why, then);
+    compiled_scene_free(cs);
+    free(tex);
+    return NULL;
+  }
+
+  scene *sc = scene_new(color_new(h->bg.r, h->bg.g, h->bg.b),
+                        color_new(h->amb.r, h->amb.g, h->amb.b), NULL, NULL);
+  for (uint32_t i = 0; i < h->nlights; i++) {
+    cached_light *l = &lights[i];
+    if (l->tag == POINT) {
+      scene_add_light(sc, pl_new(l->v.x, l->v.y, l->v.z, l->color.r,
+                                 l->color.g, l->color.b));
+    } else {
+      light *dl = dl_new(0, 0, -1, l->color.r, l->color.g, l->color.b);
+      /* already a unit vector; normalizing it again could move the last
+       * bit */
+      *dl->direction = l->v;
+      scene_add_light(sc, dl);
+    }
+  }
+  if (h->bg_tag == TEXTURE) {
+    surf_free(&sc->bg);
+    sc->bg.tag = TEXTURE;
+    sc->bg.c.t = tex[h->bg_texture];
+  }
+  sc->compiled = cs;
+  free(tex);
+  fprintf(stderr, "scene cache: loaded %s, %u spheres, %u rectangles, "
+          "%u materials\n", path, cs->nspheres, cs->nrects, cs->nmaterials);
+  if (!linear && !cs->accel) {
+    /* cached without one; the arrays are reordered in the private copy */
+    double t0 = wall_time();
+    cs->accel = bvh_build(cs);
+    fprintf(stderr, "bvh: %u nodes over %u objects, built in %.3f ms\n",
+            bvh_node_count(cs->accel), cs->nspheres + cs->nrects,
+            (wall_time() - t0) * 1e3);
+  }
+  if (simd_single())
+    cs_build_single(cs);
+  environment *e = environment_new(h->camera_z, h->width, h->height, sc);
+  if (h->has_view) {
+    e->view = (camera_view*)malloc(sizeof(camera_view));
+    check_malloc("cache_map", e->view);
+    e->view->eye = h->eye;
+    e->view->at = h->at;
+  }
+  return e;
+}
+
+/* the environment cached at path if it was built from text with this hash
+ * and length, with its bvh unless linear; NULL, saying why on stderr, if
+ * there is no such cache */
+environment *scene_cache_load(const char *path, unsigned long hash,
+                              size_t len, int linear)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  environment *e = cache_map(fd, path, hash, len, linear, ", rebuilding");
+  close(fd);
+  return e;
+}
+
+/* the same for a cache in the file open on fd, such as one received from
+ * a coordinator, called name in messages */
+environment *scene_cache_map(int fd, const char *name, unsigned long hash,
+                             size_t len, int linear)
+{
+  return cache_map(fd, name, hash, len, linear, "");
+}
+
+environment *read_env_cached(FILE *f, const char *path, int linear)
+{
+  scene_text text = scene_text_load(f);
+  unsigned long hash = scene_text_hash(text.data, text.len);
+  environment *e = scene_cache_load(path, hash, text.len, linear);
+  if (!e) {
+    e = parse_scene_text(&text);
+    scene_compile(e->scene, !linear);
+    if (scene_cache_write(path, e, hash, text.len))
+      fprintf(stderr, "scene cache: wrote %s\n", path);
+  }
+  scene_text_free(&text);
+  return e;
+}
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+
+/* keyframed sequences. KEY records place objects and lights at later
+ * frames; between keys they move in a straight line, and after the last
+ * one they stay put. the scene is parsed and compiled once and rendered
+ * on two copies of its compiled form: while the pool traces a frame on
+ * one, a second thread moves the other's objects and lights to where they
+ * are in the next frame, refits its bvh, and writes out the frame before.
+ * a refit keeps the shape the tree was built with, so it costs a pass over
+ * the nodes and gets looser only as objects wander from where they began */
+
+enum track_kind { T_SPHERE, T_RECT, T_LIGHT };
+
+/* the keys of one object or light */
+typedef struct {
+  enum track_kind kind;
+  uint            index; /* compiled sphere or rectangle, or light */
+  double          w;     /* a rectangle's size */
+  double          h;
+  vector3         base;  /* where it is at frame 0 */
+  keyframe       *keys;
+  uint            nkeys;
+} track;
+
+/* one copy of the scene and the frame last rendered from it */
+typedef struct {
+  environment *e;
+  framebuffer *fb;
+  uint         frame;
+  double       refit; /* seconds moving it to frame */
+} slot;
+
+typedef struct {
+  track *tracks;
+  uint   ntracks;
+  char  *pattern;
+  enum image_format fmt;
+  double write; /* seconds writing frames, summed */
+  int    failed;
+} sequence;
+
+/* a pattern with one %d, such as frame%03d.ppm, and no other conversion */
+int frame_pattern_ok(const char *pattern)
+{
+  int n = 0;
+  for (const char *p = pattern; *p; p++) {
+    if (*p != '%')
+      continue;
+    if (*++p == '%')
+      continue;
+    while (*p >= '0' && *p <= '9')
+      p++;
+    if (*p != 'd')
+      return 0;
+    n++;
+  }
+  return n == 1;
+}
+
+/* one track per object or light with keys; their keys are together */
+static track *tracks_new(scene *s, uint *ntracks)
+{
+  animation *an = s->anim;
+  compiled_scene *cs = s->compiled;
+  *ntracks = 0;
+  if (!an)
+    return NULL;
+  uint nobjs = cs->nspheres + cs->nrects;
+  /* objects by list position, and where each went in cs */
+  object **objs = (object**)malloc(sizeof(object*) * (nobjs + 1));
+  uint *where = (uint*)malloc(sizeof(uint) * (nobjs + 1));
+  track *tr = (track*)malloc(sizeof(track) * (an->nkeys + 1));
+  check_malloc("tracks_new", objs);
+  check_malloc("tracks_new", where);
+  check_malloc("tracks_new", tr);
+  uint n = 0;
+  for (object_list *ol = s->objects; ol != NULL; ol = ol->rest)
+    objs[n++] = &ol->first;
+  for (uint i = 0; i < cs->nspheres; i++)
+    where[cs->sph_id[i]] = i;
+  for (uint i = 0; i < cs->nrects; i++)
+    where[cs->rect_id[i]] = i;
+  for (uint k = 0; k < an->nkeys;) {
+    keyframe *first = &an->keys[k];
+    track *t = &tr[(*ntracks)++];
+    t->keys = first;
+    t->nkeys = 0;
+    while (k < an->nkeys && an->keys[k].light == first->light &&
+           an->keys[k].target == first->target) {
+      t->nkeys++;
+      k++;
+    }
+    /* a directional light's keys run from its direction as written, not
+     * the unit vector the light holds, as a scene with it placed at any
+     * frame would give it */
+    t->base = first->from;
+    if (first->light) {
+      t->kind = T_LIGHT;
+      t->index = first->target;
+      continue;
+    }
+    /* the list runs from the last object in the file to the first */
+    uint id = nobjs - 1 - first->target;
+    object *o = objs[id];
+    t->index = where[id];
+    if (o->tag == SPHERE) {
+      t->kind = T_SPHERE;
+    } else {
+      t->kind = T_RECT;
+      t->w = o->o.r->w;
+      t->h = o->o.r->h;
+    }
+  }
+  free(objs);
+  free(where);
+  return tr;
+}
+
+/* where t is at frame f */
+static vector3 track_at(track *t, uint f)
+{
+  uint f0 = 0;
+  vector3 a = t->base;
+  for (uint k = 0; k < t->nkeys; k++) {
+    keyframe *key = &t->keys[k];
+    if (f == key->frame)
+      return key->v;
+    if (f < key->frame) {
+      double u = (double)(f - f0) / (key->frame - f0);
+      return v3_add(a, v3_scale(u, v3_sub(key->v, a)));
+    }
+    f0 = key->frame;
+    a = key->v;
+  }
+  return a;
+}
+
+/* move everything keyed in s to frame f and refit the bvh. the other slot
+ * may be tracing meanwhile; its per-thread shadow caches may name objects
+ * of this copy, which is harmless as both number them alike and a cached
+ * occluder is always tested again, by the kernels a full search uses */
+static void pose(sequence *q, slot *s, uint f)
+{
+  double t0 = wall_time();
+  scene *sc = s->e->scene;
+  compiled_scene *cs = sc->compiled;
+  for (uint i = 0; i < q->ntracks; i++) {
+    track *t = &q->tracks[i];
+    vector3 v = track_at(t, f);
+    if (t->kind == T_SPHERE) {
+      cs_place_sphere(cs, t->index, v);
+    } else if (t->kind == T_RECT) {
+      cs_place_rect(cs, t->index, v, t->w, t->h);
+    } else {
+      light *l = sc->lights[t->index];
+      if (l->tag == POINT)
+        *l->position = v;
+      else
+        *l->direction = v3_normalize(v);
+    }
+  }
+  if (cs->accel)
+    bvh_refit(cs->accel, cs);
+  s->frame = f;
+  s->refit = wall_time() - t0;
+}
+
+/* a second copy of e to pose frames in, sharing its textures */
+static environment *env_clone(environment *e)
+{
+  scene *s = e->scene;
+  color *bg = s->bg.tag == CONSTANT ? s->bg.c.k : s->amb_light;
+  scene *c = scene_new(color_new(bg->r, bg->g, bg->b),
+                       color_new(s->amb_light->r, s->amb_light->g,
+                                 s->amb_light->b), NULL, NULL);
+  if (s->bg.tag != CONSTANT) {
+    surf_free(&c->bg);
+    c->bg = s->bg;
+  }
+  c->shading = s->shading;
+  for (uint i = 0; i < s->nlights; i++) {
+    light *l = s->lights[i];
+    color *k = l->color;
+    if (l->tag == POINT) {
+      scene_add_light(c, pl_new(l->position->x, l->position->y,
+                                l->position->z, k->r, k->g, k->b));
+    } else {
+      light *dl = dl_new(0, 0, -1, k->r, k->g, k->b);
+      *dl->direction = *l->direction;
+      scene_add_light(c, dl);
+    }
+  }
+  c->compiled = cs_clone(s->compiled);
+  environment *ce = environment_new(e->camera_z, e->image_width,
+                                    e->image_height, c);
+  if (e->view) {
+    ce->view = (camera_view*)malloc(sizeof(camera_view));
+    check_malloc("env_clone", ce->view);
+    *ce->view = *e->view;
+  }
+  ce->aa = e->aa;
+  ce->fast_rays = e->fast_rays;
+  return ce;
+}
+
+static void write_frame(sequence *q, slot *s)
+{
+  double t0 = wall_time();
+  int n = snprintf(NULL, 0, q->pattern, s->frame);
+  char *path = (char*)malloc(n + 1);
+  check_malloc("write_frame", path);
+  snprintf(path, n + 1, q->pattern, s->frame);
+  FILE *f = fopen(path, "wb");
+  if (f)
+    framebuffer_write(f, s->fb, q->fmt);
+  if (!f || (ferror(f) | fclose(f))) {
+    fprintf(stderr, "sequence: cannot write %s\n", path);
+    q->failed = 1;
+  }
+  free(path);
+  q->write += wall_time() - t0;
+}
+
+/* what the second thread does while a frame is traced */
+typedef struct {
+  sequence *q;
+  slot     *done; /* to write out, or NULL */
+  slot     *next; /* to pose for frame, or NULL */
+  uint      frame;
+} side_job;
+
+static void *side_main(void *p)
+{
+  side_job *j = (side_job*)p;
+  if (j->done)
+    write_frame(j->q, j->done);
+  if (j->next)
+    pose(j->q, j->next, j->frame);
+  return NULL;
+}
+
+/* render frames 0 to nframes - 1 of e, a compiled scene, to the files
+ * named by pattern, reporting the time each took on stderr */
+void render_sequence(environment *e, worker_pool *p, char *pattern,
+                     uint nframes, enum image_format fmt)
+{
+  sequence q;
+  q.tracks = tracks_new(e->scene, &q.ntracks);
+  q.pattern = pattern;
+  q.fmt = fmt;
+  q.write = 0;
+  q.failed = 0;
+  slot slots[2];
+  slots[0].e = e;
+  slots[1].e = env_clone(e);
+  for (int i = 0; i < 2; i++)
+    slots[i].fb = framebuffer_new(e->image_width, e->image_height);
+
+  double start = wall_time(), refit = 0, trace = 0;
+  pose(&q, &slots[0], 0);
+  for (uint f = 0; f < nframes; f++) {
+    slot *s = &slots[f % 2];
+    side_job j = { &q, f > 0 ? &slots[(f + 1) % 2] : NULL,
+                   f + 1 < nframes ? &slots[(f + 1) % 2] : NULL, f + 1 };
+    /* the slot written out is the one posed next, so side_main writes
+     * before it poses */
+    pthread_t side;
+    int threaded = j.done || j.next;
+    if (threaded && pthread_create(&side, NULL, side_main, &j) != 0) {
+      side_main(&j);
+      threaded = 0;
+    }
+    double t0 = wall_time();
+    render_frame(s->fb, s->e, p);
+    double t = wall_time() - t0;
+    if (threaded)
+      pthread_join(side, NULL);
+    if (q.failed)
+      exit(1);
+    refit += s->refit;
+    trace += t;
+    fprintf(stderr, "sequence: frame %u, refit %.3f ms, trace %.3f ms\n", f,
+            s->refit * 1e3, t * 1e3);
+  }
+  write_frame(&q, &slots[(nframes - 1) % 2]);
+  if (q.failed)
+    exit(1);
+  double total = wall_time() - start;
+  fprintf(stderr, "sequence: %u frames in %.3f s, %.2f frames/s; %u objects "
+          "and lights keyed; a frame took %.3f ms to refit and %.3f ms to "
+          "write, alongside %.3f ms of tracing\n", nframes, total,
+          nframes / total, q.ntracks, refit / nframes * 1e3,
+          q.write / nframes * 1e3, trace / nframes * 1e3);
+  for (int i = 0; i < 2; i++)
+    framebuffer_free(slots[i].fb);
+  env_free(slots[1].e);
+  free(q.tracks);
+}
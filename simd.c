@@ -0,0 +1,561 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* one ray against a run of up to 32 spheres or rectangles at once. each
+ * kernel returns a bit mask of the primitives hit and stores their t values;
+ * the vector kernels load whole registers, which is safe because compiled
+ * scene arrays are padded by SIMD_PAD entries.
+ *
+ * the vector kernels perform the scalar arithmetic lane by lane with no
+ * fused operations, so in a normal build they agree with cs_sphere_hit and
+ * cs_rect_hit exactly. SIMD_EPSILON bounds the relative difference in t we
+ * accept (e.g. if the scalar path is built with fma contraction) and is what
+ * simd_self_check tests against */
+
+#define SIMD_EPSILON 1e-12
+
+static uint sphere_hits_scalar(compiled_scene *cs, uint first, uint n,
+                               vector3 o, vector3 d, double *t)
+{
+  uint mask = 0;
+  for (uint k = 0; k < n; k++) {
+    if (cs_sphere_hit(cs, first + k, o, d, &t[k]))
+      mask |= 1u << k;
+  }
+  return mask;
+}
+
+static uint rect_hits_scalar(compiled_scene *cs, uint first, uint n,
+                             vector3 o, vector3 d, double *t)
+{
+  uint mask = 0;
+  for (uint k = 0; k < n; k++) {
+    if (cs_rect_hit(cs, first + k, o, d, &t[k]))
+      mask |= 1u << k;
+  }
+  return mask;
+}
+
+/* the float kernels do the same arithmetic in single precision, on the
+ * copies cs_build_single makes, and widen t for the caller */
+
+static uint sphere_hits_scalar_f(compiled_scene *cs, uint first, uint n,
+                                 vector3 o, vector3 d, double *t)
+{
+  compiled_single *f = cs->single;
+  float ox = o.x, oy = o.y, oz = o.z, dx = d.x, dy = d.y, dz = d.z;
+  uint mask = 0;
+  for (uint k = 0; k < n; k++) {
+    uint i = first + k;
+    float ax = ox - f->sph_cx[i];
+    float ay = oy - f->sph_cy[i];
+    float az = oz - f->sph_cz[i];
+    float b = ax * dx + ay * dy + az * dz;
+    float c = (ax * ax + ay * ay + az * az) - f->sph_r[i] * f->sph_r[i];
+    float disc = b * b - c;
+    float tt = - b - sqrtf(disc);
+    t[k] = tt;
+    if (disc > 0 && tt > 0)
+      mask |= 1u << k;
+  }
+  return mask;
+}
+
+static uint rect_hits_scalar_f(compiled_scene *cs, uint first, uint n,
+                               vector3 o, vector3 d, double *t)
+{
+  compiled_single *f = cs->single;
+  float ox = o.x, oy = o.y, dx = d.x, dy = d.y, noz = -o.z, ndz = -d.z;
+  uint mask = 0;
+  for (uint k = 0; k < n; k++) {
+    uint i = first + k;
+    float tt = -(noz + f->rect_z[i]) / ndz;
+    float x = ox + tt * dx;
+    float y = oy + tt * dy;
+    t[k] = tt;
+    if (tt > 0 && x >= f->rect_x0[i] && x <= f->rect_x1[i] &&
+        y >= f->rect_y0[i] && y <= f->rect_y1[i])
+      mask |= 1u << k;
+  }
+  return mask;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* sse2 is part of the x86-64 baseline, so these need no dispatch guard */
+
+static uint sphere_hits_sse2(compiled_scene *cs, uint first, uint n,
+                             vector3 o, vector3 d, double *t)
+{
+  __m128d ox = _mm_set1_pd(o.x), oy = _mm_set1_pd(o.y), oz = _mm_set1_pd(o.z);
+  __m128d dx = _mm_set1_pd(d.x), dy = _mm_set1_pd(d.y), dz = _mm_set1_pd(d.z);
+  __m128d zero = _mm_setzero_pd(), sign = _mm_set1_pd(-0.0);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 2) {
+    uint i = first + k;
+    __m128d ax = _mm_sub_pd(ox, _mm_loadu_pd(cs->sph_cx + i));
+    __m128d ay = _mm_sub_pd(oy, _mm_loadu_pd(cs->sph_cy + i));
+    __m128d az = _mm_sub_pd(oz, _mm_loadu_pd(cs->sph_cz + i));
+    __m128d r = _mm_loadu_pd(cs->sph_r + i);
+    __m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ax, dx), _mm_mul_pd(ay, dy)),
+                           _mm_mul_pd(az, dz));
+    __m128d aa = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ax, ax), _mm_mul_pd(ay, ay)),
+                            _mm_mul_pd(az, az));
+    __m128d c = _mm_sub_pd(aa, _mm_mul_pd(r, r));
+    __m128d disc = _mm_sub_pd(_mm_mul_pd(b, b), c);
+    __m128d tt = _mm_sub_pd(_mm_xor_pd(b, sign), _mm_sqrt_pd(disc));
+    __m128d hit = _mm_and_pd(_mm_cmpgt_pd(disc, zero), _mm_cmpgt_pd(tt, zero));
+    _mm_storeu_pd(t + k, tt);
+    mask |= (uint)_mm_movemask_pd(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+static uint rect_hits_sse2(compiled_scene *cs, uint first, uint n,
+                           vector3 o, vector3 d, double *t)
+{
+  __m128d ox = _mm_set1_pd(o.x), oy = _mm_set1_pd(o.y);
+  __m128d dx = _mm_set1_pd(d.x), dy = _mm_set1_pd(d.y);
+  __m128d sign = _mm_set1_pd(-0.0), zero = _mm_setzero_pd();
+  __m128d ndz = _mm_set1_pd(-d.z), noz = _mm_set1_pd(-o.z);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 2) {
+    uint i = first + k;
+    __m128d num = _mm_add_pd(noz, _mm_loadu_pd(cs->rect_z + i));
+    __m128d tt = _mm_div_pd(_mm_xor_pd(num, sign), ndz);
+    __m128d x = _mm_add_pd(ox, _mm_mul_pd(tt, dx));
+    __m128d y = _mm_add_pd(oy, _mm_mul_pd(tt, dy));
+    __m128d hit = _mm_cmpgt_pd(tt, zero);
+    hit = _mm_and_pd(hit, _mm_cmpge_pd(x, _mm_loadu_pd(cs->rect_x0 + i)));
+    hit = _mm_and_pd(hit, _mm_cmple_pd(x, _mm_loadu_pd(cs->rect_x1 + i)));
+    hit = _mm_and_pd(hit, _mm_cmpge_pd(y, _mm_loadu_pd(cs->rect_y0 + i)));
+    hit = _mm_and_pd(hit, _mm_cmple_pd(y, _mm_loadu_pd(cs->rect_y1 + i)));
+    _mm_storeu_pd(t + k, tt);
+    mask |= (uint)_mm_movemask_pd(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+/* widen four float t values into t[0..3] */
+static void store_t_sse2(double *t, __m128 tt)
+{
+  _mm_storeu_pd(t, _mm_cvtps_pd(tt));
+  _mm_storeu_pd(t + 2, _mm_cvtps_pd(_mm_movehl_ps(tt, tt)));
+}
+
+static uint sphere_hits_sse2_f(compiled_scene *cs, uint first, uint n,
+                               vector3 o, vector3 d, double *t)
+{
+  compiled_single *f = cs->single;
+  __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+  __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+  __m128 zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.0f);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 4) {
+    uint i = first + k;
+    __m128 ax = _mm_sub_ps(ox, _mm_loadu_ps(f->sph_cx + i));
+    __m128 ay = _mm_sub_ps(oy, _mm_loadu_ps(f->sph_cy + i));
+    __m128 az = _mm_sub_ps(oz, _mm_loadu_ps(f->sph_cz + i));
+    __m128 r = _mm_loadu_ps(f->sph_r + i);
+    __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, dx), _mm_mul_ps(ay, dy)),
+                          _mm_mul_ps(az, dz));
+    __m128 aa = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, ax), _mm_mul_ps(ay, ay)),
+                           _mm_mul_ps(az, az));
+    __m128 c = _mm_sub_ps(aa, _mm_mul_ps(r, r));
+    __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), c);
+    __m128 tt = _mm_sub_ps(_mm_xor_ps(b, sign), _mm_sqrt_ps(disc));
+    __m128 hit = _mm_and_ps(_mm_cmpgt_ps(disc, zero), _mm_cmpgt_ps(tt, zero));
+    store_t_sse2(t + k, tt);
+    mask |= (uint)_mm_movemask_ps(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+static uint rect_hits_sse2_f(compiled_scene *cs, uint first, uint n,
+                             vector3 o, vector3 d, double *t)
+{
+  compiled_single *f = cs->single;
+  __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y);
+  __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y);
+  __m128 sign = _mm_set1_ps(-0.0f), zero = _mm_setzero_ps();
+  __m128 ndz = _mm_set1_ps(-d.z), noz = _mm_set1_ps(-o.z);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 4) {
+    uint i = first + k;
+    __m128 num = _mm_add_ps(noz, _mm_loadu_ps(f->rect_z + i));
+    __m128 tt = _mm_div_ps(_mm_xor_ps(num, sign), ndz);
+    __m128 x = _mm_add_ps(ox, _mm_mul_ps(tt, dx));
+    __m128 y = _mm_add_ps(oy, _mm_mul_ps(tt, dy));
+    __m128 hit = _mm_cmpgt_ps(tt, zero);
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(x, _mm_loadu_ps(f->rect_x0 + i)));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(x, _mm_loadu_ps(f->rect_x1 + i)));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(y, _mm_loadu_ps(f->rect_y0 + i)));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(y, _mm_loadu_ps(f->rect_y1 + i)));
+    store_t_sse2(t + k, tt);
+    mask |= (uint)_mm_movemask_ps(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+__attribute__((target("avx2")))
+static uint sphere_hits_avx2(compiled_scene *cs, uint first, uint n,
+                             vector3 o, vector3 d, double *t)
+{
+  __m256d ox = _mm256_set1_pd(o.x), oy = _mm256_set1_pd(o.y);
+  __m256d oz = _mm256_set1_pd(o.z);
+  __m256d dx = _mm256_set1_pd(d.x), dy = _mm256_set1_pd(d.y);
+  __m256d dz = _mm256_set1_pd(d.z);
+  __m256d zero = _mm256_setzero_pd(), sign = _mm256_set1_pd(-0.0);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 4) {
+    uint i = first + k;
+    __m256d ax = _mm256_sub_pd(ox, _mm256_loadu_pd(cs->sph_cx + i));
+    __m256d ay = _mm256_sub_pd(oy, _mm256_loadu_pd(cs->sph_cy + i));
+    __m256d az = _mm256_sub_pd(oz, _mm256_loadu_pd(cs->sph_cz + i));
+    __m256d r = _mm256_loadu_pd(cs->sph_r + i);
+    __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ax, dx),
+                                            _mm256_mul_pd(ay, dy)),
+                              _mm256_mul_pd(az, dz));
+    __m256d aa = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ax, ax),
+                                             _mm256_mul_pd(ay, ay)),
+                               _mm256_mul_pd(az, az));
+    __m256d c = _mm256_sub_pd(aa, _mm256_mul_pd(r, r));
+    __m256d disc = _mm256_sub_pd(_mm256_mul_pd(b, b), c);
+    __m256d tt = _mm256_sub_pd(_mm256_xor_pd(b, sign), _mm256_sqrt_pd(disc));
+    __m256d hit = _mm256_and_pd(_mm256_cmp_pd(disc, zero, _CMP_GT_OQ),
+                                _mm256_cmp_pd(tt, zero, _CMP_GT_OQ));
+    _mm256_storeu_pd(t + k, tt);
+    mask |= (uint)_mm256_movemask_pd(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+__attribute__((target("avx2")))
+static uint rect_hits_avx2(compiled_scene *cs, uint first, uint n,
+                           vector3 o, vector3 d, double *t)
+{
+  __m256d ox = _mm256_set1_pd(o.x), oy = _mm256_set1_pd(o.y);
+  __m256d dx = _mm256_set1_pd(d.x), dy = _mm256_set1_pd(d.y);
+  __m256d sign = _mm256_set1_pd(-0.0), zero = _mm256_setzero_pd();
+  __m256d ndz = _mm256_set1_pd(-d.z), noz = _mm256_set1_pd(-o.z);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 4) {
+    uint i = first + k;
+    __m256d num = _mm256_add_pd(noz, _mm256_loadu_pd(cs->rect_z + i));
+    __m256d tt = _mm256_div_pd(_mm256_xor_pd(num, sign), ndz);
+    __m256d x = _mm256_add_pd(ox, _mm256_mul_pd(tt, dx));
+    __m256d y = _mm256_add_pd(oy, _mm256_mul_pd(tt, dy));
+    __m256d hit = _mm256_cmp_pd(tt, zero, _CMP_GT_OQ);
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(x, _mm256_loadu_pd(cs->rect_x0 + i),
+                                           _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(x, _mm256_loadu_pd(cs->rect_x1 + i),
+                                           _CMP_LE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(y, _mm256_loadu_pd(cs->rect_y0 + i),
+                                           _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(y, _mm256_loadu_pd(cs->rect_y1 + i),
+                                           _CMP_LE_OQ));
+    _mm256_storeu_pd(t + k, tt);
+    mask |= (uint)_mm256_movemask_pd(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+/* widen eight float t values into t[0..7] */
+__attribute__((target("avx2")))
+static void store_t_avx2(double *t, __m256 tt)
+{
+  _mm256_storeu_pd(t, _mm256_cvtps_pd(_mm256_castps256_ps128(tt)));
+  _mm256_storeu_pd(t + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(tt, 1)));
+}
+
+__attribute__((target("avx2")))
+static uint sphere_hits_avx2_f(compiled_scene *cs, uint first, uint n,
+                               vector3 o, vector3 d, double *t)
+{
+  compiled_single *f = cs->single;
+  __m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y);
+  __m256 oz = _mm256_set1_ps(o.z);
+  __m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y);
+  __m256 dz = _mm256_set1_ps(d.z);
+  __m256 zero = _mm256_setzero_ps(), sign = _mm256_set1_ps(-0.0f);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 8) {
+    uint i = first + k;
+    __m256 ax = _mm256_sub_ps(ox, _mm256_loadu_ps(f->sph_cx + i));
+    __m256 ay = _mm256_sub_ps(oy, _mm256_loadu_ps(f->sph_cy + i));
+    __m256 az = _mm256_sub_ps(oz, _mm256_loadu_ps(f->sph_cz + i));
+    __m256 r = _mm256_loadu_ps(f->sph_r + i);
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, dx),
+                                           _mm256_mul_ps(ay, dy)),
+                             _mm256_mul_ps(az, dz));
+    __m256 aa = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, ax),
+                                            _mm256_mul_ps(ay, ay)),
+                              _mm256_mul_ps(az, az));
+    __m256 c = _mm256_sub_ps(aa, _mm256_mul_ps(r, r));
+    __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+    __m256 tt = _mm256_sub_ps(_mm256_xor_ps(b, sign), _mm256_sqrt_ps(disc));
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GT_OQ),
+                               _mm256_cmp_ps(tt, zero, _CMP_GT_OQ));
+    store_t_avx2(t + k, tt);
+    mask |= (uint)_mm256_movemask_ps(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+__attribute__((target("avx2")))
+static uint rect_hits_avx2_f(compiled_scene *cs, uint first, uint n,
+                             vector3 o, vector3 d, double *t)
+{
+  compiled_single *f = cs->single;
+  __m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y);
+  __m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y);
+  __m256 sign = _mm256_set1_ps(-0.0f), zero = _mm256_setzero_ps();
+  __m256 ndz = _mm256_set1_ps(-d.z), noz = _mm256_set1_ps(-o.z);
+  uint mask = 0;
+  for (uint k = 0; k < n; k += 8) {
+    uint i = first + k;
+    __m256 num = _mm256_add_ps(noz, _mm256_loadu_ps(f->rect_z + i));
+    __m256 tt = _mm256_div_ps(_mm256_xor_ps(num, sign), ndz);
+    __m256 x = _mm256_add_ps(ox, _mm256_mul_ps(tt, dx));
+    __m256 y = _mm256_add_ps(oy, _mm256_mul_ps(tt, dy));
+    __m256 hit = _mm256_cmp_ps(tt, zero, _CMP_GT_OQ);
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(x, _mm256_loadu_ps(f->rect_x0 + i),
+                                           _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(x, _mm256_loadu_ps(f->rect_x1 + i),
+                                           _CMP_LE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(y, _mm256_loadu_ps(f->rect_y0 + i),
+                                           _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(y, _mm256_loadu_ps(f->rect_y1 + i),
+                                           _CMP_LE_OQ));
+    store_t_avx2(t + k, tt);
+    mask |= (uint)_mm256_movemask_ps(hit) << k;
+  }
+  return mask & (n >= 32 ? ~0u : (1u << n) - 1);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/* === dispatch === */
+
+typedef struct {
+  char       *name;
+  hit_kernel  spheres;
+  hit_kernel  rects;
+  hit_kernel  spheres_f; /* in single precision */
+  hit_kernel  rects_f;
+} kernel_set;
+
+static kernel_set kernel_sets[] = {
+  { "scalar", sphere_hits_scalar, rect_hits_scalar,
+    sphere_hits_scalar_f, rect_hits_scalar_f },
+#ifdef HAVE_X86_SIMD
+  { "sse2", sphere_hits_sse2, rect_hits_sse2,
+    sphere_hits_sse2_f, rect_hits_sse2_f },
+  { "avx2", sphere_hits_avx2, rect_hits_avx2,
+    sphere_hits_avx2_f, rect_hits_avx2_f },
+#endif
+};
+
+#define NKERNELS (sizeof(kernel_sets) / sizeof(kernel_set))
+
+hit_kernel sphere_hits = sphere_hits_scalar;
+hit_kernel rect_hits = rect_hits_scalar;
+static char *kernel_name = "scalar";
+static int   kernel_single = 0;
+
+static int kernel_supported(kernel_set *k)
+{
+#ifdef HAVE_X86_SIMD
+  if (!strcmp(k->name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+#endif
+  return 1;
+}
+
+/* pick the widest supported kernels, or the ones named by force, in
+ * single precision if single is set */
+void simd_select(char *force, int single)
+{
+  kernel_set *best = &kernel_sets[0];
+  for (uint i = 0; i < NKERNELS; i++) {
+    kernel_set *k = &kernel_sets[i];
+    if (force != NULL && strcmp(force, k->name))
+      continue;
+    if (!kernel_supported(k)) {
+      if (force != NULL) {
+        fprintf(stderr, "simd: %s is not supported on this cpu\n", force);
+        exit(1);
+      }
+      continue;
+    }
+    best = k;
+  }
+  if (force != NULL && strcmp(force, best->name)) {
+    fprintf(stderr, "simd: unknown kernel set \"%s\"\n", force);
+    exit(1);
+  }
+  sphere_hits = single ? best->spheres_f : best->spheres;
+  rect_hits = single ? best->rects_f : best->rects;
+  kernel_name = best->name;
+  kernel_single = single;
+}
+
+char *simd_name()
+{
+  return kernel_name;
+}
+
+int simd_single()
+{
+  return kernel_single;
+}
+
+/* === self check === */
+
+static double urand(unsigned long *state, double lo, double hi)
+{
+  *state = *state * 6364136223846793005UL + 1442695040888963407UL;
+  return lo + (hi - lo) * ((*state >> 11) * (1.0 / 9007199254740992.0));
+}
+
+static int same_t(double a, double b)
+{
+  return a == b || fabs(a - b) <= SIMD_EPSILON * fmax(fabs(a), fabs(b));
+}
+
+/* how many of len objects kernel v hits differently from the scalar
+ * kernel s, or at another t; exactly the same t if exact is set */
+static int mismatches(hit_kernel s, hit_kernel v, compiled_scene *cs,
+                      uint first, uint len, vector3 o, vector3 d, int exact)
+{
+  double ts[32], tv[32];
+  uint ms = s(cs, first, len, o, d, ts);
+  uint mv = v(cs, first, len, o, d, tv);
+  int bad = 0;
+  for (uint j = 0; j < len; j++) {
+    if (((ms ^ mv) >> j & 1) ||
+        ((ms >> j & 1) && (exact ? ts[j] != tv[j] : !same_t(ts[j], tv[j]))))
+      bad++;
+  }
+  return bad;
+}
+
+/* compare every supported kernel set, or only the one named, with the
+ * scalar kernels on random spheres, rectangles and rays, the float
+ * kernels exactly. single is 0 to check the double kernels, 1 the float
+ * ones, and -1 both. a set this build or cpu lacks is skipped; returns
+ * the number of mismatches */
+int simd_self_check(FILE *f, char *only, int single)
+{
+  uint known = only == NULL || !strcmp(only, "scalar");
+  for (uint ki = 1; ki < NKERNELS; ki++)
+    known |= !strcmp(only ? only : "", kernel_sets[ki].name);
+  if (!known) {
+    fprintf(f, "simd check: no %s kernels in this build, skipped\n", only);
+    return 0;
+  }
+  uint n = 29; /* not a multiple of any vector width */
+  object_list *objs = NULL;
+  unsigned long st = 12345;
+  object_list *cells = (object_list*)malloc(sizeof(object_list) * 2 * n);
+  check_malloc("simd_self_check", cells);
+  sphere *sph = (sphere*)malloc(sizeof(sphere) * n);
+  check_malloc("simd_self_check", sph);
+  rectangle *rct = (rectangle*)malloc(sizeof(rectangle) * n);
+  check_malloc("simd_self_check", rct);
+  vector3 *pts = (vector3*)malloc(sizeof(vector3) * 2 * n);
+  check_malloc("simd_self_check", pts);
+  color black = { 0, 0, 0 };
+  for (uint i = 0; i < n; i++) {
+    pts[i].x = urand(&st, -2, 2);
+    pts[i].y = urand(&st, -2, 2);
+    pts[i].z = urand(&st, 2, 8);
+    sph[i].center = &pts[i];
+    sph[i].radius = urand(&st, 0.1, 1.5);
+    sph[i].surf.tag = CONSTANT;
+    sph[i].surf.c.k = &black;
+    sph[i].shine = &black;
+    cells[i].first.tag = SPHERE;
+    cells[i].first.o.s = &sph[i];
+    cells[i].rest = objs;
+    objs = &cells[i];
+    pts[n + i].x = urand(&st, -2, 2);
+    pts[n + i].y = urand(&st, -2, 2);
+    pts[n + i].z = urand(&st, 2, 8);
+    rct[i].upper_left = &pts[n + i];
+    rct[i].w = urand(&st, 0.1, 2);
+    rct[i].h = urand(&st, 0.1, 2);
+    rct[i].surf = sph[i].surf;
+    rct[i].shine = &black;
+    cells[n + i].first.tag = RECTANGLE;
+    cells[n + i].first.o.r = &rct[i];
+    cells[n + i].rest = objs;
+    objs = &cells[n + i];
+  }
+  compiled_scene *cs = compile_scene(objs);
+  cs_build_single(cs);
+
+  int failures = 0;
+  uint rays = 20000;
+  if (only && !strcmp(only, "scalar"))
+    fprintf(f, "simd check: scalar is what the others are checked "
+            "against\n");
+  for (uint ki = 1; ki < NKERNELS; ki++) {
+    kernel_set *k = &kernel_sets[ki];
+    if (only && strcmp(only, k->name))
+      continue;
+    if (!kernel_supported(k)) {
+      fprintf(f, "simd check: %s is not supported on this cpu, skipped\n",
+              k->name);
+      continue;
+    }
+    int bad = 0;
+    for (uint r = 0; r < rays; r++) {
+      vector3 o = { urand(&st, -1, 1), urand(&st, -1, 1), urand(&st, -4, 1) };
+      vector3 d = { urand(&st, -0.5, 0.5), urand(&st, -0.5, 0.5), 1 };
+      double norm = sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+      d.x /= norm;
+      d.y /= norm;
+      d.z /= norm;
+      /* vary the starting offset and length to exercise the tails */
+      uint first = r % 5, len = n - first - r % 7;
+      if (single != 1) {
+        bad += mismatches(sphere_hits_scalar, k->spheres, cs, first, len, o,
+                          d, 0);
+        bad += mismatches(rect_hits_scalar, k->rects, cs, first, len, o, d,
+                          0);
+      }
+      if (single != 0) {
+        bad += mismatches(sphere_hits_scalar_f, k->spheres_f, cs, first, len,
+                          o, d, 1);
+        bad += mismatches(rect_hits_scalar_f, k->rects_f, cs, first, len, o,
+                          d, 1);
+      }
+    }
+    /* double t within SIMD_EPSILON, float t exactly */
+    char how[64];
+    if (single == 1)
+      snprintf(how, sizeof(how), "float exact");
+    else
+      snprintf(how, sizeof(how), "double within epsilon %g%s", SIMD_EPSILON,
+               single < 0 ? ", float exact" : "");
+    fprintf(f, "simd check: %s vs scalar, %s, %u rays: %s (%d mismatches)\n",
+            k->name, how, rays, bad ? "FAILED" : "ok", bad);
+    failures += bad;
+  }
+  compiled_scene_free(cs);
+  free(cells);
+  free(sph);
+  free(rct);
+  free(pts);
+  return failures;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "stats.h"
+
+/* totals of the per-thread counters in stats.h, and the report printed by
+ * --stats. span times are kept in clock ticks and converted to seconds
+ * against the wall clock over the run */
+
+#ifdef RT_STATS
+
+_Thread_local unsigned long stat_count[NSTAT_COUNTERS];
+_Thread_local unsigned long stat_ticks[NSTAT_SPANS];
+
+static unsigned long   total_count[NSTAT_COUNTERS];
+static unsigned long   total_ticks[NSTAT_SPANS];
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long   start_ticks;
+static double          start_time;
+
+int stats_enabled()
+{
+  return 1;
+}
+
+void stats_start()
+{
+  start_time = wall_time();
+  start_ticks = stat_clock();
+}
+
+void stats_flush()
+{
+  pthread_mutex_lock(&totals_lock);
+  for (int i = 0; i < NSTAT_COUNTERS; i++)
+    total_count[i] += stat_count[i];
+  for (int i = 0; i < NSTAT_SPANS; i++)
+    total_ticks[i] += stat_ticks[i];
+  pthread_mutex_unlock(&totals_lock);
+  memset(stat_count, 0, sizeof(stat_count));
+  memset(stat_ticks, 0, sizeof(stat_ticks));
+}
+
+static double per(unsigned long n, unsigned long d)
+{
+  return d > 0 ? (double)n / d : 0;
+}
+
+void stats_report(FILE *f, double output_s)
+{
+  double elapsed = wall_time() - start_time;
+  double hz = elapsed > 0 ? (stat_clock() - start_ticks) / elapsed : 0;
+  double sec[NSTAT_SPANS];
+  pthread_mutex_lock(&totals_lock);
+  unsigned long *c = total_count;
+  for (int i = 0; i < NSTAT_SPANS; i++)
+    sec[i] = hz > 0 ? total_ticks[i] / hz : 0;
+  phase_times pt = phase_times_total();
+  shadow_stats st = shadow_stats_total();
+  /* every closest-hit query, primary, anti-aliasing or reflected, ends in
+   * a hit or a miss */
+  unsigned long closest = c[ST_SPHERE_HITS] + c[ST_RECT_HITS] + c[ST_MISSES];
+  fprintf(f, "{\"primary_rays\":%lu,\"shadow_rays\":%lu,"
+          "\"shadow_cache_hits\":%lu,\"closest_queries\":%lu,"
+          "\"tests_per_closest_query\":%.2f,"
+          "\"nodes_per_closest_query\":%.2f,\"tests_per_shadow_ray\":%.2f,"
+          "\"nodes_per_shadow_ray\":%.2f,\"sphere_hits\":%lu,"
+          "\"rect_hits\":%lu,\"misses\":%lu,\"texture_evals\":%lu,"
+          "\"texture_runs\":%lu,\"function_evals\":%lu,\"specular_evals\":%lu,"
+          "\"lights_behind\":%lu,\"lights_culled\":%lu,\"reflect_rays\":%lu,"
+          "\"trace_thread_s\":%.6f,\"shade_thread_s\":%.6f,"
+          "\"texture_thread_s\":%.6f,\"light_thread_s\":%.6f,"
+          "\"shadow_thread_s\":%.6f,\"output_s\":%.6f}\n",
+          pt.rays, st.rays, st.cache_hits, closest,
+          per(c[ST_CLOSEST_TESTS], closest), per(c[ST_CLOSEST_NODES], closest),
+          per(st.tests, st.rays), per(c[ST_SHADOW_NODES], st.rays),
+          c[ST_SPHERE_HITS], c[ST_RECT_HITS], c[ST_MISSES],
+          c[ST_TEXTURE_LANES], c[ST_TEXTURE_RUNS], c[ST_FUNCTION_CALLS],
+          c[ST_SPECULAR], c[ST_LIGHTS_BEHIND], c[ST_LIGHTS_CULLED],
+          c[ST_REFLECT_RAYS],
+          pt.trace, pt.shade, sec[SP_TEXTURE], sec[SP_LIGHT], sec[SP_SHADOW],
+          output_s);
+  pthread_mutex_unlock(&totals_lock);
+}
+
+#else
+
+int stats_enabled()
+{
+  return 0;
+}
+
+void stats_start()
+{
+}
+
+void stats_flush()
+{
+}
+
+void stats_report(FILE *f, double output_s)
+{
+}
+
+#endif /* RT_STATS */
@@ -0,0 +1,65 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/* instrumentation for --stats. built with -DRT_STATS (make STATS=1) the
+ * STAT_ macros count events and time spans in per-thread arrays that
+ * stats_flush adds to the totals; otherwise they compile to nothing */
+
+enum stat_counter {
+  ST_CLOSEST_TESTS,  /* primitive tests for closest hits */
+  ST_CLOSEST_NODES,  /* bvh nodes visited for closest hits */
+  ST_SHADOW_NODES,   /* bvh nodes visited for shadow rays */
+  ST_SPHERE_HITS,
+  ST_RECT_HITS,
+  ST_MISSES,
+  ST_TEXTURE_LANES,  /* points colored by texture programs */
+  ST_TEXTURE_RUNS,   /* texture program runs over a batch of points */
+  ST_FUNCTION_CALLS, /* C color functions */
+  ST_SPECULAR,       /* highlights computed, each with a pow */
+  ST_LIGHTS_BEHIND,  /* lights skipped as behind the surface */
+  ST_LIGHTS_CULLED,  /* lights skipped as dimmer than --light-cutoff */
+  ST_REFLECT_RAYS,   /* reflected rays traced */
+  NSTAT_COUNTERS
+};
+
+enum stat_span {
+  SP_TEXTURE,        /* the batched texture pass of shade_batch */
+  SP_LIGHT,          /* the lighting pass of shade_batch, shadows included */
+  SP_SHADOW,         /* scene_in_shadow */
+  NSTAT_SPANS
+};
+
+#ifdef RT_STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline unsigned long stat_clock()
+{
+  return __rdtsc();
+}
+#else
+#include <time.h>
+static inline unsigned long stat_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+extern _Thread_local unsigned long stat_count[NSTAT_COUNTERS];
+extern _Thread_local unsigned long stat_ticks[NSTAT_SPANS];
+
+#define STAT_ADD(c, n)  (stat_count[c] += (n))
+#define STAT_BEGIN(v)   unsigned long v = stat_clock()
+#define STAT_END(s, v)  (stat_ticks[s] += stat_clock() - (v))
+
+#else
+
+#define STAT_ADD(c, n)  ((void)(n))
+#define STAT_BEGIN(v)   ((void)0)
+#define STAT_END(s, v)  ((void)0)
+
+#endif /* RT_STATS */
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "utils.h"
+#include "raytracer-project2.h"
+#include "vmath.h"
+#include "stats.h"
+
+/* texture expressions, as written after TEXTURE in a scene file:
+ *
+ *   d = sin((x + y + z) * 16) / 2 + 0.5; rgb(d / 2, d / 1.5, d)
+ *
+ * a texture is a list of bindings followed by rgb(r, g, b). expressions
+ * use + - * / and parentheses, numbers, the hit point x y z, the anchor
+ * cx cy cz (a sphere's centre, a rectangle's upper-left corner, or the
+ * camera for a background), earlier bindings, and the functions below.
+ *
+ * a texture compiles to code for a register machine whose registers each
+ * hold a whole batch of points, so one pass of the interpreter colors up
+ * to TEXTURE_LANES hits and nothing is allocated while rendering.
+ * arithmetic is done in the order written, exactly as C would do it */
+
+#define TEXTURE_REGS  32
+#define TEXTURE_LANES 256
+
+enum tx_op {
+  TX_CONST,
+  TX_NEG, TX_SIN, TX_COS, TX_TAN, TX_ABS, TX_FLOOR, TX_FRACT, TX_SQRT,
+  TX_EXP, TX_LOG,
+  TX_ADD, TX_SUB, TX_MUL, TX_DIV, TX_MIN, TX_MAX, TX_POW, TX_MOD, TX_STEP
+};
+
+typedef struct {
+  unsigned char op;
+  unsigned char dst;
+  unsigned char a;
+  unsigned char b;
+  double        k; /* TX_CONST */
+} tx_instr;
+
+struct texture {
+  tx_instr *code;
+  uint      ncode;
+  uint      out[3]; /* registers holding r, g and b */
+  char     *src;    /* the text it was compiled from */
+  texture  *next;   /* in the registry */
+};
+
+/* ====================================== */
+/* === evaluation                     === */
+/* ====================================== */
+
+static _Thread_local double regs[TEXTURE_REGS][TEXTURE_LANES];
+
+static double fract(double v)
+{
+  return v - floor(v);
+}
+
+static double step(double edge, double v)
+{
+  return v < edge ? 0 : 1;
+}
+
+static double apply1(enum tx_op op, double a)
+{
+  switch (op) {
+  case TX_NEG:   return -a;
+  case TX_SIN:   return sin(a);
+  case TX_COS:   return cos(a);
+  case TX_TAN:   return tan(a);
+  case TX_ABS:   return fabs(a);
+  case TX_FLOOR: return floor(a);
+  case TX_FRACT: return fract(a);
+  case TX_SQRT:  return sqrt(a);
+  case TX_EXP:   return exp(a);
+  case TX_LOG:   return log(a);
+  default:       return 0;
+  }
+}
+
+static double apply2(enum tx_op op, double a, double b)
+{
+  switch (op) {
+  case TX_ADD:  return a + b;
+  case TX_SUB:  return a - b;
+  case TX_MUL:  return a * b;
+  case TX_DIV:  return a / b;
+  case TX_MIN:  return fmin(a, b);
+  case TX_MAX:  return fmax(a, b);
+  case TX_POW:  return pow(a, b);
+  case TX_MOD:  return fmod(a, b);
+  case TX_STEP: return step(a, b);
+  default:      return 0;
+  }
+}
+
+/* one instruction over m lanes; the arithmetic ops get loops of their own
+ * so the compiler can vectorize them */
+static void run(tx_instr *i, double **reg, uint m)
+{
+  double *d = reg[i->dst], *a = reg[i->a], *b = reg[i->b];
+  switch (i->op) {
+  case TX_CONST:
+    for (uint k = 0; k < m; k++)
+      d[k] = i->k;
+    break;
+  case TX_ADD:
+    for (uint k = 0; k < m; k++)
+      d[k] = a[k] + b[k];
+    break;
+  case TX_SUB:
+    for (uint k = 0; k < m; k++)
+      d[k] = a[k] - b[k];
+    break;
+  case TX_MUL:
+    for (uint k = 0; k < m; k++)
+      d[k] = a[k] * b[k];
+    break;
+  case TX_DIV:
+    for (uint k = 0; k < m; k++)
+      d[k] = a[k] / b[k];
+    break;
+  case TX_NEG:
+    for (uint k = 0; k < m; k++)
+      d[k] = -a[k];
+    break;
+  case TX_SIN: case TX_COS: case TX_TAN: case TX_ABS: case TX_FLOOR:
+  case TX_FRACT: case TX_SQRT: case TX_EXP: case TX_LOG:
+    for (uint k = 0; k < m; k++)
+      d[k] = apply1(i->op, a[k]);
+    break;
+  default:
+    for (uint k = 0; k < m; k++)
+      d[k] = apply2(i->op, a[k], b[k]);
+    break;
+  }
+}
+
+void texture_eval(texture *t, uint n, double *in[TX_INPUTS], color *out)
+{
+  double *reg[TEXTURE_REGS];
+  STAT_ADD(ST_TEXTURE_LANES, n);
+  STAT_ADD(ST_TEXTURE_RUNS, 1);
+  for (uint base = 0; base < n; base += TEXTURE_LANES) {
+    uint m = n - base < TEXTURE_LANES ? n - base : TEXTURE_LANES;
+    for (uint r = 0; r < TEXTURE_REGS; r++)
+      reg[r] = r < TX_INPUTS ? in[r] + base : regs[r];
+    for (uint i = 0; i < t->ncode; i++)
+      run(&t->code[i], reg, m);
+    double *r = reg[t->out[0]], *g = reg[t->out[1]], *b = reg[t->out[2]];
+    for (uint k = 0; k < m; k++)
+      out[base + k] = col(r[k], g[k], b[k]);
+  }
+}
+
+color texture_eval1(texture *t, vector3 anchor, vector3 point)
+{
+  double v[TX_INPUTS] = { point.x, point.y, point.z,
+                          anchor.x, anchor.y, anchor.z };
+  double *in[TX_INPUTS] = { &v[0], &v[1], &v[2], &v[3], &v[4], &v[5] };
+  color c;
+  texture_eval(t, 1, in, &c);
+  return c;
+}
+
+/* ====================================== */
+/* === compiler                       === */
+/* ====================================== */
+
+/* a compiled subexpression: a constant, folded at compile time, or the
+ * register holding its value */
+typedef struct {
+  int    is_const;
+  double k;
+  uint   reg;
+} val;
+
+typedef struct {
+  char  *name;
+  size_t len;
+  val    v;
+} binding;
+
+typedef struct {
+  const char *src;
+  const char *p;
+  tx_instr   *code;
+  uint        ncode;
+  uint        cap;
+  uint        fixed;  /* registers below this hold inputs and bindings */
+  uint        top;    /* next free register */
+  binding     vars[TEXTURE_REGS];
+  uint        nvars;
+  char       *err;
+  size_t      errlen;
+  int         failed;
+} compiler;
+
+static void fail(compiler *c, const char *msg)
+{
+  if (!c->failed)
+    snprintf(c->err, c->errlen, "%s at column %d", msg,
+             (int)(c->p - c->src) + 1);
+  c->failed = 1;
+}
+
+static void skip_space(compiler *c)
+{
+  while (*c->p == ' ' || *c->p == '\t' || *c->p == '\r')
+    c->p++;
+}
+
+static int accept(compiler *c, char ch)
+{
+  skip_space(c);
+  if (*c->p != ch)
+    return 0;
+  c->p++;
+  return 1;
+}
+
+static void expect(compiler *c, char ch)
+{
+  if (!accept(c, ch)) {
+    char msg[32];
+    snprintf(msg, sizeof(msg), "expected '%c'", ch);
+    fail(c, msg);
+  }
+}
+
+static int is_ident(char ch, int first)
+{
+  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_' ||
+    (!first && ch >= '0' && ch <= '9');
+}
+
+/* the identifier at c->p, or 0 if there is none */
+static size_t ident(compiler *c)
+{
+  skip_space(c);
+  size_t n = 0;
+  while (is_ident(c->p[n], n == 0))
+    n++;
+  return n;
+}
+
+static uint new_reg(compiler *c)
+{
+  if (c->top >= TEXTURE_REGS) {
+    fail(c, "expression too complex");
+    return 0;
+  }
+  return c->top++;
+}
+
+static void emit(compiler *c, enum tx_op op, uint dst, uint a, uint b,
+                 double k)
+{
+  if (c->ncode == c->cap) {
+    c->cap = c->cap ? 2 * c->cap : 16;
+    c->code = (tx_instr*)realloc(c->code, c->cap * sizeof(tx_instr));
+    check_malloc("texture_compile", c->code);
+  }
+  tx_instr *i = &c->code[c->ncode++];
+  i->op = op;
+  i->dst = dst;
+  i->a = a;
+  i->b = b;
+  i->k = k;
+}
+
+static val constant(double k)
+{
+  val v = { 1, k, 0 };
+  return v;
+}
+
+static val in_reg(uint r)
+{
+  val v = { 0, 0, r };
+  return v;
+}
+
+/* the register holding v, loading it first if it is a constant */
+static uint materialize(compiler *c, val v)
+{
+  if (!v.is_const)
+    return v.reg;
+  uint r = new_reg(c);
+  emit(c, TX_CONST, r, 0, 0, v.k);
+  return r;
+}
+
+/* operands are computed above mark; the result takes the first free
+ * register from mark on, which the operands no longer need */
+static val op1(compiler *c, enum tx_op op, val a, uint mark)
+{
+  if (a.is_const)
+    return constant(apply1(op, a.k));
+  c->top = mark;
+  uint r = new_reg(c);
+  emit(c, op, r, a.reg, 0, 0);
+  return in_reg(r);
+}
+
+static val op2(compiler *c, enum tx_op op, val a, val b, uint mark)
+{
+  if (a.is_const && b.is_const)
+    return constant(apply2(op, a.k, b.k));
+  uint ra = materialize(c, a);
+  uint rb = materialize(c, b);
+  c->top = mark;
+  uint r = new_reg(c);
+  emit(c, op, r, ra, rb, 0);
+  return in_reg(r);
+}
+
+static val expr(compiler *c);
+
+static const struct {
+  const char *name;
+  enum tx_op  op;
+  int         nargs; /* 1 or 2; clamp and mix are built from these */
+} functions[] = {
+  { "sin", TX_SIN, 1 },     { "cos", TX_COS, 1 },     { "tan", TX_TAN, 1 },
+  { "abs", TX_ABS, 1 },     { "floor", TX_FLOOR, 1 }, { "fract", TX_FRACT, 1 },
+  { "sqrt", TX_SQRT, 1 },   { "exp", TX_EXP, 1 },     { "log", TX_LOG, 1 },
+  { "min", TX_MIN, 2 },     { "max", TX_MAX, 2 },     { "pow", TX_POW, 2 },
+  { "mod", TX_MOD, 2 },     { "step", TX_STEP, 2 }
+};
+
+static const char *inputs[TX_INPUTS] = { "x", "y", "z", "cx", "cy", "cz" };
+
+static int word_is(const char *p, size_t n, const char *w)
+{
+  return strlen(w) == n && !memcmp(p, w, n);
+}
+
+static val call(compiler *c, const char *name, size_t n)
+{
+  uint mark = c->top;
+  val a[3];
+  int nargs = 0;
+  if (!accept(c, ')')) {
+    do {
+      if (nargs == 3) {
+        fail(c, "too many arguments");
+        return constant(0);
+      }
+      a[nargs++] = expr(c);
+    } while (accept(c, ','));
+    expect(c, ')');
+  }
+  if (word_is(name, n, "clamp") && nargs == 3) {
+    /* clamp(v, lo, hi) = min(max(v, lo), hi) */
+    val lo = op2(c, TX_MAX, a[0], a[1], mark);
+    return op2(c, TX_MIN, lo, a[2], mark);
+  }
+  if (word_is(name, n, "mix") && nargs == 3) {
+    /* mix(a, b, t) = a + (b - a) * t, working above the arguments */
+    uint keep = c->top;
+    val d = op2(c, TX_SUB, a[1], a[0], keep);
+    val s = op2(c, TX_MUL, d, a[2], keep);
+    return op2(c, TX_ADD, a[0], s, mark);
+  }
+  for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+    if (word_is(name, n, functions[i].name)) {
+      if (nargs != functions[i].nargs)
+        break;
+      if (nargs == 1)
+        return op1(c, functions[i].op, a[0], mark);
+      return op2(c, functions[i].op, a[0], a[1], mark);
+    }
+  }
+  fail(c, "unknown function or wrong number of arguments");
+  return constant(0);
+}
+
+static val primary(compiler *c)
+{
+  skip_space(c);
+  if (accept(c, '(')) {
+    val v = expr(c);
+    expect(c, ')');
+    return v;
+  }
+  if ((*c->p >= '0' && *c->p <= '9') || *c->p == '.') {
+    char *end;
+    double k = strtod(c->p, &end);
+    if (end == c->p) {
+      fail(c, "bad number");
+      return constant(0);
+    }
+    c->p = end;
+    return constant(k);
+  }
+  size_t n = ident(c);
+  if (n == 0) {
+    fail(c, "expected an expression");
+    return constant(0);
+  }
+  const char *name = c->p;
+  c->p += n;
+  if (accept(c, '('))
+    return call(c, name, n);
+  for (uint i = c->nvars; i-- > 0; )
+    if (c->vars[i].len == n && !memcmp(c->vars[i].name, name, n))
+      return c->vars[i].v;
+  for (uint i = 0; i < TX_INPUTS; i++)
+    if (word_is(name, n, inputs[i]))
+      return in_reg(i);
+  c->p = name;
+  fail(c, "unknown name");
+  return constant(0);
+}
+
+static val unary(compiler *c)
+{
+  if (accept(c, '-')) {
+    uint mark = c->top;
+    return op1(c, TX_NEG, unary(c), mark);
+  }
+  return primary(c);
+}
+
+static val term(compiler *c)
+{
+  uint mark = c->top;
+  val v = unary(c);
+  for (;;) {
+    enum tx_op op;
+    if (accept(c, '*'))
+      op = TX_MUL;
+    else if (accept(c, '/'))
+      op = TX_DIV;
+    else
+      return v;
+    v = op2(c, op, v, unary(c), mark);
+  }
+}
+
+static val expr(compiler *c)
+{
+  uint mark = c->top;
+  val v = term(c);
+  for (;;) {
+    enum tx_op op;
+    if (accept(c, '+'))
+      op = TX_ADD;
+    else if (accept(c, '-'))
+      op = TX_SUB;
+    else
+      return v;
+    v = op2(c, op, v, term(c), mark);
+  }
+}
+
+/* ====================================== */
+/* === registry                       === */
+/* ====================================== */
+
+/* compiled textures are shared by every scene that uses the same program,
+ * so materials compare by pointer and scenes can be freed in any order */
+static texture *registry = NULL;
+
+static int same_code(texture *a, texture *b)
+{
+  if (a->ncode != b->ncode || memcmp(a->out, b->out, sizeof(a->out)))
+    return 0;
+  for (uint i = 0; i < a->ncode; i++) {
+    tx_instr *p = &a->code[i], *q = &b->code[i];
+    if (p->op != q->op || p->dst != q->dst || p->a != q->a || p->b != q->b ||
+        memcmp(&p->k, &q->k, sizeof(double)))
+      return 0;
+  }
+  return 1;
+}
+
+static texture *intern(texture *t)
+{
+  for (texture *u = registry; u; u = u->next) {
+    if (same_code(u, t)) {
+      free(t->code);
+      free(t->src);
+      free(t);
+      return u;
+    }
+  }
+  t->next = registry;
+  registry = t;
+  return t;
+}
+
+void textures_free()
+{
+  while (registry) {
+    texture *next = registry->next;
+    free(registry->code);
+    free(registry->src);
+    free(registry);
+    registry = next;
+  }
+}
+
+texture *texture_compile(const char *src, size_t len, char *err,
+                         size_t errlen)
+{
+  char *text = (char*)malloc(len + 1);
+  check_malloc("texture_compile", text);
+  memcpy(text, src, len);
+  text[len] = '\0';
+  compiler c;
+  memset(&c, 0, sizeof(compiler));
+  c.src = text;
+  c.p = text;
+  c.fixed = TX_INPUTS;
+  c.top = TX_INPUTS;
+  c.err = err;
+  c.errlen = errlen;
+  uint out[3];
+  int done = 0;
+  while (!c.failed && !done) {
+    size_t n = ident(&c);
+    const char *name = c.p;
+    c.p += n;
+    if (n > 0 && accept(&c, '=')) {
+      val v = expr(&c);
+      if (!v.is_const && v.reg >= c.fixed)
+        c.fixed = v.reg + 1; /* keep the result for later uses */
+      c.top = c.fixed;
+      if (c.nvars == TEXTURE_REGS) {
+        fail(&c, "too many bindings");
+        break;
+      }
+      c.vars[c.nvars].name = (char*)name;
+      c.vars[c.nvars].len = n;
+      c.vars[c.nvars].v = v;
+      c.nvars++;
+      if (!accept(&c, ';'))
+        fail(&c, "expected ';'");
+    } else if (word_is(name, n, "rgb") && accept(&c, '(')) {
+      for (int i = 0; i < 3; i++) {
+        if (i > 0)
+          expect(&c, ',');
+        val v = expr(&c);
+        out[i] = materialize(&c, v);
+        c.top = c.top > out[i] + 1 ? c.top : out[i] + 1;
+      }
+      expect(&c, ')');
+      accept(&c, ';');
+      skip_space(&c);
+      if (*c.p != '\0')
+        fail(&c, "unexpected text after rgb(...)");
+      done = 1;
+    } else {
+      c.p = name;
+      fail(&c, "expected a binding or rgb(r, g, b)");
+    }
+  }
+  if (c.failed) {
+    free(text);
+    free(c.code);
+    return NULL;
+  }
+  texture *t = (texture*)malloc(sizeof(texture));
+  check_malloc("texture_compile", t);
+  t->code = c.code;
+  t->ncode = c.ncode;
+  memcpy(t->out, out, sizeof(out));
+  t->src = text;
+  return intern(t);
+}
+
+const char *texture_source(texture *t)
+{
+  return t->src;
+}
+
+/* the functional colors of main.c, written as textures; each does the
+ * same arithmetic in the same order, so the images are identical */
+static const struct {
+  const char *name;
+  const char *src;
+} builtins[] = {
+  { "fn1", "r = sin((x + y + z) * 16); d = r / 2 + 0.5; "
+           "rgb(d / 2, d / 1.5, d)" },
+  { "fn2", "r = cos((x + y * z) * 2); d = r / 2 + 0.5; "
+           "rgb(1, d / 1.5, d / 1.1)" },
+  { "sunset", "grad = (1 - -y) / 2; rgb((1 - grad) / 1.5, 0, grad / 2)" }
+};
+
+texture *texture_builtin(const char *name, size_t len)
+{
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (word_is(name, len, builtins[i].name)) {
+      char err[128];
+      return texture_compile(builtins[i].src, strlen(builtins[i].src), err,
+                             sizeof(err));
+    }
+  }
+  return NULL;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include "utils.h"
 
 void todo(char *function_name)
@@ -15,3 +16,109 @@ void check_malloc(char *function_name, void *h)
     exit(1);
   }
 }
+
+double wall_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* blocks grow geometrically up to this size; larger requests get a block
+ * of their own */
+#define ARENA_MAX_BLOCK ((size_t)64 << 20)
+#define ARENA_ALIGN 16
+
+typedef struct arena_block arena_block;
+struct arena_block {
+  arena_block *next;
+  size_t       size;
+  size_t       used;
+  size_t       pad; /* keeps data 16-byte aligned */
+  char         data[];
+};
+
+struct arena {
+  arena_block *head; /* the block being filled */
+  size_t       next_size;
+  size_t       bytes;
+};
+
+static arena_block *arena_block_new(size_t size)
+{
+  arena_block *b = (arena_block*)malloc(sizeof(arena_block) + size);
+  check_malloc("arena_alloc", b);
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+arena *arena_new(size_t block_size)
+{
+  arena *a = (arena*)malloc(sizeof(arena));
+  check_malloc("arena_new", a);
+  a->head = NULL;
+  a->next_size = block_size < 256 ? 256 : block_size;
+  a->bytes = 0;
+  return a;
+}
+
+void *arena_alloc(arena *a, size_t n)
+{
+  n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  arena_block *b = a->head;
+  if (!b || b->size - b->used < n) {
+    size_t size = a->next_size;
+    if (size < ARENA_MAX_BLOCK)
+      a->next_size = 2 * size;
+    b = arena_block_new(n > size ? n : size);
+    b->next = a->head;
+    a->head = b;
+  }
+  void *p = b->data + b->used;
+  b->used += n;
+  a->bytes += n;
+  return p;
+}
+
+int arena_owns(arena *a, void *p)
+{
+  for (arena_block *b = a->head; b; b = b->next)
+    if ((char*)p >= b->data && (char*)p < b->data + b->used)
+      return 1;
+  return 0;
+}
+
+size_t arena_bytes(arena *a)
+{
+  return a->bytes;
+}
+
+void arena_reset(arena *a)
+{
+  arena_block *b = a->head;
+  if (!b)
+    return;
+  /* keep the newest block, which is usually the largest */
+  arena_block *rest = b->next;
+  while (rest) {
+    arena_block *next = rest->next;
+    free(rest);
+    rest = next;
+  }
+  b->next = NULL;
+  b->used = 0;
+  a->bytes = 0;
+}
+
+void arena_free(arena *a)
+{
+  arena_block *b = a->head;
+  while (b) {
+    arena_block *next = b->next;
+    free(b);
+    b = next;
+  }
+  free(a);
+}
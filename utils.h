@@ -9,4 +9,18 @@ void todo(char *function_name);
 /* check_malloc: if pointer is NULL, print a message to stderr and exit(1) */
 void check_malloc(char *function_name, void *h);
 
+/* wall_time: monotonic clock reading in seconds, for timing phases */
+double wall_time();
+
+/* arena: a bump allocator over a chain of large blocks. everything
+ * allocated from an arena is released at once by arena_reset or arena_free */
+#include <stddef.h>
+typedef struct arena arena;
+arena *arena_new(size_t block_size);
+void  *arena_alloc(arena *a, size_t n);  /* 16-byte aligned, never NULL */
+int    arena_owns(arena *a, void *p);
+size_t arena_bytes(arena *a);           /* bytes handed out so far */
+void   arena_reset(arena *a);           /* keeps one block for reuse */
+void   arena_free(arena *a);
+
 #endif /* _UTILS_H_ */
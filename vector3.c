@@ -4,6 +4,7 @@
 #include <math.h>
 #include "utils.h"
 #include "raytracer-project2.h"
+#include "vmath.h"
 
 vector3 *vector3_new(double x, double y, double z)
 {
@@ -15,40 +16,45 @@ vector3 *vector3_new(double x, double y, double z)
   return v;
 }
 
+/* heap copy of a by-value vector, for the pointer-based operations below */
+vector3 *vector3_box(vector3 v)
+{
+  return vector3_new(v.x, v.y, v.z);
+}
+
 vector3 *vector3_add(vector3 *v1, vector3 *v2)
 {
-  return vector3_new(v1->x + v2->x, v1->y + v2->y, v1->z + v2->z);
+  return vector3_box(v3_add(*v1, *v2));
 }
 
 vector3 *vector3_sub(vector3 *v1, vector3 *v2)
 {
-  return vector3_new(v1->x - v2->x, v1->y - v2->y, v1->z - v2->z);
+  return vector3_box(v3_sub(*v1, *v2));
 }
 
 vector3 *vector3_negate(vector3 *v)
 {
-  return vector3_new(-(v->x), -(v->y), -(v->z));
+  return vector3_box(v3_negate(*v));
 }
 
 vector3 *vector3_scale(double scalar, vector3 *v)
 {
-  return vector3_new(scalar * (v->x), scalar * (v->y), scalar * (v->z));
+  return vector3_box(v3_scale(scalar, *v));
 }
 
 double vector3_dot(vector3 *v1, vector3 *v2)
 {
-  return (v1->x) * (v2->x) + (v1->y) * (v2->y) + (v1->z) * (v2->z);
+  return v3_dot(*v1, *v2);
 }
 
 double vector3_magnitude(vector3 *v)
 {
-  return sqrt((v->x) * (v->x) + (v->y) * (v->y) + (v->z) * (v->z));
+  return v3_magnitude(*v);
 }
 
 vector3 *vector3_normalize(vector3 *v)
 {
-  double norm = vector3_magnitude(v);
-  return vector3_new((v->x) / norm, (v->y) / norm, (v->z) / norm);
+  return vector3_box(v3_normalize(*v));
 }
 
 char *vector_format = "<%lf,%lf,%lf>";
@@ -67,8 +73,5 @@ void vector3_show(FILE *f, vector3 *v)
 
 void vector3_normify(vector3 *v)
 {
-  double norm = vector3_magnitude(v);
-  v->x /= norm;
-  v->y /= norm;
-  v->z /= norm;
+  *v = v3_normalize(*v);
 }
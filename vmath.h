@@ -0,0 +1,120 @@
+#ifndef __VMATH_H__
+#define __VMATH_H__
+
+#include <math.h>
+#include "raytracer-project2.h"
+
+/* by-value vector, color and ray operations: nothing here allocates, and
+ * every result fits in registers. the heap-returning operations in
+ * vector3.c, color.c and ray3.c are thin wrappers around these, and they
+ * perform the same arithmetic in the same order so results are bit-equal */
+
+/* === vector3 === */
+
+static inline vector3 v3(double x, double y, double z)
+{
+  vector3 v = { x, y, z };
+  return v;
+}
+
+static inline vector3 v3_add(vector3 a, vector3 b)
+{
+  return v3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+static inline vector3 v3_sub(vector3 a, vector3 b)
+{
+  return v3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+static inline vector3 v3_negate(vector3 v)
+{
+  return v3(-v.x, -v.y, -v.z);
+}
+
+static inline vector3 v3_scale(double scalar, vector3 v)
+{
+  return v3(scalar * v.x, scalar * v.y, scalar * v.z);
+}
+
+static inline double v3_dot(vector3 a, vector3 b)
+{
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline vector3 v3_cross(vector3 a, vector3 b)
+{
+  return v3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x);
+}
+
+static inline double v3_magnitude(vector3 v)
+{
+  return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+static inline vector3 v3_normalize(vector3 v)
+{
+  double norm = v3_magnitude(v);
+  return v3(v.x / norm, v.y / norm, v.z / norm);
+}
+
+/* === color === */
+
+static inline color col(double r, double g, double b)
+{
+  color c = { r, g, b };
+  return c;
+}
+
+/* add and scale clamp each channel to 1, modulate cannot leave [0,1] */
+static inline color col_add(color c1, color c2)
+{
+  double r0 = c1.r + c2.r;
+  double g0 = c1.g + c2.g;
+  double b0 = c1.b + c2.b;
+  return col(r0 > 1 ? 1 : r0, g0 > 1 ? 1 : g0, b0 > 1 ? 1 : b0);
+}
+
+static inline color col_modulate(color c1, color c2)
+{
+  return col(c1.r * c2.r, c1.g * c2.g, c1.b * c2.b);
+}
+
+static inline color col_scale(double scalar, color c)
+{
+  double r0 = c.r * scalar;
+  double g0 = c.g * scalar;
+  double b0 = c.b * scalar;
+  return col(r0 > 1 ? 1 : r0, g0 > 1 ? 1 : g0, b0 > 1 ? 1 : b0);
+}
+
+/* round a channel on [0,1] to the nearest 8-bit value */
+static inline unsigned char channel_byte(double v)
+{
+  if (!(v > 0))
+    return 0;
+  if (v >= 1)
+    return 255;
+  return (unsigned char)(v * 255 + 0.5);
+}
+
+/* === ray3v === */
+
+static inline ray3v ray3v_make(vector3 origin, vector3 direction)
+{
+  ray3v r = { origin, direction };
+  return r;
+}
+
+static inline ray3v ray3v_of(ray3 *r)
+{
+  return ray3v_make(*r->origin, *r->direction);
+}
+
+static inline vector3 ray3v_position(ray3v r, double t)
+{
+  return v3_add(r.origin, v3_scale(t, r.direction));
+}
+
+#endif /* __VMATH_H__ */